@@ -4,16 +4,45 @@
 #define AVIF_LOADER_H
 
 #include <Imlib2.h>
+#include <stddef.h>
 
-Imlib_Image loadAvif(const char *path);
+// Reports the full image size and asks for the smallest size the decode
+// must still cover.
+typedef void (*AvifFitFn)(void *user, int srcW, int srcH, int *needW, int *needH);
+
+Imlib_Image loadAvif(const char *path, AvifFitFn fit, void *user);
+DATA32 *loadAvifPixels(const char *path, AvifFitFn fit, void *user, int *width, int *height, int *hasAlpha);
+int avifProbe(const char *path, int *width, int *height, size_t *planeBytes, int *canShrink);
+
+// Decoder for animated AVIF; frames come out in order and loop at the end.
+typedef struct AvifSequence AvifSequence;
+
+typedef struct
+{
+    const DATA32 *pixels; // BGRA; valid until the next avifSequenceNext call.
+    int width;
+    int height;
+    int hasAlpha;
+    double duration; // Seconds.
+} AvifFrame;
+
+int avifIsSequence(const char *path);
+AvifSequence *avifSequenceOpen(const char *path);
+int avifSequenceCount(const AvifSequence *seq);
+int avifSequenceNext(AvifSequence *seq, AvifFrame *frame);
+void avifSequenceClose(AvifSequence *seq);
 
 #ifdef AVIF_LOADER_IMPLEMENTATION
 
 #include <avif/avif.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "pixbuf.h"
+
 // Falls back to 1 if core count can't be determined;
 // used for parallel decoding.
 static int getCpuCount(void)
@@ -26,20 +55,14 @@ static int getCpuCount(void)
 #endif
 }
 
-// Loads an AVIF image from disk and decodes to BGRA via libavif;
-// returns an Imlib2 image.
-Imlib_Image loadAvif(const char *path)
+// Creates a dav1d-backed decoder and parses path. Returns NULL on failure.
+static avifDecoder *avifOpenDecoder(const char *path)
 {
-    avifDecoder *dec = NULL;
-    avifRGBImage rgb;
-    Imlib_Image im = NULL;
-    int pixelsAlloc = 0;
-
-    dec = avifDecoderCreate();
+    avifDecoder *dec = avifDecoderCreate();
     if (!dec)
     {
         fprintf(stderr, "avifDecoderCreate failed\n");
-        goto cleanup;
+        return NULL;
     }
 
     // Ensure the dav1d decoder is present. Aborts if unavailable.
@@ -47,7 +70,8 @@ Imlib_Image loadAvif(const char *path)
     if (!avifCodecName(AVIF_CODEC_CHOICE_DAV1D, AVIF_CODEC_FLAG_CAN_DECODE))
     {
         fprintf(stderr, "dav1d not available at runtime\n");
-        goto cleanup;
+        avifDecoderDestroy(dec);
+        return NULL;
     }
     dec->codecChoice = AVIF_CODEC_CHOICE_DAV1D;
 
@@ -55,12 +79,108 @@ Imlib_Image loadAvif(const char *path)
     if (r != AVIF_RESULT_OK)
     {
         fprintf(stderr, "AVIF I/O error: %s\n", avifResultToString(r));
-        goto cleanup;
+        avifDecoderDestroy(dec);
+        return NULL;
     }
 
     if ((r = avifDecoderParse(dec)) != AVIF_RESULT_OK)
     {
         fprintf(stderr, "AVIF parse error: %s\n", avifResultToString(r));
+        avifDecoderDestroy(dec);
+        return NULL;
+    }
+    return dec;
+}
+
+// Sets rgb up as a packed 8-bit BGRA image of y's size and allocates its
+// pixels with pixbufAlloc. Returns 0 on overflow or allocation failure.
+static int avifAllocRGB(avifRGBImage *rgb, const avifImage *y)
+{
+    avifRGBImageSetDefaults(rgb, y);
+    rgb->format = AVIF_RGB_FORMAT_BGRA;
+    rgb->depth = 8;
+
+    // Check for integer overflow in image dimensions.
+    size_t totalPixels = (size_t)rgb->width * (size_t)rgb->height;
+    if (rgb->width != 0 && totalPixels / rgb->width != (size_t)rgb->height)
+    {
+        fprintf(stderr, "Image dimensions overflow\n");
+        return 0;
+    }
+    if (totalPixels > SIZE_MAX / 4 || rgb->width > UINT32_MAX / 4)
+    {
+        fprintf(stderr, "Image size overflow\n");
+        return 0;
+    }
+
+    // Imlib2 wants tightly packed rows; the alignment is for the scaler.
+    rgb->rowBytes = rgb->width * 4;
+    rgb->pixels = pixbufAlloc(totalPixels * 4);
+    if (!rgb->pixels)
+    {
+        fprintf(stderr, "AVIF pixel alloc failed\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Reads the size of an AVIF image from its header without decoding it,
+// plus the bytes of the YUV and alpha planes a decode allocates at full
+// size. canShrink says whether the RGB conversion can run at a smaller
+// size (libavif 1.0 with libyuv). Returns 0 if the file can't be parsed.
+int avifProbe(const char *path, int *width, int *height, size_t *planeBytes, int *canShrink)
+{
+    avifDecoder *dec = avifOpenDecoder(path);
+    if (!dec)
+    {
+        return 0;
+    }
+
+    const avifImage *y = dec->image;
+    const size_t pixels = (size_t)y->width * y->height;
+    const size_t sample = (y->depth > 8) ? 2 : 1;
+    size_t quarters; // Luma and chroma planes, in quarters of the luma one.
+    switch (y->yuvFormat)
+    {
+    case AVIF_PIXEL_FORMAT_YUV444:
+        quarters = 12;
+        break;
+    case AVIF_PIXEL_FORMAT_YUV422:
+        quarters = 8;
+        break;
+    case AVIF_PIXEL_FORMAT_YUV420:
+        quarters = 6;
+        break;
+    default:
+        quarters = 4;
+        break;
+    }
+    *planeBytes = (pixels * sample * quarters / 4) + (dec->alphaPresent ? pixels * sample : 0);
+    *width = (int)y->width;
+    *height = (int)y->height;
+#if AVIF_VERSION >= 1000000
+    *canShrink = avifLibYUVVersion() != 0;
+#else
+    *canShrink = 0;
+#endif
+    avifDecoderDestroy(dec);
+    return *width > 0 && *height > 0;
+}
+
+// Decodes an AVIF image from disk to BGRA via libavif, shrunk to what fit
+// asks for when it is smaller. Touches no Imlib2 state, so decodes can run
+// on several threads; the pixels are released with pixbufFree(). Returns
+// NULL on failure.
+DATA32 *loadAvifPixels(const char *path, AvifFitFn fit, void *user, int *width, int *height, int *hasAlpha)
+{
+    avifRGBImage rgb;
+    DATA32 *pixels = NULL;
+    int pixelsAlloc = 0;
+    avifResult r;
+
+    avifDecoder *dec = avifOpenDecoder(path);
+    if (!dec)
+    {
         goto cleanup;
     }
 
@@ -71,13 +191,26 @@ Imlib_Image loadAvif(const char *path)
     }
 
     avifImage *y = dec->image;
-    avifRGBImageSetDefaults(&rgb, y);
-    rgb.format = AVIF_RGB_FORMAT_BGRA;
-    rgb.depth = 8;
 
-    if ((r = avifRGBImageAllocatePixels(&rgb)) != AVIF_RESULT_OK)
+#if AVIF_VERSION >= 1000000
+    // Shrink the YUV planes first (libyuv box filter), so the RGB conversion
+    // below never materialises a full-resolution BGRA buffer.
+    if (fit)
+    {
+        int needW = (int)y->width;
+        int needH = (int)y->height;
+        fit(user, (int)y->width, (int)y->height, &needW, &needH);
+        if (needW > 0 && needH > 0 && (uint32_t)needW < y->width && (uint32_t)needH < y->height)
+        {
+            // Fails when libavif lacks libyuv; the image is then left at
+            // full size and converted as before.
+            (void)avifImageScale(y, (uint32_t)needW, (uint32_t)needH, &dec->diag);
+        }
+    }
+#endif
+
+    if (!avifAllocRGB(&rgb, y))
     {
-        fprintf(stderr, "AVIF pixel alloc error: %s\n", avifResultToString(r));
         goto cleanup;
     }
     pixelsAlloc = 1;
@@ -88,37 +221,132 @@ Imlib_Image loadAvif(const char *path)
         goto cleanup;
     }
 
-    // Check for integer overflow in image dimensions.
-    size_t totalPixels = (size_t)rgb.width * (size_t)rgb.height;
-    if (rgb.width != 0 && totalPixels / rgb.width != (size_t)rgb.height)
-    {
-        fprintf(stderr, "Image dimensions overflow\n");
-        goto cleanup;
-    }
-    size_t totalBytes = totalPixels * 4;
-    if (totalBytes > SIZE_MAX)
+    pixels = (DATA32 *)rgb.pixels;
+    pixelsAlloc = 0;
+    *width = (int)rgb.width;
+    *height = (int)rgb.height;
+    *hasAlpha = dec->alphaPresent ? 1 : 0;
+
+cleanup:
+    if (pixelsAlloc)
+        pixbufFree(rgb.pixels);
+    if (dec)
+        avifDecoderDestroy(dec);
+    return pixels;
+}
+
+// Loads an AVIF image from disk and decodes to BGRA via libavif;
+// returns an Imlib2 image, shrunk to what fit asks for when it is smaller.
+Imlib_Image loadAvif(const char *path, AvifFitFn fit, void *user)
+{
+    int width;
+    int height;
+    int hasAlpha;
+    DATA32 *pixels = loadAvifPixels(path, fit, user, &width, &height, &hasAlpha);
+    if (!pixels)
     {
-        fprintf(stderr, "Image size overflow\n");
-        goto cleanup;
+        return NULL;
     }
 
-    // Create Imlib2 image using decoded BGRA pixel data.
-    im = imlib_create_image_using_data(rgb.width, rgb.height, (DATA32 *)rgb.pixels);
-    // fuck you enlightenment
+    // The image takes ownership and frees the buffer through pixbufMemory.
+    Imlib_Image im = imlib_create_image_using_data_and_memory_function(width, height, pixels, pixbufMemory);
     if (!im)
     {
         fprintf(stderr, "Imlib image alloc failed\n");
-        goto cleanup;
+        pixbufFree(pixels);
+        return NULL;
     }
 
-    pixelsAlloc = 0;
+    imlib_context_set_image(im);
+    imlib_image_set_has_alpha(hasAlpha);
+    return im;
+}
 
-cleanup:
-    if (pixelsAlloc)
-        avifRGBImageFreePixels(&rgb);
+struct AvifSequence
+{
+    avifDecoder *dec;
+    avifRGBImage rgb; // Conversion target, reused for every frame.
+};
+
+// True if path holds more than one image, i.e. should be played.
+int avifIsSequence(const char *path)
+{
+    avifDecoder *dec = avifOpenDecoder(path);
+    int animated = dec && dec->imageCount > 1;
     if (dec)
         avifDecoderDestroy(dec);
-    return im;
+    return animated;
+}
+
+// Opens an image sequence. Returns NULL for stills and on errors.
+AvifSequence *avifSequenceOpen(const char *path)
+{
+    AvifSequence *seq = calloc(1, sizeof *seq);
+    if (!seq)
+    {
+        return NULL;
+    }
+    seq->dec = avifOpenDecoder(path);
+    if (!seq->dec || seq->dec->imageCount < 2)
+    {
+        avifSequenceClose(seq);
+        return NULL;
+    }
+    return seq;
+}
+
+int avifSequenceCount(const AvifSequence *seq)
+{
+    return seq->dec->imageCount;
+}
+
+// Decodes the next frame, wrapping to the first after the last one.
+// Returns 0 on a decode error.
+int avifSequenceNext(AvifSequence *seq, AvifFrame *frame)
+{
+    avifDecoder *dec = seq->dec;
+    avifResult r = avifDecoderNextImage(dec);
+    if (r == AVIF_RESULT_NO_IMAGES_REMAINING && (r = avifDecoderReset(dec)) == AVIF_RESULT_OK)
+    {
+        r = avifDecoderNextImage(dec);
+    }
+    if (r != AVIF_RESULT_OK)
+    {
+        fprintf(stderr, "AVIF decode error: %s\n", avifResultToString(r));
+        return 0;
+    }
+
+    // Every frame of a sequence has the same size; allocate on the first.
+    avifImage *y = dec->image;
+    if (!seq->rgb.pixels && !avifAllocRGB(&seq->rgb, y))
+    {
+        return 0;
+    }
+    if ((r = avifImageYUVToRGB(y, &seq->rgb)) != AVIF_RESULT_OK)
+    {
+        fprintf(stderr, "AVIF to RGB error: %s\n", avifResultToString(r));
+        return 0;
+    }
+
+    frame->pixels = (const DATA32 *)seq->rgb.pixels;
+    frame->width = (int)seq->rgb.width;
+    frame->height = (int)seq->rgb.height;
+    frame->hasAlpha = dec->alphaPresent ? 1 : 0;
+    frame->duration = dec->imageTiming.duration;
+    return 1;
+}
+
+void avifSequenceClose(AvifSequence *seq)
+{
+    if (!seq)
+    {
+        return;
+    }
+    if (seq->rgb.pixels)
+        pixbufFree(seq->rgb.pixels);
+    if (seq->dec)
+        avifDecoderDestroy(seq->dec);
+    free(seq);
 }
 
 #endif // AVIF_LOADER_IMPLEMENTATION
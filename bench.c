@@ -0,0 +1,578 @@
+/*
+ * wall-bench: times the stages of setting a wallpaper.
+ * Generates a deterministic corpus of PNG, JPEG and AVIF images from 720p to
+ * 16K, opaque and with alpha, then sets each one in every display mode on a
+ * private Xvfb. Every run is a fresh process, so its peak RSS and page
+ * faults are its own.
+ * Results go to stdout as JSON, progress to stderr.
+ *
+ * Usage:
+ *   wall-bench [-s WxH] [-H max-height] [-r repeats] [-c corpus-dir] [-x]
+ */
+
+#define WALL_NO_MAIN
+#include "wall.c"
+
+#include <float.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Corpus image sizes, smallest first.
+static const struct
+{
+    const char *Name;
+    int Width;
+    int Height;
+} BenchSizes[] = {
+    {"720p", 1280, 720},  {"1080p", 1920, 1080}, {"1440p", 2560, 1440},
+    {"4k", 3840, 2160},   {"8k", 7680, 4320},    {"16k", 15360, 8640},
+};
+
+// Corpus file types; JPEG has no alpha variant.
+static const struct
+{
+    const char *Ext;
+    int Alpha;
+} BenchFormats[] = {
+    {"png", 0}, {"png", 1}, {"jpg", 0}, {"avif", 0}, {"avif", 1},
+};
+
+// Stage times in milliseconds, peak RSS in KiB after each stage, minor page
+// faults taken in each, how the large pixel buffers were backed, and which
+// path the image took. A streamed image decodes while it composes, and a
+// pipelined frame uploads while it composes, so those times move into
+// compose_ms.
+typedef struct
+{
+    double Open;
+    double Decode;
+    double Compose;
+    double Upload;
+    double Publish;
+    long RssDecode;
+    long RssCompose;
+    long RssPeak;
+    long FaultsDecode;
+    long FaultsCompose;
+    long FaultsTotal;
+    long HugeTlb;
+    long Hinted;
+    int Streamed;
+    int Pipelined;
+} BenchResult;
+
+typedef struct
+{
+    char *Corpus;
+    int ScrW;
+    int ScrH;
+    int MaxHeight;
+    int Repeat;
+    int UseDisplay;
+} BenchArgs;
+
+static struct argp_option BenchOptions[] = {
+    {"screen", 's', "WxH", 0, "Xvfb screen size (default 1920x1080)", 0},
+    {"max-height", 'H', "N", 0, "Skip corpus sizes taller than N (default 8640)", 0},
+    {"repeat", 'r', "N", 0, "Runs per case; the fastest is reported (default 3)", 0},
+    {"corpus", 'c', "DIR", 0, "Corpus directory, reused when present (default /tmp/wall-bench-corpus)", 0},
+    {"display", 'x', 0, 0, "Use $DISPLAY instead of starting Xvfb", 0},
+    {0}};
+
+static error_t parseBenchOpt(int Key, char *Arg, struct argp_state *State)
+{
+    BenchArgs *Args = State->input;
+    char *End;
+
+    switch (Key)
+    {
+    case 's':
+        if (sscanf(Arg, "%dx%d", &Args->ScrW, &Args->ScrH) != 2 || Args->ScrW < 1 || Args->ScrH < 1)
+        {
+            argp_error(State, "Screen must be WxH: %s", Arg);
+        }
+        break;
+
+    case 'H':
+        Args->MaxHeight = (int)strtol(Arg, &End, 10);
+        if (*End != '\0' || Args->MaxHeight < 1)
+        {
+            argp_error(State, "Invalid height: %s", Arg);
+        }
+        break;
+
+    case 'r':
+        Args->Repeat = (int)strtol(Arg, &End, 10);
+        if (*End != '\0' || Args->Repeat < 1)
+        {
+            argp_error(State, "Invalid repeat count: %s", Arg);
+        }
+        break;
+
+    case 'c':
+        Args->Corpus = Arg;
+        break;
+
+    case 'x':
+        Args->UseDisplay = 1;
+        break;
+
+    case ARGP_KEY_ARG:
+        argp_error(State, "Too many arguments");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp BenchArgp = {BenchOptions, parseBenchOpt, NULL, "Benchmark wall's decode, scale and upload path.",
+                                NULL, NULL, NULL};
+
+// Smooth gradients with a little xorshift noise, so encoders and decoders
+// do realistic work. Alpha images get a radial falloff.
+static void benchPattern(DATA32 *Pixels, int Width, int Height, int Alpha)
+{
+    uint32_t Seed = 0x9e3779b9u ^ (uint32_t)Width ^ ((uint32_t)Height << 16);
+    const double Cx = Width / 2.0;
+    const double Cy = Height / 2.0;
+    const double Radius = (Cx < Cy) ? Cx : Cy;
+
+    for (int Y = 0; Y < Height; ++Y)
+    {
+        DATA32 *Row = Pixels + ((size_t)Y * Width);
+        for (int X = 0; X < Width; ++X)
+        {
+            Seed ^= Seed << 13;
+            Seed ^= Seed >> 17;
+            Seed ^= Seed << 5;
+            const uint32_t Noise = Seed & 0x0f;
+            const uint32_t Red = (((uint32_t)X * 255u / (uint32_t)Width) + Noise) & 0xff;
+            const uint32_t Grn = (((uint32_t)Y * 255u / (uint32_t)Height) + Noise) & 0xff;
+            const uint32_t Blu = (((uint32_t)(X ^ Y) >> 3) + Noise) & 0xff;
+            uint32_t A = 0xff;
+            if (Alpha)
+            {
+                const double Dist = sqrt(((X - Cx) * (X - Cx)) + ((Y - Cy) * (Y - Cy))) / Radius;
+                A = (Dist >= 1.0) ? 0 : (uint32_t)((1.0 - Dist) * 255.0);
+            }
+            Row[X] = (A << 24) | (Red << 16) | (Grn << 8) | Blu;
+        }
+    }
+}
+
+static int benchWriteImlib(const char *Path, const char *Ext, DATA32 *Pixels, int Width, int Height, int Alpha)
+{
+    Imlib_Image Img = imlib_create_image_using_data(Width, Height, Pixels);
+    if (!Img)
+    {
+        return 0;
+    }
+    imlib_context_set_image(Img);
+    imlib_image_set_has_alpha(Alpha ? 1 : 0);
+    imlib_image_set_format(Ext);
+    imlib_image_attach_data_value("quality", NULL, 90, NULL);
+    imlib_save_image(Path);
+    imlib_free_image();
+    return access(Path, R_OK) == 0;
+}
+
+static int benchWriteAvif(const char *Path, DATA32 *Pixels, int Width, int Height, int Alpha)
+{
+    avifImage *Img = avifImageCreate((uint32_t)Width, (uint32_t)Height, 8, AVIF_PIXEL_FORMAT_YUV420);
+    avifEncoder *Enc = avifEncoderCreate();
+    avifRWData Out = {0};
+    avifRGBImage Rgb;
+    int Ok = 0;
+
+    if (Img && Enc)
+    {
+        avifRGBImageSetDefaults(&Rgb, Img);
+        Rgb.format = AVIF_RGB_FORMAT_BGRA;
+        Rgb.depth = 8;
+        Rgb.ignoreAlpha = Alpha ? AVIF_FALSE : AVIF_TRUE;
+        Rgb.pixels = (uint8_t *)Pixels;
+        Rgb.rowBytes = (uint32_t)Width * 4;
+        Enc->maxThreads = getCpuCount();
+        Enc->speed = 10; // Fastest; the corpus is about decoding.
+
+        FILE *File;
+        if (avifImageRGBToYUV(Img, &Rgb) == AVIF_RESULT_OK && avifEncoderWrite(Enc, Img, &Out) == AVIF_RESULT_OK &&
+            (File = fopen(Path, "wb")))
+        {
+            Ok = fwrite(Out.data, 1, Out.size, File) == Out.size;
+            Ok = (fclose(File) == 0) && Ok;
+        }
+    }
+    avifRWDataFree(&Out);
+    if (Enc)
+    {
+        avifEncoderDestroy(Enc);
+    }
+    if (Img)
+    {
+        avifImageDestroy(Img);
+    }
+    return Ok;
+}
+
+static void benchCorpusPath(char *Buffer, size_t Size, const char *Dir, int SizeIdx, int FormatIdx)
+{
+    (void)snprintf(Buffer, Size, "%s/%s-%s.%s", Dir, BenchSizes[SizeIdx].Name,
+                   BenchFormats[FormatIdx].Alpha ? "alpha" : "opaque", BenchFormats[FormatIdx].Ext);
+}
+
+// Write the corpus files that don't exist yet. Runs in its own process so
+// the pattern buffers never count towards a measured run.
+static int benchGenerate(const BenchArgs *Args)
+{
+    const int HaveAvif = avifCodecName(AVIF_CODEC_CHOICE_AUTO, AVIF_CODEC_FLAG_CAN_ENCODE) != NULL;
+    if (!HaveAvif)
+    {
+        (void)fprintf(stderr, "No AV1 encoder in libavif; skipping AVIF corpus\n");
+    }
+    if (mkdir(Args->Corpus, 0755) != 0 && errno != EEXIST)
+    {
+        perror(Args->Corpus);
+        return 0;
+    }
+
+    for (size_t SizeIdx = 0; SizeIdx < sizeof BenchSizes / sizeof *BenchSizes; ++SizeIdx)
+    {
+        const int Width = BenchSizes[SizeIdx].Width;
+        const int Height = BenchSizes[SizeIdx].Height;
+        if (Height > Args->MaxHeight)
+        {
+            break;
+        }
+        for (size_t FormatIdx = 0; FormatIdx < sizeof BenchFormats / sizeof *BenchFormats; ++FormatIdx)
+        {
+            char Path[PATH_MAX];
+            const char *Ext = BenchFormats[FormatIdx].Ext;
+            const int Alpha = BenchFormats[FormatIdx].Alpha;
+            benchCorpusPath(Path, sizeof Path, Args->Corpus, (int)SizeIdx, (int)FormatIdx);
+            if (access(Path, R_OK) == 0 || (strcmp(Ext, "avif") == 0 && !HaveAvif))
+            {
+                continue;
+            }
+
+            (void)fprintf(stderr, "Generating %s\n", Path);
+            DATA32 *Pixels = malloc((size_t)Width * Height * sizeof *Pixels);
+            if (!Pixels)
+            {
+                (void)fprintf(stderr, "Out of memory for %dx%d corpus image\n", Width, Height);
+                return 0;
+            }
+            benchPattern(Pixels, Width, Height, Alpha);
+            const int Ok = (strcmp(Ext, "avif") == 0) ? benchWriteAvif(Path, Pixels, Width, Height, Alpha)
+                                                      : benchWriteImlib(Path, Ext, Pixels, Width, Height, Alpha);
+            free(Pixels);
+            if (!Ok)
+            {
+                (void)fprintf(stderr, "Cannot write %s\n", Path);
+                (void)unlink(Path);
+            }
+        }
+    }
+    return 1;
+}
+
+// Start Xvfb on a free display and point DISPLAY at it. Returns its pid,
+// or -1 if it could not be started.
+static pid_t benchStartXvfb(int ScrW, int ScrH)
+{
+    int Fds[2];
+    if (pipe(Fds) != 0)
+    {
+        return -1;
+    }
+
+    pid_t Pid = fork();
+    if (Pid == 0)
+    {
+        char Fd[16];
+        char Screen[32];
+        close(Fds[0]);
+        (void)snprintf(Fd, sizeof Fd, "%d", Fds[1]);
+        (void)snprintf(Screen, sizeof Screen, "%dx%dx24", ScrW, ScrH);
+        execlp("Xvfb", "Xvfb", "-displayfd", Fd, "-screen", "0", Screen, "-nolisten", "tcp", (char *)NULL);
+        _exit(127);
+    }
+    close(Fds[1]);
+
+    // Xvfb writes the display number once it accepts connections.
+    char Number[16] = {0};
+    size_t Len = 0;
+    ssize_t Got;
+    while (Pid > 0 && Len < sizeof Number - 1 && (Got = read(Fds[0], Number + Len, sizeof Number - 1 - Len)) > 0)
+    {
+        Len += (size_t)Got;
+        if (strchr(Number, '\n'))
+        {
+            break;
+        }
+    }
+    close(Fds[0]);
+
+    char Display[32];
+    char *End;
+    const long Disp = strtol(Number, &End, 10);
+    if (Pid < 0 || End == Number)
+    {
+        (void)fprintf(stderr, "Cannot start Xvfb\n");
+        if (Pid > 0)
+        {
+            kill(Pid, SIGTERM);
+            waitpid(Pid, NULL, 0);
+        }
+        return -1;
+    }
+    (void)snprintf(Display, sizeof Display, ":%ld", Disp);
+    setenv("DISPLAY", Display, 1);
+    return Pid;
+}
+
+static long benchMaxRss(void)
+{
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_maxrss;
+}
+
+static long benchFaults(void)
+{
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_minflt;
+}
+
+// One measured run, in a child process: set Path in Mode and write the
+// stage times to Fd. Takes setWallpaper's decode plan, stream and upload
+// pipeline choices, without the frame cache.
+static void benchRun(const char *Path, WallpaperMode Mode, int Fd)
+{
+    WallpaperConfig Cfg = {.Mode = Mode, .Filter = SF_Bilinear};
+    strCopy(Cfg.BgColor, sizeof Cfg.BgColor, "000000", strlen("000000"));
+    strCopy(Cfg.Path, sizeof Cfg.Path, Path, strlen(Path));
+    BenchResult Res = {0};
+    WallDisplay Wd;
+
+    // The pool is shared process state, not part of any stage.
+    (void)framePool();
+
+    const long Faults = benchFaults();
+    double Mark = monotonicNow();
+    if (!openDisplay(&Wd))
+    {
+        _exit(2);
+    }
+    double Now = monotonicNow();
+    Res.Open = (Now - Mark) * 1e3;
+    Mark = Now;
+
+    DecodeTarget Target = {.Cfg = &Cfg, .ScrW = Wd.Width, .ScrH = Wd.Height};
+    const size_t FrameBytes = (size_t)Wd.Width * Wd.Height * sizeof(DATA32) * (Wd.Native ? 1 : 2);
+    ImageStream Stream;
+    const int Fits = planDecode(&Cfg, &Target, FrameBytes);
+    Res.Streamed = Fits && openStream(&Stream, &Target);
+    Imlib_Image Img = (Fits && !Res.Streamed) ? loadImage(Path, &Target) : NULL;
+    if (!Res.Streamed && !Img)
+    {
+        _exit(3);
+    }
+    Now = monotonicNow();
+    Res.Decode = (Now - Mark) * 1e3;
+    Res.RssDecode = benchMaxRss();
+    Res.FaultsDecode = benchFaults();
+    Mark = Now;
+
+    UploadBuffer *Buf = Wd.Native ? frameBuffer(&Wd) : NULL;
+    DATA32 *Pixels = NULL;
+    Pixmap Back = None;
+    Res.Pipelined = uploadPipelined(&Cfg, Img, Buf);
+    if (Res.Pipelined)
+    {
+        if ((Back = composeOffscreen(&Wd, &Cfg, Img, Buf)) == None)
+        {
+            _exit(4);
+        }
+    }
+    else
+    {
+        Pixels = Buf ? (DATA32 *)Buf->Data : pixbufAlloc((size_t)Wd.Width * Wd.Height * sizeof *Pixels);
+        if (!Pixels || !composeImage(&Cfg, Img, &Stream, Wd.Width, Wd.Height, Pixels))
+        {
+            _exit(4);
+        }
+    }
+    Now = monotonicNow();
+    Res.Compose = (Now - Mark) * 1e3;
+    Res.RssCompose = benchMaxRss();
+    Res.FaultsCompose = benchFaults() - Res.FaultsDecode;
+    Res.FaultsDecode -= Faults;
+    Mark = Now;
+
+    int created = 0;
+    Pixmap Pix = getOrCreateRootPixmap(&Wd, NULL, &created);
+    if (Back != None)
+    {
+        movePixmap(&Wd, Back, Pix);
+    }
+    else if (Buf)
+    {
+        presentFrame(&Wd, &Cfg, Buf, Pix, created);
+        uploadWait(Buf);
+    }
+    else if (!renderComposed(&Wd, Pix, Pixels))
+    {
+        _exit(5);
+    }
+    XSync(Wd.Dpy, False);
+    Now = monotonicNow();
+    Res.Upload = (Now - Mark) * 1e3;
+    Mark = Now;
+
+    publishPixmap(&Wd, &Cfg, Pix, created);
+    XSync(Wd.Dpy, False);
+    Res.Publish = (monotonicNow() - Mark) * 1e3;
+
+    Res.RssPeak = benchMaxRss();
+    Res.FaultsTotal = benchFaults() - Faults;
+    PixbufStats Stats;
+    pixbufGetStats(&Stats);
+    Res.HugeTlb = (long)Stats.HugeTlb;
+    Res.Hinted = (long)Stats.Hinted;
+    ssize_t Wrote = write(Fd, &Res, sizeof Res);
+    _exit(Wrote == (ssize_t)sizeof Res ? 0 : 6);
+}
+
+// Fastest of Repeat runs, each in a fresh process. Returns 0 if any failed.
+static int benchCase(const char *Path, WallpaperMode Mode, int Repeat, BenchResult *Best)
+{
+    *Best = (BenchResult){DBL_MAX, DBL_MAX, DBL_MAX, DBL_MAX, DBL_MAX, 0, 0, 0, LONG_MAX, LONG_MAX, LONG_MAX, 0, 0, 0, 0};
+
+    for (int Run = 0; Run < Repeat; ++Run)
+    {
+        int Fds[2];
+        if (pipe(Fds) != 0)
+        {
+            return 0;
+        }
+        pid_t Pid = fork();
+        if (Pid == 0)
+        {
+            close(Fds[0]);
+            benchRun(Path, Mode, Fds[1]);
+        }
+        close(Fds[1]);
+
+        BenchResult Res;
+        int WaitStatus = 0;
+        const ssize_t Got = (Pid > 0) ? read(Fds[0], &Res, sizeof Res) : -1;
+        close(Fds[0]);
+        if (Pid < 0 || waitpid(Pid, &WaitStatus, 0) != Pid || !WIFEXITED(WaitStatus) || WEXITSTATUS(WaitStatus) != 0 ||
+            Got != (ssize_t)sizeof Res)
+        {
+            return 0;
+        }
+
+        Best->Open = (Res.Open < Best->Open) ? Res.Open : Best->Open;
+        Best->Decode = (Res.Decode < Best->Decode) ? Res.Decode : Best->Decode;
+        Best->Compose = (Res.Compose < Best->Compose) ? Res.Compose : Best->Compose;
+        Best->Upload = (Res.Upload < Best->Upload) ? Res.Upload : Best->Upload;
+        Best->Publish = (Res.Publish < Best->Publish) ? Res.Publish : Best->Publish;
+        Best->RssDecode = (Res.RssDecode > Best->RssDecode) ? Res.RssDecode : Best->RssDecode;
+        Best->RssCompose = (Res.RssCompose > Best->RssCompose) ? Res.RssCompose : Best->RssCompose;
+        Best->RssPeak = (Res.RssPeak > Best->RssPeak) ? Res.RssPeak : Best->RssPeak;
+        Best->FaultsDecode = (Res.FaultsDecode < Best->FaultsDecode) ? Res.FaultsDecode : Best->FaultsDecode;
+        Best->FaultsCompose = (Res.FaultsCompose < Best->FaultsCompose) ? Res.FaultsCompose : Best->FaultsCompose;
+        Best->FaultsTotal = (Res.FaultsTotal < Best->FaultsTotal) ? Res.FaultsTotal : Best->FaultsTotal;
+        Best->HugeTlb = Res.HugeTlb;
+        Best->Hinted = Res.Hinted;
+        Best->Streamed = Res.Streamed;
+        Best->Pipelined = Res.Pipelined;
+    }
+    return 1;
+}
+
+int main(int Argc, char *Argv[])
+{
+    BenchArgs Args = {
+        .Corpus = "/tmp/wall-bench-corpus", .ScrW = 1920, .ScrH = 1080, .MaxHeight = 8640, .Repeat = 3};
+    argp_parse(&BenchArgp, Argc, Argv, 0, NULL, &Args);
+
+    // Generate out of process; see benchGenerate.
+    int WaitStatus = 0;
+    pid_t Gen = fork();
+    if (Gen == 0)
+    {
+        _exit(benchGenerate(&Args) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (Gen < 0 || waitpid(Gen, &WaitStatus, 0) != Gen || !WIFEXITED(WaitStatus) || WEXITSTATUS(WaitStatus) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    pid_t Xvfb = -1;
+    if (!Args.UseDisplay && (Xvfb = benchStartXvfb(Args.ScrW, Args.ScrH)) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    (void)printf("{\n  \"screen\": [%d, %d],\n  \"simd\": \"%s\",\n  \"cpus\": %d,\n  \"runs\": [", Args.ScrW,
+                 Args.ScrH, scaleSimdName(), getCpuCount());
+    int First = 1;
+    int Failed = 0;
+    for (size_t SizeIdx = 0; SizeIdx < sizeof BenchSizes / sizeof *BenchSizes; ++SizeIdx)
+    {
+        if (BenchSizes[SizeIdx].Height > Args.MaxHeight)
+        {
+            break;
+        }
+        for (size_t FormatIdx = 0; FormatIdx < sizeof BenchFormats / sizeof *BenchFormats; ++FormatIdx)
+        {
+            char Path[PATH_MAX];
+            benchCorpusPath(Path, sizeof Path, Args.Corpus, (int)SizeIdx, (int)FormatIdx);
+            if (access(Path, R_OK) != 0)
+            {
+                continue;
+            }
+            for (int Mode = 0; Mode < WM_Count; ++Mode)
+            {
+                BenchResult Res;
+                (void)fprintf(stderr, "%s %s\n", Path, ModeLUT[Mode].Name);
+                if (!benchCase(Path, (WallpaperMode)Mode, Args.Repeat, &Res))
+                {
+                    (void)fprintf(stderr, "Run failed: %s %s\n", Path, ModeLUT[Mode].Name);
+                    Failed = 1;
+                    continue;
+                }
+                (void)printf("%s\n    {\"image\": \"%s\", \"format\": \"%s\", \"width\": %d, \"height\": %d, "
+                             "\"alpha\": %s, \"mode\": \"%s\", \"open_ms\": %.3f, \"decode_ms\": %.3f, "
+                             "\"compose_ms\": %.3f, \"upload_ms\": %.3f, \"publish_ms\": %.3f, \"total_ms\": %.3f, "
+                             "\"rss_decode_kb\": %ld, \"rss_compose_kb\": %ld, \"peak_rss_kb\": %ld, "
+                             "\"faults_decode\": %ld, \"faults_compose\": %ld, \"faults_total\": %ld, "
+                             "\"hugetlb_buffers\": %ld, \"thp_buffers\": %ld, \"streamed\": %s, \"pipelined\": %s}",
+                             First ? "" : ",", strrchr(Path, '/') + 1, BenchFormats[FormatIdx].Ext,
+                             BenchSizes[SizeIdx].Width, BenchSizes[SizeIdx].Height,
+                             BenchFormats[FormatIdx].Alpha ? "true" : "false", ModeLUT[Mode].Name, Res.Open,
+                             Res.Decode, Res.Compose, Res.Upload, Res.Publish,
+                             Res.Open + Res.Decode + Res.Compose + Res.Upload + Res.Publish, Res.RssDecode,
+                             Res.RssCompose, Res.RssPeak, Res.FaultsDecode, Res.FaultsCompose, Res.FaultsTotal,
+                             Res.HugeTlb, Res.Hinted, Res.Streamed ? "true" : "false",
+                             Res.Pipelined ? "true" : "false");
+                First = 0;
+                (void)fflush(stdout);
+            }
+        }
+    }
+    (void)printf("\n  ]\n}\n");
+
+    if (Xvfb > 0)
+    {
+        kill(Xvfb, SIGTERM);
+        waitpid(Xvfb, NULL, 0);
+    }
+    return Failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,383 @@
+// On-disk cache of fully composed wallpaper frames.
+// Each entry is a small header, the key it was stored under, and the raw
+// pixels at a page-aligned offset so a hit is a single mmap.
+// The directory is kept under FRAME_CACHE_MAX_BYTES: every store drops the
+// least recently used entries until the rest fit, and any temporary file
+// a crashed writer left behind.
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_CACHE_MAGIC "WALLFRM1"
+
+// Total size of all entries; about thirty 4K frames. Override at build time.
+#ifndef FRAME_CACHE_MAX_BYTES
+#define FRAME_CACHE_MAX_BYTES ((uint64_t)1 << 30)
+#endif
+
+// Pixel layout of a cached frame; must match the target visual exactly.
+typedef struct
+{
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t Stride;
+    uint32_t Depth;
+    uint32_t BitsPerPixel;
+    uint32_t ByteOrder;
+    uint32_t RedMask;
+    uint32_t GreenMask;
+    uint32_t BlueMask;
+} FrameFormat;
+
+typedef struct
+{
+    char Magic[8];
+    uint64_t KeyHash;
+    FrameFormat Format;
+    uint32_t KeyLen;
+    uint32_t DataOffset;
+} FrameCacheHeader;
+
+// A mapped cache hit. Pixels stays valid until frameCacheClose().
+typedef struct
+{
+    void *Map;
+    size_t MapSize;
+    const unsigned char *Pixels;
+} CachedFrame;
+
+uint64_t frameCacheHash(const void *Data, size_t Len);
+int frameCacheOpen(const char *Key, const FrameFormat *Fmt, CachedFrame *Out);
+int frameCacheStore(const char *Key, const FrameFormat *Fmt, const void *Pixels);
+void frameCacheClose(CachedFrame *Frame);
+
+#ifdef FRAME_CACHE_IMPLEMENTATION
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_CACHE_ALIGN 4096u
+#define FRAME_CACHE_SUFFIX ".frame"
+
+// A temporary file untouched for this long lost its writer.
+#define FRAME_CACHE_STALE_SECONDS 600
+
+// 64-bit FNV-1a; only used to name files, the full key is compared on load.
+uint64_t frameCacheHash(const void *Data, size_t Len)
+{
+    const unsigned char *Bytes = Data;
+    uint64_t Hash = 0xcbf29ce484222325ull;
+    for (size_t idx = 0; idx < Len; ++idx)
+    {
+        Hash ^= Bytes[idx];
+        Hash *= 0x100000001b3ull;
+    }
+    return Hash;
+}
+
+// "$XDG_CACHE_HOME/wall", falling back to "$HOME/.cache/wall".
+static int frameCacheDir(char *Buffer, size_t Size, int Create)
+{
+    const char *Base = getenv("XDG_CACHE_HOME");
+    const char *Home = getenv("HOME");
+    int Len;
+
+    if (Base && *Base)
+    {
+        Len = snprintf(Buffer, Size, "%s/wall", Base);
+    }
+    else if (Home && *Home)
+    {
+        Len = snprintf(Buffer, Size, "%s/.cache/wall", Home);
+    }
+    else
+    {
+        return 0;
+    }
+    if (Len <= 0 || (size_t)Len >= Size)
+    {
+        return 0;
+    }
+
+    if (Create)
+    {
+        // Create the parent first; $HOME/.cache may not exist yet.
+        char *Slash = strrchr(Buffer, '/');
+        *Slash = 0;
+        (void)mkdir(Buffer, 0700);
+        *Slash = '/';
+        if (mkdir(Buffer, 0700) != 0 && errno != EEXIST)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int frameCachePath(char *Buffer, size_t Size, uint64_t Hash, int Create)
+{
+    char Dir[PATH_MAX];
+    if (!frameCacheDir(Dir, sizeof Dir, Create))
+    {
+        return 0;
+    }
+    int Len = snprintf(Buffer, Size, "%s/%016llx" FRAME_CACHE_SUFFIX, Dir, (unsigned long long)Hash);
+    return Len > 0 && (size_t)Len < Size;
+}
+
+static size_t frameCacheDataOffset(size_t KeyLen)
+{
+    size_t Used = sizeof(FrameCacheHeader) + KeyLen;
+    return (Used + FRAME_CACHE_ALIGN - 1) & ~(size_t)(FRAME_CACHE_ALIGN - 1);
+}
+
+// Map the entry stored under Key. Returns 1 on a hit whose layout matches Fmt.
+int frameCacheOpen(const char *Key, const FrameFormat *Fmt, CachedFrame *Out)
+{
+    char Path[PATH_MAX];
+    size_t KeyLen = strlen(Key);
+    uint64_t Hash = frameCacheHash(Key, KeyLen);
+    struct stat St;
+
+    memset(Out, 0, sizeof *Out);
+    if (!frameCachePath(Path, sizeof Path, Hash, 0))
+    {
+        return 0;
+    }
+
+    int Fd = open(Path, O_RDONLY | O_CLOEXEC);
+    if (Fd < 0)
+    {
+        return 0;
+    }
+
+    size_t DataSize = (size_t)Fmt->Stride * Fmt->Height;
+    size_t Offset = frameCacheDataOffset(KeyLen);
+    if (fstat(Fd, &St) != 0 || (size_t)St.st_size != Offset + DataSize)
+    {
+        close(Fd);
+        return 0;
+    }
+
+    void *Map = mmap(NULL, (size_t)St.st_size, PROT_READ, MAP_SHARED, Fd, 0);
+    if (Map != MAP_FAILED)
+    {
+        // Stamp the use ourselves; relatime and noatime mounts won't, and
+        // pruning goes by it.
+        const struct timespec Times[2] = {{.tv_nsec = UTIME_NOW}, {.tv_nsec = UTIME_OMIT}};
+        (void)futimens(Fd, Times);
+    }
+    close(Fd);
+    if (Map == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    const FrameCacheHeader *Hdr = Map;
+    if (memcmp(Hdr->Magic, FRAME_CACHE_MAGIC, sizeof Hdr->Magic) != 0 || Hdr->KeyHash != Hash ||
+        Hdr->KeyLen != KeyLen || Hdr->DataOffset != Offset || memcmp(&Hdr->Format, Fmt, sizeof *Fmt) != 0 ||
+        memcmp(Hdr + 1, Key, KeyLen) != 0)
+    {
+        munmap(Map, (size_t)St.st_size);
+        return 0;
+    }
+
+    // The whole frame is about to be uploaded; start reading it in now.
+    (void)madvise(Map, (size_t)St.st_size, MADV_WILLNEED | MADV_SEQUENTIAL);
+
+    Out->Map = Map;
+    Out->MapSize = (size_t)St.st_size;
+    Out->Pixels = (const unsigned char *)Map + Offset;
+    return 1;
+}
+
+static int frameCacheWrite(int Fd, const void *Data, size_t Len)
+{
+    const unsigned char *Bytes = Data;
+    while (Len)
+    {
+        ssize_t Put = write(Fd, Bytes, Len);
+        if (Put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (Put <= 0)
+        {
+            return 0;
+        }
+        Bytes += Put;
+        Len -= (size_t)Put;
+    }
+    return 1;
+}
+
+typedef struct
+{
+    char Name[32];
+    uint64_t Bytes;
+    time_t Used;
+} FrameCacheEntry;
+
+static int frameCacheOlder(const void *A, const void *B)
+{
+    const FrameCacheEntry *Left = A;
+    const FrameCacheEntry *Right = B;
+    return (Left->Used > Right->Used) - (Left->Used < Right->Used);
+}
+
+// True for an abandoned "<entry>.XXXXXX" written by frameCacheStore.
+static int frameCacheStaleTemp(const char *Name, const struct stat *St, time_t Now)
+{
+    const char *Dot = strrchr(Name, '.');
+    const size_t SuffixLen = sizeof FRAME_CACHE_SUFFIX - 1;
+    return Dot && strlen(Dot) == 7 && (size_t)(Dot - Name) > SuffixLen &&
+           strncmp(Dot - SuffixLen, FRAME_CACHE_SUFFIX, SuffixLen) == 0 &&
+           Now - St->st_mtime > FRAME_CACHE_STALE_SECONDS;
+}
+
+// Delete least recently used entries, never Keep, until the directory
+// holds at most FRAME_CACHE_MAX_BYTES, and stale temporary files.
+static void frameCachePrune(const char *Keep)
+{
+    char Dir[PATH_MAX];
+    char Path[PATH_MAX + 32];
+    if (!frameCacheDir(Dir, sizeof Dir, 0))
+    {
+        return;
+    }
+    DIR *Handle = opendir(Dir);
+    if (!Handle)
+    {
+        return;
+    }
+
+    FrameCacheEntry *Entries = NULL;
+    size_t Count = 0;
+    size_t Capacity = 0;
+    uint64_t Total = 0;
+    const time_t Now = time(NULL);
+    struct dirent *Ent;
+    while ((Ent = readdir(Handle)))
+    {
+        const size_t Len = strlen(Ent->d_name);
+        const size_t SuffixLen = sizeof FRAME_CACHE_SUFFIX - 1;
+        struct stat St;
+        if (fstatat(dirfd(Handle), Ent->d_name, &St, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(St.st_mode))
+        {
+            continue;
+        }
+        if (frameCacheStaleTemp(Ent->d_name, &St, Now))
+        {
+            (void)unlinkat(dirfd(Handle), Ent->d_name, 0);
+            continue;
+        }
+        if (Len <= SuffixLen || Len >= sizeof Entries->Name ||
+            strcmp(Ent->d_name + Len - SuffixLen, FRAME_CACHE_SUFFIX) != 0)
+        {
+            continue;
+        }
+        if (Count == Capacity)
+        {
+            Capacity = Capacity ? Capacity * 2 : 64;
+            FrameCacheEntry *Grown = realloc(Entries, Capacity * sizeof *Entries);
+            if (!Grown)
+            {
+                break;
+            }
+            Entries = Grown;
+        }
+        FrameCacheEntry *Entry = &Entries[Count++];
+        memcpy(Entry->Name, Ent->d_name, Len + 1);
+        Entry->Bytes = (uint64_t)St.st_blocks * 512;
+        Entry->Used = St.st_atime > St.st_mtime ? St.st_atime : St.st_mtime;
+        Total += Entry->Bytes;
+    }
+    closedir(Handle);
+
+    if (Total > FRAME_CACHE_MAX_BYTES)
+    {
+        const char *KeepName = strrchr(Keep, '/') + 1;
+        qsort(Entries, Count, sizeof *Entries, frameCacheOlder);
+        for (size_t idx = 0; idx < Count && Total > FRAME_CACHE_MAX_BYTES; ++idx)
+        {
+            if (strcmp(Entries[idx].Name, KeepName) == 0)
+            {
+                continue;
+            }
+            (void)snprintf(Path, sizeof Path, "%s/%s", Dir, Entries[idx].Name);
+            if (unlink(Path) == 0 || errno == ENOENT)
+            {
+                Total -= Entries[idx].Bytes;
+            }
+        }
+    }
+    free(Entries);
+}
+
+// Store a frame under Key. Written to a uniquely named temporary file and
+// renamed into place, so a concurrent reader never maps a partial entry and
+// concurrent writers, in this process or another, never share one.
+int frameCacheStore(const char *Key, const FrameFormat *Fmt, const void *Pixels)
+{
+    char Path[PATH_MAX];
+    char Tmp[PATH_MAX + 16];
+    size_t KeyLen = strlen(Key);
+    size_t Offset = frameCacheDataOffset(KeyLen);
+    FrameCacheHeader Hdr = {0};
+    static const char Zero[FRAME_CACHE_ALIGN] = {0};
+
+    memcpy(Hdr.Magic, FRAME_CACHE_MAGIC, sizeof Hdr.Magic);
+    Hdr.KeyHash = frameCacheHash(Key, KeyLen);
+    Hdr.Format = *Fmt;
+    Hdr.KeyLen = (uint32_t)KeyLen;
+    Hdr.DataOffset = (uint32_t)Offset;
+
+    if (!frameCachePath(Path, sizeof Path, Hdr.KeyHash, 1))
+    {
+        return 0;
+    }
+    (void)snprintf(Tmp, sizeof Tmp, "%s.XXXXXX", Path);
+
+    int Fd = mkstemp(Tmp);
+    if (Fd < 0)
+    {
+        return 0;
+    }
+
+    int Ok = frameCacheWrite(Fd, &Hdr, sizeof Hdr) && frameCacheWrite(Fd, Key, KeyLen) &&
+             frameCacheWrite(Fd, Zero, Offset - sizeof Hdr - KeyLen) &&
+             frameCacheWrite(Fd, Pixels, (size_t)Fmt->Stride * Fmt->Height);
+    Ok = (close(Fd) == 0) && Ok;
+
+    if (!Ok || rename(Tmp, Path) != 0)
+    {
+        (void)unlink(Tmp);
+        return 0;
+    }
+    frameCachePrune(Path);
+    return 1;
+}
+
+void frameCacheClose(CachedFrame *Frame)
+{
+    if (Frame->Map)
+    {
+        munmap(Frame->Map, Frame->MapSize);
+    }
+    memset(Frame, 0, sizeof *Frame);
+}
+
+#endif // FRAME_CACHE_IMPLEMENTATION
+
+#endif // FRAME_CACHE_H
@@ -0,0 +1,411 @@
+// Conversion of composed ARGB32 frames into the pixel format of a TrueColor
+// visual that doesn't take them as-is: other channel orders, 30-bit deep
+// colour with each 8-bit channel widened, and 15/16-bit colour reduced
+// with a 4x4 ordered dither. SIMD kernels are picked at runtime like the
+// scaler's; other layouts (24 bits per pixel, foreign byte order) take a
+// portable path.
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct ConvertPlan ConvertPlan;
+
+// Converts Count pixels of row Y; Y only picks the dither row.
+typedef void (*ConvertRowFn)(const ConvertPlan *Plan, const uint32_t *Src, uint8_t *Dst, int Count, int Y);
+
+struct ConvertPlan
+{
+    int BitsPerPixel; // 16, 24 or 32.
+    int Swap;         // Pixels are stored in the other byte order than the host's.
+    int Shift[3];     // Lowest bit of red, green and blue in a pixel.
+    int Bits[3];      // Width of each channel, 1-16.
+    ConvertRowFn Row;
+};
+
+int convertPlanInit(ConvertPlan *Plan, unsigned long RedMask, unsigned long GreenMask, unsigned long BlueMask,
+                    int BitsPerPixel, int Swap);
+void convertRows(const ConvertPlan *Plan, const uint32_t *Src, size_t SrcStride, uint8_t *Dst, size_t DstStride,
+                 int Width, int Row0, int Row1);
+const char *convertSimdName(void);
+
+#ifdef CONVERT_IMPLEMENTATION
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86 1
+#endif
+
+typedef struct
+{
+    const char *Name;
+    ConvertRowFn Exact;  // 32 bpp, 8-bit channels in any order.
+    ConvertRowFn Deep;   // 32 bpp, 9-16 bit channels.
+    ConvertRowFn Dither; // 16 bpp, channels of at most 8 bits.
+} ConvertKernels;
+
+// 4x4 Bayer matrix as thresholds in [8, 248], added before dividing by 255.
+static const uint8_t ConvertBayer[4][4] = {
+    {8, 136, 40, 168}, {200, 72, 232, 104}, {56, 184, 24, 152}, {248, 120, 216, 88}};
+
+// An 8-bit channel value V at Bits wide. Narrower channels round by the
+// dither threshold T; (X + 1 + (X >> 8)) >> 8 is X / 255 for X < 65535.
+static inline uint32_t convertChannel(uint32_t V, int Bits, uint32_t T)
+{
+    if (Bits == 8)
+    {
+        return V;
+    }
+    if (Bits > 8)
+    {
+        return (V << (Bits - 8)) | (V >> (16 - Bits));
+    }
+    const uint32_t X = (V * ((1u << Bits) - 1)) + T;
+    return (X + 1 + (X >> 8)) >> 8;
+}
+
+static inline uint32_t convertPixel(const ConvertPlan *Plan, uint32_t Px, uint32_t T)
+{
+    return (convertChannel((Px >> 16) & 0xff, Plan->Bits[0], T) << Plan->Shift[0]) |
+           (convertChannel((Px >> 8) & 0xff, Plan->Bits[1], T) << Plan->Shift[1]) |
+           (convertChannel(Px & 0xff, Plan->Bits[2], T) << Plan->Shift[2]);
+}
+
+// Portable path for every layout; also the reference for the SIMD kernels.
+static void convertRowScalar(const ConvertPlan *Plan, const uint32_t *Src, uint8_t *Dst, int Count, int Y)
+{
+    const uint8_t *Thresh = ConvertBayer[Y & 3];
+    const int Bytes = Plan->BitsPerPixel / 8;
+    const uint16_t One = 1;
+    const int Msb = (*(const uint8_t *)&One == 0) != Plan->Swap; // Stored most significant byte first.
+
+    for (int idx = 0; idx < Count; ++idx, Dst += Bytes)
+    {
+        const uint32_t Val = convertPixel(Plan, Src[idx], Thresh[idx & 3]);
+        for (int byte = 0; byte < Bytes; ++byte)
+        {
+            Dst[byte] = (uint8_t)(Val >> (8 * (Msb ? Bytes - 1 - byte : byte)));
+        }
+    }
+}
+
+static const ConvertKernels ConvertScalar = {"scalar", convertRowScalar, convertRowScalar, convertRowScalar};
+
+#ifdef CONVERT_X86
+
+// The three channels of four pixels, each in the low byte of a 32-bit lane.
+#define CONVERT_SPLIT_128(Px, Mask, R, G, B)                                                                           \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        (R) = _mm_and_si128(_mm_srli_epi32((Px), 16), (Mask));                                                         \
+        (G) = _mm_and_si128(_mm_srli_epi32((Px), 8), (Mask));                                                          \
+        (B) = _mm_and_si128((Px), (Mask));                                                                             \
+    } while (0)
+
+#define CONVERT_SPLIT_256(Px, Mask, R, G, B)                                                                           \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        (R) = _mm256_and_si256(_mm256_srli_epi32((Px), 16), (Mask));                                                   \
+        (G) = _mm256_and_si256(_mm256_srli_epi32((Px), 8), (Mask));                                                    \
+        (B) = _mm256_and_si256((Px), (Mask));                                                                          \
+    } while (0)
+
+__attribute__((target("sse2"))) static void convertExactSSE2(const ConvertPlan *Plan, const uint32_t *Src,
+                                                             uint8_t *Dst, int Count, int Y)
+{
+    const __m128i Mask = _mm_set1_epi32(0xff);
+    const __m128i SR = _mm_cvtsi32_si128(Plan->Shift[0]);
+    const __m128i SG = _mm_cvtsi32_si128(Plan->Shift[1]);
+    const __m128i SB = _mm_cvtsi32_si128(Plan->Shift[2]);
+    int idx = 0;
+    for (; idx + 4 <= Count; idx += 4)
+    {
+        __m128i R;
+        __m128i G;
+        __m128i B;
+        CONVERT_SPLIT_128(_mm_loadu_si128((const __m128i *)(Src + idx)), Mask, R, G, B);
+        const __m128i Out =
+            _mm_or_si128(_mm_or_si128(_mm_sll_epi32(R, SR), _mm_sll_epi32(G, SG)), _mm_sll_epi32(B, SB));
+        _mm_storeu_si128((__m128i *)(Dst + ((size_t)idx * 4)), Out);
+    }
+    convertRowScalar(Plan, Src + idx, Dst + ((size_t)idx * 4), Count - idx, Y);
+}
+
+// Widen each channel by repeating its top bits, then move it into place.
+__attribute__((target("sse2"))) static inline __m128i convertDeepChannelSSE2(__m128i V, int Bits, int Shift)
+{
+    const __m128i Wide = _mm_or_si128(_mm_sll_epi32(V, _mm_cvtsi32_si128(Bits - 8)),
+                                      _mm_srl_epi32(V, _mm_cvtsi32_si128(16 - Bits)));
+    return _mm_sll_epi32(Wide, _mm_cvtsi32_si128(Shift));
+}
+
+__attribute__((target("sse2"))) static void convertDeepSSE2(const ConvertPlan *Plan, const uint32_t *Src,
+                                                            uint8_t *Dst, int Count, int Y)
+{
+    const __m128i Mask = _mm_set1_epi32(0xff);
+    int idx = 0;
+    for (; idx + 4 <= Count; idx += 4)
+    {
+        __m128i R;
+        __m128i G;
+        __m128i B;
+        CONVERT_SPLIT_128(_mm_loadu_si128((const __m128i *)(Src + idx)), Mask, R, G, B);
+        const __m128i Out = _mm_or_si128(_mm_or_si128(convertDeepChannelSSE2(R, Plan->Bits[0], Plan->Shift[0]),
+                                                      convertDeepChannelSSE2(G, Plan->Bits[1], Plan->Shift[1])),
+                                         convertDeepChannelSSE2(B, Plan->Bits[2], Plan->Shift[2]));
+        _mm_storeu_si128((__m128i *)(Dst + ((size_t)idx * 4)), Out);
+    }
+    convertRowScalar(Plan, Src + idx, Dst + ((size_t)idx * 4), Count - idx, Y);
+}
+
+// V * Max + T fits 16 bits, so a 16-bit multiply on zero-topped 32-bit
+// lanes is exact.
+__attribute__((target("sse2"))) static inline __m128i convertDitherChannelSSE2(__m128i V, int Bits, int Shift,
+                                                                               __m128i T)
+{
+    const __m128i X = _mm_add_epi32(_mm_mullo_epi16(V, _mm_set1_epi32((1 << Bits) - 1)), T);
+    const __m128i Q = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(X, _mm_set1_epi32(1)), _mm_srli_epi32(X, 8)), 8);
+    return _mm_sll_epi32(Q, _mm_cvtsi32_si128(Shift));
+}
+
+__attribute__((target("sse2"))) static inline __m128i convertDither4SSE2(const ConvertPlan *Plan, const uint32_t *Src,
+                                                                         __m128i T)
+{
+    const __m128i Mask = _mm_set1_epi32(0xff);
+    __m128i R;
+    __m128i G;
+    __m128i B;
+    CONVERT_SPLIT_128(_mm_loadu_si128((const __m128i *)Src), Mask, R, G, B);
+    const __m128i Out = _mm_or_si128(_mm_or_si128(convertDitherChannelSSE2(R, Plan->Bits[0], Plan->Shift[0], T),
+                                                  convertDitherChannelSSE2(G, Plan->Bits[1], Plan->Shift[1], T)),
+                                     convertDitherChannelSSE2(B, Plan->Bits[2], Plan->Shift[2], T));
+    // Sign-extend the low 16 bits so the saturating pack keeps them.
+    return _mm_srai_epi32(_mm_slli_epi32(Out, 16), 16);
+}
+
+__attribute__((target("sse2"))) static void convertDitherSSE2(const ConvertPlan *Plan, const uint32_t *Src,
+                                                              uint8_t *Dst, int Count, int Y)
+{
+    const uint8_t *Row = ConvertBayer[Y & 3];
+    const __m128i T = _mm_setr_epi32(Row[0], Row[1], Row[2], Row[3]);
+    int idx = 0;
+    for (; idx + 8 <= Count; idx += 8)
+    {
+        const __m128i Lo = convertDither4SSE2(Plan, Src + idx, T);
+        const __m128i Hi = convertDither4SSE2(Plan, Src + idx + 4, T);
+        _mm_storeu_si128((__m128i *)(Dst + ((size_t)idx * 2)), _mm_packs_epi32(Lo, Hi));
+    }
+    convertRowScalar(Plan, Src + idx, Dst + ((size_t)idx * 2), Count - idx, Y);
+}
+
+static const ConvertKernels ConvertSSE2 = {"sse2", convertExactSSE2, convertDeepSSE2, convertDitherSSE2};
+
+__attribute__((target("avx2"))) static void convertExactAVX2(const ConvertPlan *Plan, const uint32_t *Src,
+                                                             uint8_t *Dst, int Count, int Y)
+{
+    const __m256i Mask = _mm256_set1_epi32(0xff);
+    const __m128i SR = _mm_cvtsi32_si128(Plan->Shift[0]);
+    const __m128i SG = _mm_cvtsi32_si128(Plan->Shift[1]);
+    const __m128i SB = _mm_cvtsi32_si128(Plan->Shift[2]);
+    int idx = 0;
+    for (; idx + 8 <= Count; idx += 8)
+    {
+        __m256i R;
+        __m256i G;
+        __m256i B;
+        CONVERT_SPLIT_256(_mm256_loadu_si256((const __m256i *)(Src + idx)), Mask, R, G, B);
+        const __m256i Out =
+            _mm256_or_si256(_mm256_or_si256(_mm256_sll_epi32(R, SR), _mm256_sll_epi32(G, SG)), _mm256_sll_epi32(B, SB));
+        _mm256_storeu_si256((__m256i *)(Dst + ((size_t)idx * 4)), Out);
+    }
+    convertExactSSE2(Plan, Src + idx, Dst + ((size_t)idx * 4), Count - idx, Y);
+}
+
+__attribute__((target("avx2"))) static inline __m256i convertDeepChannelAVX2(__m256i V, int Bits, int Shift)
+{
+    const __m256i Wide = _mm256_or_si256(_mm256_sll_epi32(V, _mm_cvtsi32_si128(Bits - 8)),
+                                         _mm256_srl_epi32(V, _mm_cvtsi32_si128(16 - Bits)));
+    return _mm256_sll_epi32(Wide, _mm_cvtsi32_si128(Shift));
+}
+
+__attribute__((target("avx2"))) static void convertDeepAVX2(const ConvertPlan *Plan, const uint32_t *Src,
+                                                            uint8_t *Dst, int Count, int Y)
+{
+    const __m256i Mask = _mm256_set1_epi32(0xff);
+    int idx = 0;
+    for (; idx + 8 <= Count; idx += 8)
+    {
+        __m256i R;
+        __m256i G;
+        __m256i B;
+        CONVERT_SPLIT_256(_mm256_loadu_si256((const __m256i *)(Src + idx)), Mask, R, G, B);
+        const __m256i Out =
+            _mm256_or_si256(_mm256_or_si256(convertDeepChannelAVX2(R, Plan->Bits[0], Plan->Shift[0]),
+                                            convertDeepChannelAVX2(G, Plan->Bits[1], Plan->Shift[1])),
+                            convertDeepChannelAVX2(B, Plan->Bits[2], Plan->Shift[2]));
+        _mm256_storeu_si256((__m256i *)(Dst + ((size_t)idx * 4)), Out);
+    }
+    convertDeepSSE2(Plan, Src + idx, Dst + ((size_t)idx * 4), Count - idx, Y);
+}
+
+__attribute__((target("avx2"))) static inline __m256i convertDitherChannelAVX2(__m256i V, int Bits, int Shift,
+                                                                               __m256i T)
+{
+    const __m256i X = _mm256_add_epi32(_mm256_mullo_epi16(V, _mm256_set1_epi32((1 << Bits) - 1)), T);
+    const __m256i Q =
+        _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(X, _mm256_set1_epi32(1)), _mm256_srli_epi32(X, 8)), 8);
+    return _mm256_sll_epi32(Q, _mm_cvtsi32_si128(Shift));
+}
+
+__attribute__((target("avx2"))) static inline __m256i convertDither8AVX2(const ConvertPlan *Plan,
+                                                                         const uint32_t *Src, __m256i T)
+{
+    const __m256i Mask = _mm256_set1_epi32(0xff);
+    __m256i R;
+    __m256i G;
+    __m256i B;
+    CONVERT_SPLIT_256(_mm256_loadu_si256((const __m256i *)Src), Mask, R, G, B);
+    const __m256i Out =
+        _mm256_or_si256(_mm256_or_si256(convertDitherChannelAVX2(R, Plan->Bits[0], Plan->Shift[0], T),
+                                        convertDitherChannelAVX2(G, Plan->Bits[1], Plan->Shift[1], T)),
+                        convertDitherChannelAVX2(B, Plan->Bits[2], Plan->Shift[2], T));
+    return _mm256_srai_epi32(_mm256_slli_epi32(Out, 16), 16);
+}
+
+__attribute__((target("avx2"))) static void convertDitherAVX2(const ConvertPlan *Plan, const uint32_t *Src,
+                                                              uint8_t *Dst, int Count, int Y)
+{
+    const uint8_t *Row = ConvertBayer[Y & 3];
+    const __m256i T = _mm256_setr_epi32(Row[0], Row[1], Row[2], Row[3], Row[0], Row[1], Row[2], Row[3]);
+    int idx = 0;
+    for (; idx + 16 <= Count; idx += 16)
+    {
+        const __m256i Lo = convertDither8AVX2(Plan, Src + idx, T);
+        const __m256i Hi = convertDither8AVX2(Plan, Src + idx + 8, T);
+        // The pack works per 128-bit lane; put the quarters back in order.
+        const __m256i Packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(Lo, Hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)(Dst + ((size_t)idx * 2)), Packed);
+    }
+    convertDitherSSE2(Plan, Src + idx, Dst + ((size_t)idx * 2), Count - idx, Y);
+}
+
+static const ConvertKernels ConvertAVX2 = {"avx2", convertExactAVX2, convertDeepAVX2, convertDitherAVX2};
+
+#endif // CONVERT_X86
+
+static const ConvertKernels *ConvertChosen = &ConvertScalar;
+static pthread_once_t ConvertKernelsOnce = PTHREAD_ONCE_INIT;
+
+// Best kernel set for this CPU, capped by WALL_SIMD like the scaler's.
+static void convertKernelsInit(void)
+{
+    const ConvertKernels *Best = &ConvertScalar;
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    const char *Cap = getenv("WALL_SIMD");
+    // There are no AVX-512 kernels; that cap allows everything.
+    const char *Names[] = {"avx512", "avx2", "sse2"};
+    const ConvertKernels *Order[] = {&ConvertAVX2, &ConvertAVX2, &ConvertSSE2};
+    const int Usable[] = {__builtin_cpu_supports("avx2"), __builtin_cpu_supports("avx2"),
+                          __builtin_cpu_supports("sse2")};
+    int Capped = Cap && *Cap;
+    for (size_t idx = 0; idx < sizeof Order / sizeof *Order; ++idx)
+    {
+        if (Capped && strcmp(Cap, Names[idx]) == 0)
+        {
+            Capped = 0;
+        }
+        if (!Capped && Usable[idx])
+        {
+            Best = Order[idx];
+            break;
+        }
+    }
+#endif
+    ConvertChosen = Best;
+}
+
+// Called from every pool band of a conversion.
+static const ConvertKernels *convertKernels(void)
+{
+    pthread_once(&ConvertKernelsOnce, convertKernelsInit);
+    return ConvertChosen;
+}
+
+const char *convertSimdName(void)
+{
+    return convertKernels()->Name;
+}
+
+// Position and width of a contiguous mask. Returns 0 for an empty,
+// split or over-wide mask.
+static int convertMask(unsigned long Mask, int BitsPerPixel, int *Shift, int *Bits)
+{
+    if (!Mask || (BitsPerPixel < 32 && Mask >> BitsPerPixel))
+    {
+        return 0;
+    }
+    *Shift = __builtin_ctzl(Mask);
+    *Bits = __builtin_popcountl(Mask);
+    return *Bits <= 16 && (Mask >> *Shift) == (1ul << *Bits) - 1;
+}
+
+// Plan conversion into a TrueColor visual with the given masks, stored at
+// BitsPerPixel in host byte order unless Swap is set. Returns 0 for
+// layouts it can't produce, such as palettes or split masks.
+int convertPlanInit(ConvertPlan *Plan, unsigned long RedMask, unsigned long GreenMask, unsigned long BlueMask,
+                    int BitsPerPixel, int Swap)
+{
+    const unsigned long Masks[3] = {RedMask, GreenMask, BlueMask};
+
+    memset(Plan, 0, sizeof *Plan);
+    if (BitsPerPixel != 16 && BitsPerPixel != 24 && BitsPerPixel != 32)
+    {
+        return 0;
+    }
+    int Narrow = 0;
+    int Wide = 0;
+    for (int chn = 0; chn < 3; ++chn)
+    {
+        if (!convertMask(Masks[chn], BitsPerPixel, &Plan->Shift[chn], &Plan->Bits[chn]))
+        {
+            return 0;
+        }
+        Narrow += Plan->Bits[chn] < 8;
+        Wide += Plan->Bits[chn] > 8;
+    }
+    Plan->BitsPerPixel = BitsPerPixel;
+    Plan->Swap = Swap;
+
+    const ConvertKernels *Kern = convertKernels();
+    Plan->Row = convertRowScalar;
+    if (!Swap && BitsPerPixel == 32 && !Narrow)
+    {
+        Plan->Row = Wide ? (Wide == 3 ? Kern->Deep : convertRowScalar) : Kern->Exact;
+    }
+    else if (!Swap && BitsPerPixel == 16 && !Wide)
+    {
+        Plan->Row = Kern->Dither;
+    }
+    return 1;
+}
+
+// Convert rows [Row0, Row1) of Width pixels. Strides are in bytes.
+void convertRows(const ConvertPlan *Plan, const uint32_t *Src, size_t SrcStride, uint8_t *Dst, size_t DstStride,
+                 int Width, int Row0, int Row1)
+{
+    for (int row = Row0; row < Row1; ++row)
+    {
+        Plan->Row(Plan, (const uint32_t *)((const uint8_t *)Src + ((size_t)row * SrcStride)),
+                  Dst + ((size_t)row * DstStride), Width, row);
+    }
+}
+
+#endif // CONVERT_IMPLEMENTATION
+
+#endif // CONVERT_H
@@ -0,0 +1,216 @@
+// Writes composed ARGB32 frames to image files for headless renders: binary
+// PPM (P6), PAM (P7, TUPLTYPE RGB) and QOI, picked by the file extension.
+// Frames are opaque, so every format stores three channels.
+#ifndef IMAGE_OUT_H
+#define IMAGE_OUT_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    IF_None,
+    IF_Ppm,
+    IF_Pam,
+    IF_Qoi
+} ImageFormat;
+
+ImageFormat imageFormatOf(const char *Path);
+int imageWrite(const char *Path, const uint32_t *Pixels, int Width, int Height);
+
+#ifdef IMAGE_OUT_IMPLEMENTATION
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// Format for Path's extension, or IF_None if it has none of ours.
+ImageFormat imageFormatOf(const char *Path)
+{
+    const char *Ext = strrchr(Path, '.');
+    if (!Ext)
+    {
+        return IF_None;
+    }
+    if (strcasecmp(Ext, ".ppm") == 0)
+    {
+        return IF_Ppm;
+    }
+    if (strcasecmp(Ext, ".pam") == 0)
+    {
+        return IF_Pam;
+    }
+    return strcasecmp(Ext, ".qoi") == 0 ? IF_Qoi : IF_None;
+}
+
+// Row of Count pixels as packed RGB bytes; returns the bytes written.
+static size_t imageRowRgb(const uint32_t *Src, int Count, uint8_t *Dst)
+{
+    for (int idx = 0; idx < Count; ++idx)
+    {
+        Dst[(3 * idx) + 0] = (uint8_t)(Src[idx] >> 16);
+        Dst[(3 * idx) + 1] = (uint8_t)(Src[idx] >> 8);
+        Dst[(3 * idx) + 2] = (uint8_t)Src[idx];
+    }
+    return (size_t)Count * 3;
+}
+
+// QOI encoder state, carried across rows since runs and the index span them.
+typedef struct
+{
+    uint32_t Index[64];
+    uint32_t Prev;
+    int Run;
+} QoiState;
+
+static size_t qoiFlushRun(QoiState *Qoi, uint8_t *Dst)
+{
+    if (Qoi->Run == 0)
+    {
+        return 0;
+    }
+    Dst[0] = (uint8_t)(0xc0 | (Qoi->Run - 1));
+    Qoi->Run = 0;
+    return 1;
+}
+
+// Encode Count opaque pixels; at most five bytes each.
+static size_t qoiRow(QoiState *Qoi, const uint32_t *Src, int Count, uint8_t *Dst)
+{
+    size_t Len = 0;
+    for (int idx = 0; idx < Count; ++idx)
+    {
+        const uint32_t Px = Src[idx] | 0xff000000u;
+        if (Px == Qoi->Prev)
+        {
+            // Runs of up to 62; 63 and 64 would collide with the RGB(A) tags.
+            if (++Qoi->Run == 62)
+            {
+                Len += qoiFlushRun(Qoi, Dst + Len);
+            }
+            continue;
+        }
+        Len += qoiFlushRun(Qoi, Dst + Len);
+
+        const int Red = (int)((Px >> 16) & 0xff);
+        const int Grn = (int)((Px >> 8) & 0xff);
+        const int Blu = (int)(Px & 0xff);
+        const int Slot = ((Red * 3) + (Grn * 5) + (Blu * 7) + (255 * 11)) % 64;
+        if (Qoi->Index[Slot] == Px)
+        {
+            Dst[Len++] = (uint8_t)Slot;
+            Qoi->Prev = Px;
+            continue;
+        }
+        Qoi->Index[Slot] = Px;
+
+        // Differences wrap around at 8 bits.
+        const int DR = (int8_t)(uint8_t)(Red - (int)((Qoi->Prev >> 16) & 0xff));
+        const int DG = (int8_t)(uint8_t)(Grn - (int)((Qoi->Prev >> 8) & 0xff));
+        const int DB = (int8_t)(uint8_t)(Blu - (int)(Qoi->Prev & 0xff));
+        const int RG = DR - DG;
+        const int BG = DB - DG;
+        if (DR >= -2 && DR <= 1 && DG >= -2 && DG <= 1 && DB >= -2 && DB <= 1)
+        {
+            Dst[Len++] = (uint8_t)(0x40 | ((DR + 2) << 4) | ((DG + 2) << 2) | (DB + 2));
+        }
+        else if (DG >= -32 && DG <= 31 && RG >= -8 && RG <= 7 && BG >= -8 && BG <= 7)
+        {
+            Dst[Len++] = (uint8_t)(0x80 | (DG + 32));
+            Dst[Len++] = (uint8_t)(((RG + 8) << 4) | (BG + 8));
+        }
+        else
+        {
+            Dst[Len++] = 0xfe;
+            Dst[Len++] = (uint8_t)Red;
+            Dst[Len++] = (uint8_t)Grn;
+            Dst[Len++] = (uint8_t)Blu;
+        }
+        Qoi->Prev = Px;
+    }
+    return Len;
+}
+
+static void qoiPut32(uint8_t *Dst, uint32_t Value)
+{
+    Dst[0] = (uint8_t)(Value >> 24);
+    Dst[1] = (uint8_t)(Value >> 16);
+    Dst[2] = (uint8_t)(Value >> 8);
+    Dst[3] = (uint8_t)Value;
+}
+
+// Write Width x Height pixels to Path in the format its extension names.
+// A partial file is removed on failure. Returns 0 on failure.
+int imageWrite(const char *Path, const uint32_t *Pixels, int Width, int Height)
+{
+    const ImageFormat Format = imageFormatOf(Path);
+    if (Format == IF_None)
+    {
+        fprintf(stderr, "Unknown image format: %s (use .ppm, .pam or .qoi)\n", Path);
+        return 0;
+    }
+
+    FILE *File = fopen(Path, "wb");
+    uint8_t *Row = malloc(((size_t)Width * 5) + 16);
+    if (!File || !Row)
+    {
+        fprintf(stderr, "Cannot write %s: %s\n", Path, strerror(errno));
+        if (File)
+        {
+            fclose(File);
+            (void)unlink(Path);
+        }
+        free(Row);
+        return 0;
+    }
+
+    int Ok = 1;
+    if (Format == IF_Ppm)
+    {
+        Ok = fprintf(File, "P6\n%d %d\n255\n", Width, Height) > 0;
+    }
+    else if (Format == IF_Pam)
+    {
+        Ok = fprintf(File, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n", Width, Height) > 0;
+    }
+    else
+    {
+        // Magic, size, three channels, sRGB with linear alpha.
+        uint8_t Header[14] = {'q', 'o', 'i', 'f'};
+        qoiPut32(Header + 4, (uint32_t)Width);
+        qoiPut32(Header + 8, (uint32_t)Height);
+        Header[12] = 3;
+        Header[13] = 0;
+        Ok = fwrite(Header, sizeof Header, 1, File) == 1;
+    }
+
+    QoiState Qoi = {.Prev = 0xff000000u};
+    for (int row = 0; Ok && row < Height; ++row)
+    {
+        const uint32_t *Src = Pixels + ((size_t)row * Width);
+        size_t Len = (Format == IF_Qoi) ? qoiRow(&Qoi, Src, Width, Row) : imageRowRgb(Src, Width, Row);
+        if (Format == IF_Qoi && row == Height - 1)
+        {
+            static const uint8_t End[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+            Len += qoiFlushRun(&Qoi, Row + Len);
+            memcpy(Row + Len, End, sizeof End);
+            Len += sizeof End;
+        }
+        Ok = fwrite(Row, 1, Len, File) == Len;
+    }
+    free(Row);
+
+    if (fclose(File) != 0 || !Ok)
+    {
+        fprintf(stderr, "Cannot write %s: %s\n", Path, strerror(errno));
+        (void)unlink(Path);
+        return 0;
+    }
+    return 1;
+}
+
+#endif // IMAGE_OUT_IMPLEMENTATION
+
+#endif // IMAGE_OUT_H
@@ -0,0 +1,237 @@
+// Line-oriented UNIX socket helpers used by the wall daemon and its client.
+// One request line is sent per connection and answered with one reply line.
+#ifndef IPC_H
+#define IPC_H
+
+#include <signal.h>
+#include <stddef.h>
+
+// Maximum length of a request or reply line, including the newline.
+#define IPC_LINE_MAX 8192
+
+int ipcSocketPath(char *Buffer, size_t Size);
+int ipcListen(const char *Path);
+int ipcConnect(const char *Path);
+long long ipcDeadline(int Ms);
+int ipcReadLine(int Fd, char *Buffer, size_t Size, long long Deadline, volatile sig_atomic_t *Stop);
+int ipcWriteAll(int Fd, const char *Data, size_t Len, long long Deadline);
+
+#ifdef IPC_IMPLEMENTATION
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Builds the per-user, per-display socket path; returns 0 if it doesn't fit.
+int ipcSocketPath(char *Buffer, size_t Size)
+{
+    const char *Dir = getenv("XDG_RUNTIME_DIR");
+    const char *Disp = getenv("DISPLAY");
+    char Name[64];
+    size_t idx = 0;
+
+    if (!Dir || !*Dir)
+    {
+        Dir = "/tmp";
+    }
+    if (!Disp)
+    {
+        Disp = "";
+    }
+
+    // Display names may contain '/' (e.g. launchd sockets); keep the name flat.
+    for (; Disp[idx] && idx < sizeof Name - 1; ++idx)
+    {
+        Name[idx] = (Disp[idx] == '/') ? '_' : Disp[idx];
+    }
+    Name[idx] = 0;
+
+    int Len = snprintf(Buffer, Size, "%s/wall-%u-%s.sock", Dir, (unsigned)getuid(), Name);
+    return Len > 0 && (size_t)Len < Size && (size_t)Len < sizeof(((struct sockaddr_un *)0)->sun_path);
+}
+
+static int ipcAddress(const char *Path, struct sockaddr_un *Addr)
+{
+    memset(Addr, 0, sizeof *Addr);
+    Addr->sun_family = AF_UNIX;
+    size_t Len = strlen(Path);
+    if (Len >= sizeof Addr->sun_path)
+    {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    memcpy(Addr->sun_path, Path, Len + 1);
+    return 1;
+}
+
+// Connects to a running daemon; returns -1 if none is listening.
+int ipcConnect(const char *Path)
+{
+    struct sockaddr_un Addr;
+    if (!ipcAddress(Path, &Addr))
+    {
+        return -1;
+    }
+
+    int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Fd < 0)
+    {
+        return -1;
+    }
+    if (connect(Fd, (struct sockaddr *)&Addr, sizeof Addr) != 0)
+    {
+        close(Fd);
+        return -1;
+    }
+    return Fd;
+}
+
+// Binds the daemon socket. A stale socket file is replaced, a live one is not.
+int ipcListen(const char *Path)
+{
+    struct sockaddr_un Addr;
+    if (!ipcAddress(Path, &Addr))
+    {
+        return -1;
+    }
+
+    int Live = ipcConnect(Path);
+    if (Live >= 0)
+    {
+        close(Live);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    (void)unlink(Path);
+
+    int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Fd < 0)
+    {
+        return -1;
+    }
+
+    mode_t OldMask = umask(077);
+    int Bound = bind(Fd, (struct sockaddr *)&Addr, sizeof Addr);
+    umask(OldMask);
+
+    if (Bound != 0 || listen(Fd, 8) != 0)
+    {
+        int Err = errno;
+        close(Fd);
+        errno = Err;
+        return -1;
+    }
+    return Fd;
+}
+
+static long long ipcNow(void)
+{
+    struct timespec Now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &Now);
+    return ((long long)Now.tv_sec * 1000) + (Now.tv_nsec / 1000000);
+}
+
+// Absolute deadline Ms milliseconds from now for the calls below; a
+// negative Ms waits forever.
+long long ipcDeadline(int Ms)
+{
+    return (Ms < 0) ? -1 : ipcNow() + Ms;
+}
+
+// Waits until Fd is ready for Events or Deadline passes. Returns 0 on
+// timeout, error, or an interruption while *Stop is set.
+static int ipcWait(int Fd, short Events, long long Deadline, volatile sig_atomic_t *Stop)
+{
+    for (;;)
+    {
+        long long Left = -1;
+        if (Deadline >= 0)
+        {
+            Left = Deadline - ipcNow();
+            if (Left <= 0)
+            {
+                errno = ETIMEDOUT;
+                return 0;
+            }
+        }
+        struct pollfd Poll = {.fd = Fd, .events = Events};
+        int Ready = poll(&Poll, 1, (Left > INT_MAX) ? INT_MAX : (int)Left);
+        if (Ready > 0)
+        {
+            return 1;
+        }
+        if (Ready < 0 && (errno != EINTR || (Stop && *Stop)))
+        {
+            return 0;
+        }
+    }
+}
+
+// Reads up to and excluding the first newline; anything after it is
+// dropped, as there is one line per connection. The whole line must arrive
+// by Deadline, so a client trickling bytes can't hold the caller. Returns
+// 0 on EOF, error, timeout, a stop request or an over-long line.
+int ipcReadLine(int Fd, char *Buffer, size_t Size, long long Deadline, volatile sig_atomic_t *Stop)
+{
+    size_t Used = 0;
+    while (Used + 1 < Size)
+    {
+        if (!ipcWait(Fd, POLLIN, Deadline, Stop))
+        {
+            return 0;
+        }
+        ssize_t Got = recv(Fd, Buffer + Used, Size - 1 - Used, MSG_DONTWAIT);
+        if (Got < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
+        }
+        if (Got <= 0)
+        {
+            return 0;
+        }
+        char *End = memchr(Buffer + Used, '\n', (size_t)Got);
+        if (End)
+        {
+            *End = 0;
+            return 1;
+        }
+        Used += (size_t)Got;
+    }
+    return 0;
+}
+
+// Writes all of Data by Deadline. Returns 0 on error or timeout.
+int ipcWriteAll(int Fd, const char *Data, size_t Len, long long Deadline)
+{
+    while (Len)
+    {
+        if (!ipcWait(Fd, POLLOUT, Deadline, NULL))
+        {
+            return 0;
+        }
+        ssize_t Put = send(Fd, Data, Len, MSG_DONTWAIT);
+        if (Put < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
+        }
+        if (Put <= 0)
+        {
+            return 0;
+        }
+        Data += Put;
+        Len -= (size_t)Put;
+    }
+    return 1;
+}
+
+#endif // IPC_IMPLEMENTATION
+
+#endif // IPC_H
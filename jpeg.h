@@ -0,0 +1,284 @@
+// Decodes JPEG images near the size they are shown at.
+// libjpeg-turbo can run a reduced inverse DCT (scale M/8), which skips most
+// of the decode work and memory when a large photo lands on a small screen.
+// The decode can also be streamed one row at a time for a caller that
+// scales it down anyway.
+#ifndef JPEG_LOADER_H
+#define JPEG_LOADER_H
+
+#include <Imlib2.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Reports the full image size and asks for the smallest size the decode
+// must still cover.
+typedef void (*JpegFitFn)(void *user, int srcW, int srcH, int *needW, int *needH);
+
+typedef struct JpegStream JpegStream;
+
+Imlib_Image loadJpeg(const char *path, JpegFitFn fit, void *user);
+JpegStream *jpegStreamOpen(const char *path, JpegFitFn fit, void *user, int *width, int *height);
+int jpegProbe(const char *path, JpegFitFn fit, void *user, int *width, int *height, size_t *coefBytes);
+const uint32_t *jpegStreamRow(JpegStream *js, int y);
+void jpegStreamClose(JpegStream *js);
+
+#ifdef JPEG_LOADER_IMPLEMENTATION
+
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pixbuf.h"
+
+typedef struct
+{
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+} JpegError;
+
+struct JpegStream
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegError err;
+    FILE *file;
+    uint32_t *row; // The last row read by jpegStreamRow.
+    int next;      // Rows read or skipped so far.
+    int failed;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+    JpegError *err = (JpegError *)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, msg);
+    fprintf(stderr, "JPEG decode error: %s\n", msg);
+    longjmp(err->jump, 1);
+}
+
+// Warnings about corrupt but decodable data are not worth a line each.
+static void jpegOutputMessage(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+void jpegStreamClose(JpegStream *js)
+{
+    jpeg_destroy_decompress(&js->cinfo);
+    fclose(js->file);
+    free(js->row);
+    free(js);
+}
+
+// Picks the smallest reduced IDCT (scale M/8) whose output still covers
+// what fit asks for.
+static void jpegPickScale(struct jpeg_decompress_struct *cinfo, JpegFitFn fit, void *user)
+{
+    int needW = (int)cinfo->image_width;
+    int needH = (int)cinfo->image_height;
+    if (fit)
+    {
+        fit(user, (int)cinfo->image_width, (int)cinfo->image_height, &needW, &needH);
+    }
+
+    cinfo->scale_denom = 8;
+    for (unsigned int num = 1; num <= 8; ++num)
+    {
+        cinfo->scale_num = num;
+        jpeg_calc_output_dimensions(cinfo);
+        if ((int)cinfo->output_width >= needW && (int)cinfo->output_height >= needH)
+        {
+            break;
+        }
+    }
+}
+
+// Reads just the header of path: the size jpegStreamOpen would decode it
+// at, and the bytes of the whole-image coefficient buffer libjpeg keeps for
+// progressive files (0 for sequential ones). Returns 0 if libjpeg can't
+// produce BGRA for this file.
+int jpegProbe(const char *path, JpegFitFn fit, void *user, int *width, int *height, size_t *coefBytes)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegError err;
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+
+    cinfo.err = jpeg_std_error(&err.base);
+    err.base.error_exit = jpegErrorExit;
+    err.base.output_message = jpegOutputMessage;
+    if (setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        return 0;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+    const int ok = cinfo.jpeg_color_space != JCS_CMYK && cinfo.jpeg_color_space != JCS_YCCK;
+    if (ok)
+    {
+        jpegPickScale(&cinfo, fit, user);
+        *width = (int)cinfo.output_width;
+        *height = (int)cinfo.output_height;
+
+        // Coefficients are kept at full size whatever the output scale.
+        *coefBytes = 0;
+        for (int ci = 0; jpeg_has_multiple_scans(&cinfo) && ci < cinfo.num_components; ++ci)
+        {
+            const jpeg_component_info *comp = &cinfo.comp_info[ci];
+            *coefBytes += (size_t)comp->width_in_blocks * comp->height_in_blocks * DCTSIZE2 * sizeof(JCOEF);
+        }
+    }
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    return ok;
+}
+
+// Starts decoding at the smallest M/8 scale that still covers what fit
+// asks for. Returns NULL if libjpeg can't produce BGRA for this file (e.g.
+// CMYK) so the caller can fall back to Imlib2's own loader.
+JpegStream *jpegStreamOpen(const char *path, JpegFitFn fit, void *user, int *width, int *height)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+    JpegStream *js = calloc(1, sizeof *js);
+    if (!js)
+    {
+        fclose(file);
+        return NULL;
+    }
+    js->file = file;
+
+    js->cinfo.err = jpeg_std_error(&js->err.base);
+    js->err.base.error_exit = jpegErrorExit;
+    js->err.base.output_message = jpegOutputMessage;
+    if (setjmp(js->err.jump))
+    {
+        jpegStreamClose(js);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&js->cinfo);
+    jpeg_stdio_src(&js->cinfo, file);
+    jpeg_read_header(&js->cinfo, TRUE);
+
+    if (js->cinfo.jpeg_color_space == JCS_CMYK || js->cinfo.jpeg_color_space == JCS_YCCK)
+    {
+        jpegStreamClose(js);
+        return NULL;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    js->cinfo.out_color_space = JCS_EXT_BGRA; // Imlib2's ARGB32 words in memory order.
+#else
+    js->cinfo.out_color_space = JCS_EXT_ARGB;
+#endif
+
+    jpegPickScale(&js->cinfo, fit, user);
+    jpeg_start_decompress(&js->cinfo);
+    *width = (int)js->cinfo.output_width;
+    *height = (int)js->cinfo.output_height;
+    return js;
+}
+
+// Skips skip scanlines, then reads count of them into dst back to back.
+// Returns 0 on a decode error.
+static int jpegStreamRead(JpegStream *js, int skip, uint32_t *dst, int count)
+{
+    if (js->failed)
+    {
+        return 0;
+    }
+    if (setjmp(js->err.jump))
+    {
+        js->failed = 1;
+        return 0;
+    }
+
+    // libjpeg-turbo discards rows without running the IDCT for most of them.
+    if (skip > 0)
+    {
+        js->next += (int)jpeg_skip_scanlines(&js->cinfo, (JDIMENSION)skip);
+    }
+    for (int idx = 0; idx < count; ++idx)
+    {
+        JSAMPROW row = (JSAMPROW)(dst + ((size_t)idx * js->cinfo.output_width));
+        jpeg_read_scanlines(&js->cinfo, &row, 1);
+    }
+    js->next += count;
+    return 1;
+}
+
+// Returns row y of the reduced image, decoding forward to it. Rows can only
+// be asked for in increasing order, though the last one can be asked for
+// again. Returns NULL on a decode error.
+const uint32_t *jpegStreamRow(JpegStream *js, int y)
+{
+    if (y < js->next - 1 || y >= (int)js->cinfo.output_height)
+    {
+        return NULL;
+    }
+    if (!js->row && !(js->row = malloc((size_t)js->cinfo.output_width * sizeof *js->row)))
+    {
+        return NULL;
+    }
+    if (y >= js->next && !jpegStreamRead(js, y - js->next, js->row, 1))
+    {
+        return NULL;
+    }
+    return js->row;
+}
+
+// Loads a JPEG at the reduced size jpegStreamOpen picks. Returns NULL if
+// libjpeg can't decode it, so the caller can fall back to Imlib2.
+Imlib_Image loadJpeg(const char *path, JpegFitFn fit, void *user)
+{
+    int width;
+    int height;
+    JpegStream *js = jpegStreamOpen(path, fit, user, &width, &height);
+    if (!js)
+    {
+        return NULL;
+    }
+
+    DATA32 *data = pixbufAlloc((size_t)width * height * sizeof *data);
+    if (!data)
+    {
+        fprintf(stderr, "JPEG pixel alloc failed\n");
+        jpegStreamClose(js);
+        return NULL;
+    }
+
+    // Scanlines go straight into the image's buffer, no intermediate copy.
+    const int ok = jpegStreamRead(js, 0, data, height);
+    jpegStreamClose(js);
+    if (!ok)
+    {
+        pixbufFree(data);
+        return NULL;
+    }
+
+    // The image takes ownership and frees the buffer through pixbufMemory.
+    Imlib_Image im = imlib_create_image_using_data_and_memory_function(width, height, data, pixbufMemory);
+    if (!im)
+    {
+        fprintf(stderr, "Imlib image alloc failed\n");
+        pixbufFree(data);
+        return NULL;
+    }
+    imlib_context_set_image(im);
+    imlib_image_set_has_alpha(0);
+    return im;
+}
+
+#endif // JPEG_LOADER_IMPLEMENTATION
+
+#endif // JPEG_LOADER_H
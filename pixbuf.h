@@ -0,0 +1,333 @@
+// Allocator for large pixel buffers: decodes, scaler scratch and composed
+// frames. A full 8K frame touched for the first time costs tens of
+// thousands of 4 KiB page faults; backed by 2 MiB pages it costs dozens.
+// Buffers of a huge page or more are mapped from reserved huge pages
+// (MAP_HUGETLB) when the system has some, and otherwise aligned to 2 MiB
+// and marked for transparent huge pages. Freed buffers are kept for the
+// next allocation they fit, so slideshows, animations and video stop
+// faulting in fresh pages between frames. Smaller requests go to malloc.
+// Thread-safe.
+#ifndef PIXBUF_H
+#define PIXBUF_H
+
+#include <stddef.h>
+
+typedef struct
+{
+    size_t HugeTlb; // Buffers mapped from reserved huge pages.
+    size_t Hinted;  // Buffers mapped with a transparent huge page hint.
+    size_t Reused;  // Allocations served from a freed buffer.
+    size_t Cached;  // Bytes of freed buffers held for reuse.
+} PixbufStats;
+
+void *pixbufAlloc(size_t Size);
+void pixbufFree(void *Data);
+void *pixbufMemory(void *Data, size_t Size);
+void pixbufTrim(void);
+void pixbufSetCacheLimit(size_t Bytes);
+void pixbufGetStats(PixbufStats *Stats);
+size_t pixbufHugePageSize(void);
+void pixbufAdvise(void *Data, size_t Size);
+
+#ifdef PIXBUF_IMPLEMENTATION
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Transparent huge pages are PMD sized: 2 MiB on x86-64 and on arm64 with
+// 4 KiB pages.
+#define PIXBUF_THP_SIZE ((size_t)2 << 20)
+
+// Freed mappings kept for reuse, by count and by default total size.
+#define PIXBUF_CACHE_SLOTS 8
+#define PIXBUF_CACHE_BYTES ((size_t)512 << 20)
+
+// Header in front of every buffer; also keeps the pixels 64-byte aligned
+// for the SIMD paths.
+#define PIXBUF_HEADER 64
+
+typedef struct
+{
+    size_t MapBytes; // Whole mapping, header included; 0 if from malloc.
+    int HugeTlb;
+} PixbufHead;
+
+typedef struct
+{
+    void *Base;
+    PixbufHead Head;
+} PixbufSlot;
+
+static pthread_mutex_t PixbufLock = PTHREAD_MUTEX_INITIALIZER;
+static PixbufSlot PixbufCache[PIXBUF_CACHE_SLOTS]; // Oldest first.
+static int PixbufCacheCount = 0;
+static PixbufStats PixbufCounts;
+static size_t PixbufCacheLimit = PIXBUF_CACHE_BYTES;
+
+static pthread_once_t PixbufOnce = PTHREAD_ONCE_INIT;
+static size_t PixbufHugeSize = PIXBUF_THP_SIZE;
+
+// Default hugetlb page size, as /proc/meminfo reports it.
+static void pixbufInit(void)
+{
+    FILE *File = fopen("/proc/meminfo", "r");
+    char Line[128];
+    unsigned long Kib;
+    while (File && fgets(Line, sizeof Line, File))
+    {
+        if (sscanf(Line, "Hugepagesize: %lu kB", &Kib) == 1 && Kib > 0)
+        {
+            PixbufHugeSize = (size_t)Kib << 10;
+            break;
+        }
+    }
+    if (File)
+    {
+        (void)fclose(File);
+    }
+}
+
+// Size of a reserved huge page; 2 MiB if the kernel doesn't say.
+size_t pixbufHugePageSize(void)
+{
+    pthread_once(&PixbufOnce, pixbufInit);
+    return PixbufHugeSize;
+}
+
+// Ask for transparent huge pages over the page-aligned Data. Only a hint;
+// the kernel may ignore it.
+void pixbufAdvise(void *Data, size_t Size)
+{
+#ifdef MADV_HUGEPAGE
+    (void)madvise(Data, Size, MADV_HUGEPAGE);
+#else
+    (void)Data;
+    (void)Size;
+#endif
+}
+
+// Map Bytes, a multiple of PIXBUF_THP_SIZE. Returns NULL when out of memory.
+static void *pixbufMap(size_t Bytes, int *HugeTlb)
+{
+    *HugeTlb = 0;
+#ifdef MAP_HUGETLB
+    // Fails at once unless huge pages are reserved; 1 GiB pages would waste
+    // most of one on a frame.
+    if (pixbufHugePageSize() <= PIXBUF_THP_SIZE)
+    {
+        void *Base = mmap(NULL, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (Base != MAP_FAILED)
+        {
+            *HugeTlb = 1;
+            return Base;
+        }
+    }
+#endif
+
+    // Map a huge page extra and trim it, so the buffer starts where a
+    // transparent huge page can back it.
+    unsigned char *Raw =
+        mmap(NULL, Bytes + PIXBUF_THP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Raw == MAP_FAILED)
+    {
+        return NULL;
+    }
+    const size_t Lead = (PIXBUF_THP_SIZE - ((uintptr_t)Raw % PIXBUF_THP_SIZE)) % PIXBUF_THP_SIZE;
+    if (Lead)
+    {
+        (void)munmap(Raw, Lead);
+    }
+    (void)munmap(Raw + Lead + Bytes, PIXBUF_THP_SIZE - Lead);
+    pixbufAdvise(Raw + Lead, Bytes);
+    return Raw + Lead;
+}
+
+// Take cache slot Index out, keeping the rest in age order. Called with
+// the lock held.
+static PixbufSlot pixbufTake(int Index)
+{
+    const PixbufSlot Slot = PixbufCache[Index];
+    PixbufCounts.Cached -= Slot.Head.MapBytes;
+    --PixbufCacheCount;
+    memmove(&PixbufCache[Index], &PixbufCache[Index + 1], (size_t)(PixbufCacheCount - Index) * sizeof *PixbufCache);
+    return Slot;
+}
+
+// Take the oldest cached buffers out until Bytes more and Slots more fit
+// the limits, into Out. Called with the lock held; the caller unmaps them
+// after unlocking. Returns how many were taken.
+static int pixbufEvict(size_t Bytes, int Slots, size_t Limit, PixbufSlot *Out)
+{
+    int Count = 0;
+    while (PixbufCacheCount && (PixbufCounts.Cached + Bytes > Limit || PixbufCacheCount + Slots > PIXBUF_CACHE_SLOTS))
+    {
+        Out[Count++] = pixbufTake(0);
+    }
+    return Count;
+}
+
+static void pixbufUnmap(const PixbufSlot *Slots, int Count)
+{
+    for (int idx = 0; idx < Count; ++idx)
+    {
+        (void)munmap(Slots[idx].Base, Slots[idx].Head.MapBytes);
+    }
+}
+
+// Uninitialised, 64-byte aligned Size bytes, released with pixbufFree.
+// Returns NULL when out of memory.
+void *pixbufAlloc(size_t Size)
+{
+    if (Size > SIZE_MAX - PIXBUF_HEADER - (2 * PIXBUF_THP_SIZE))
+    {
+        return NULL;
+    }
+    const size_t Need = Size + PIXBUF_HEADER;
+    PixbufHead Head = {0};
+    PixbufSlot Evicted[PIXBUF_CACHE_SLOTS] = {0};
+    int EvictedCount = 0;
+    void *Base = NULL;
+
+    if (Need < PIXBUF_THP_SIZE)
+    {
+        if (posix_memalign(&Base, PIXBUF_HEADER, Need) != 0)
+        {
+            return NULL;
+        }
+        memcpy(Base, &Head, sizeof Head);
+        return (unsigned char *)Base + PIXBUF_HEADER;
+    }
+
+    // The smallest freed buffer that fits. On a miss the cached ones are all
+    // too small; the oldest go until the new buffer would fit the cache
+    // beside the rest, so that the footprint stays within the limit.
+    const size_t MapBytes = (Need + PIXBUF_THP_SIZE - 1) / PIXBUF_THP_SIZE * PIXBUF_THP_SIZE;
+    pthread_mutex_lock(&PixbufLock);
+    int Best = -1;
+    for (int idx = 0; idx < PixbufCacheCount; ++idx)
+    {
+        const size_t Bytes = PixbufCache[idx].Head.MapBytes;
+        if (Bytes >= Need && (Best < 0 || Bytes < PixbufCache[Best].Head.MapBytes))
+        {
+            Best = idx;
+        }
+    }
+    if (Best >= 0)
+    {
+        const PixbufSlot Slot = pixbufTake(Best);
+        Base = Slot.Base;
+        Head = Slot.Head;
+        PixbufCounts.Reused++;
+    }
+    else
+    {
+        EvictedCount = pixbufEvict(MapBytes, 0, PixbufCacheLimit, Evicted);
+    }
+    pthread_mutex_unlock(&PixbufLock);
+    pixbufUnmap(Evicted, EvictedCount);
+
+    if (!Base)
+    {
+        Head.MapBytes = MapBytes;
+        if (!(Base = pixbufMap(Head.MapBytes, &Head.HugeTlb)))
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&PixbufLock);
+        if (Head.HugeTlb)
+        {
+            PixbufCounts.HugeTlb++;
+        }
+        else
+        {
+            PixbufCounts.Hinted++;
+        }
+        pthread_mutex_unlock(&PixbufLock);
+    }
+    memcpy(Base, &Head, sizeof Head);
+    return (unsigned char *)Base + PIXBUF_HEADER;
+}
+
+// Release a pixbufAlloc buffer, keeping large ones for reuse in place of
+// the oldest cached ones. NULL is ignored.
+void pixbufFree(void *Data)
+{
+    if (!Data)
+    {
+        return;
+    }
+    unsigned char *Base = (unsigned char *)Data - PIXBUF_HEADER;
+    PixbufHead Head;
+    memcpy(&Head, Base, sizeof Head);
+    if (!Head.MapBytes)
+    {
+        free(Base);
+        return;
+    }
+
+    PixbufSlot Evicted[PIXBUF_CACHE_SLOTS] = {0};
+    int EvictedCount = 0;
+    pthread_mutex_lock(&PixbufLock);
+    const int Keep = Head.MapBytes <= PixbufCacheLimit;
+    if (Keep)
+    {
+        EvictedCount = pixbufEvict(Head.MapBytes, 1, PixbufCacheLimit, Evicted);
+        PixbufCache[PixbufCacheCount++] = (PixbufSlot){.Base = Base, .Head = Head};
+        PixbufCounts.Cached += Head.MapBytes;
+    }
+    pthread_mutex_unlock(&PixbufLock);
+    pixbufUnmap(Evicted, EvictedCount);
+    if (!Keep)
+    {
+        (void)munmap(Base, Head.MapBytes);
+    }
+}
+
+// Allocates Size bytes when Data is NULL and frees Data otherwise, the
+// shape of Imlib2's memory functions.
+void *pixbufMemory(void *Data, size_t Size)
+{
+    if (Data)
+    {
+        pixbufFree(Data);
+        return NULL;
+    }
+    return pixbufAlloc(Size);
+}
+
+// Return every cached buffer to the system, for processes that go idle.
+void pixbufTrim(void)
+{
+    PixbufSlot Evicted[PIXBUF_CACHE_SLOTS] = {0};
+    pthread_mutex_lock(&PixbufLock);
+    const int EvictedCount = pixbufEvict(0, 0, 0, Evicted);
+    pthread_mutex_unlock(&PixbufLock);
+    pixbufUnmap(Evicted, EvictedCount);
+}
+
+// Keep at most Bytes of freed buffers from now on; 0 disables the cache,
+// for callers whose memory is accounted buffer by buffer.
+void pixbufSetCacheLimit(size_t Bytes)
+{
+    PixbufSlot Evicted[PIXBUF_CACHE_SLOTS] = {0};
+    pthread_mutex_lock(&PixbufLock);
+    PixbufCacheLimit = Bytes;
+    const int EvictedCount = pixbufEvict(0, 0, Bytes, Evicted);
+    pthread_mutex_unlock(&PixbufLock);
+    pixbufUnmap(Evicted, EvictedCount);
+}
+
+void pixbufGetStats(PixbufStats *Stats)
+{
+    pthread_mutex_lock(&PixbufLock);
+    *Stats = PixbufCounts;
+    pthread_mutex_unlock(&PixbufLock);
+}
+
+#endif // PIXBUF_IMPLEMENTATION
+
+#endif // PIXBUF_H
@@ -0,0 +1,208 @@
+// Decodes non-interlaced PNG images one row at a time, so an image that is
+// scaled down on the way to the screen never has to be resident as a whole.
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <stdint.h>
+
+typedef struct PngStream PngStream;
+
+int pngProbe(const char *path, int *width, int *height, int *interlaced);
+PngStream *pngStreamOpen(const char *path, int *width, int *height, int *hasAlpha);
+const uint32_t *pngStreamRow(PngStream *ps, int y);
+void pngStreamClose(PngStream *ps);
+
+#ifdef PNG_STREAM_IMPLEMENTATION
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct PngStream
+{
+    png_structp png;
+    png_infop info;
+    FILE *file;
+    uint32_t *row; // The last row read, as ARGB32 words.
+    int height;
+    int next; // Rows read so far.
+    int failed;
+};
+
+static void pngError(png_structp png, png_const_charp msg)
+{
+    fprintf(stderr, "PNG decode error: %s\n", msg);
+    png_longjmp(png, 1);
+}
+
+// Warnings about ancillary chunks are not worth a line each.
+static void pngWarning(png_structp png, png_const_charp msg)
+{
+    (void)png;
+    (void)msg;
+}
+
+void pngStreamClose(PngStream *ps)
+{
+    png_destroy_read_struct(&ps->png, &ps->info, NULL);
+    fclose(ps->file);
+    free(ps->row);
+    free(ps);
+}
+
+// Reads the size and interlacing from the IHDR chunk, which a PNG must
+// start with. Returns 0 if path is not a PNG.
+int pngProbe(const char *path, int *width, int *height, int *interlaced)
+{
+    unsigned char head[33]; // Signature, chunk length and type, IHDR data.
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    const size_t got = fread(head, 1, sizeof head, file);
+    fclose(file);
+    if (got != sizeof head || png_sig_cmp(head, 0, 8) != 0 || memcmp(head + 12, "IHDR", 4) != 0)
+    {
+        return 0;
+    }
+
+    const png_uint_32 w = png_get_uint_32(head + 16);
+    const png_uint_32 h = png_get_uint_32(head + 20);
+    if (w == 0 || h == 0 || w > INT32_MAX / 4 || h > INT32_MAX)
+    {
+        return 0;
+    }
+    *width = (int)w;
+    *height = (int)h;
+    *interlaced = head[28] != PNG_INTERLACE_NONE;
+    return 1;
+}
+
+// Reads the header and sets up conversion to ARGB32. Returns NULL if path
+// is not a PNG or is interlaced, whose rows only exist once every pass is
+// in; the caller then loads it whole.
+PngStream *pngStreamOpen(const char *path, int *width, int *height, int *hasAlpha)
+{
+    unsigned char sig[8];
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+    if (fread(sig, 1, sizeof sig, file) != sizeof sig || png_sig_cmp(sig, 0, sizeof sig) != 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    PngStream *ps = calloc(1, sizeof *ps);
+    if (!ps)
+    {
+        fclose(file);
+        return NULL;
+    }
+    ps->file = file;
+    ps->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, pngError, pngWarning);
+    ps->info = ps->png ? png_create_info_struct(ps->png) : NULL;
+    if (!ps->info || setjmp(png_jmpbuf(ps->png)))
+    {
+        pngStreamClose(ps);
+        return NULL;
+    }
+
+    png_init_io(ps->png, file);
+    png_set_sig_bytes(ps->png, sizeof sig);
+    png_read_info(ps->png, ps->info);
+
+    png_uint_32 w;
+    png_uint_32 h;
+    int bitDepth;
+    int colorType;
+    int interlace;
+    png_get_IHDR(ps->png, ps->info, &w, &h, &bitDepth, &colorType, &interlace, NULL, NULL);
+    if (interlace != PNG_INTERLACE_NONE || w > INT32_MAX / 4 || h > INT32_MAX)
+    {
+        pngStreamClose(ps);
+        return NULL;
+    }
+
+    const int trns = png_get_valid(ps->png, ps->info, PNG_INFO_tRNS) != 0;
+    const int alpha = (colorType & PNG_COLOR_MASK_ALPHA) || trns;
+    if (colorType == PNG_COLOR_TYPE_PALETTE)
+    {
+        png_set_palette_to_rgb(ps->png);
+    }
+    if (colorType == PNG_COLOR_TYPE_GRAY && bitDepth < 8)
+    {
+        png_set_expand_gray_1_2_4_to_8(ps->png);
+    }
+    if (trns)
+    {
+        png_set_tRNS_to_alpha(ps->png);
+    }
+    if (bitDepth == 16)
+    {
+        png_set_strip_16(ps->png);
+    }
+    if (!(colorType & PNG_COLOR_MASK_COLOR))
+    {
+        png_set_gray_to_rgb(ps->png);
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    png_set_bgr(ps->png); // Imlib2's ARGB32 words in memory order.
+    if (!alpha)
+    {
+        png_set_filler(ps->png, 0xff, PNG_FILLER_AFTER);
+    }
+#else
+    if (alpha)
+    {
+        png_set_swap_alpha(ps->png);
+    }
+    else
+    {
+        png_set_filler(ps->png, 0xff, PNG_FILLER_BEFORE);
+    }
+#endif
+    png_read_update_info(ps->png, ps->info);
+
+    ps->row = malloc((size_t)w * sizeof *ps->row);
+    if (!ps->row)
+    {
+        fprintf(stderr, "Out of memory for a %u pixel PNG row\n", (unsigned)w);
+        pngStreamClose(ps);
+        return NULL;
+    }
+    ps->height = (int)h;
+    *width = (int)w;
+    *height = (int)h;
+    *hasAlpha = alpha;
+    return ps;
+}
+
+// Returns row y, decoding forward to it. Rows can only be asked for in
+// increasing order, though the last one can be asked for again. Returns
+// NULL on a decode error.
+const uint32_t *pngStreamRow(PngStream *ps, int y)
+{
+    if (ps->failed || y < ps->next - 1 || y >= ps->height)
+    {
+        return NULL;
+    }
+    if (setjmp(png_jmpbuf(ps->png)))
+    {
+        ps->failed = 1;
+        return NULL;
+    }
+    for (; ps->next <= y; ++ps->next)
+    {
+        png_read_row(ps->png, (png_bytep)ps->row, NULL);
+    }
+    return ps->row;
+}
+
+#endif // PNG_STREAM_IMPLEMENTATION
+
+#endif // PNG_STREAM_H
@@ -0,0 +1,176 @@
+// Fixed pool of worker threads for data-parallel loops.
+// poolRun hands out task indices from a shared counter, so uneven tasks
+// balance themselves; the calling thread works alongside the pool.
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+typedef void (*PoolTaskFn)(void *User, int Index);
+
+typedef struct WorkPool WorkPool;
+
+WorkPool *poolCreate(int Threads);
+int poolThreads(const WorkPool *Pool);
+void poolRun(WorkPool *Pool, PoolTaskFn Fn, void *User, int Count);
+void poolDestroy(WorkPool *Pool);
+
+#ifdef WORK_POOL_IMPLEMENTATION
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct WorkPool
+{
+    pthread_mutex_t Lock;
+    pthread_cond_t Wake; // A new job was posted, or Stop was set.
+    pthread_cond_t Done; // The last worker left the current job.
+    pthread_t *Workers;
+    int Threads; // Including the caller of poolRun.
+    int Stop;
+    unsigned Generation;
+    PoolTaskFn Fn;
+    void *User;
+    int Count;
+    int Next; // Next unclaimed index, taken atomically.
+    int Busy; // Workers not yet done with the current job.
+};
+
+static void poolDrain(WorkPool *Pool)
+{
+    for (;;)
+    {
+        const int Index = __atomic_fetch_add(&Pool->Next, 1, __ATOMIC_RELAXED);
+        if (Index >= Pool->Count)
+        {
+            return;
+        }
+        Pool->Fn(Pool->User, Index);
+    }
+}
+
+static void *poolWorker(void *Arg)
+{
+    WorkPool *Pool = Arg;
+    unsigned Seen = 0;
+
+    pthread_mutex_lock(&Pool->Lock);
+    for (;;)
+    {
+        while (!Pool->Stop && Pool->Generation == Seen)
+        {
+            pthread_cond_wait(&Pool->Wake, &Pool->Lock);
+        }
+        if (Pool->Stop)
+        {
+            break;
+        }
+        Seen = Pool->Generation;
+        pthread_mutex_unlock(&Pool->Lock);
+
+        poolDrain(Pool);
+
+        pthread_mutex_lock(&Pool->Lock);
+        if (--Pool->Busy == 0)
+        {
+            pthread_cond_signal(&Pool->Done);
+        }
+    }
+    pthread_mutex_unlock(&Pool->Lock);
+    return NULL;
+}
+
+// Start Threads - 1 workers; 0 or less means one per online CPU. Returns
+// NULL on failure. A pool that could only start some workers still works.
+WorkPool *poolCreate(int Threads)
+{
+    if (Threads <= 0)
+    {
+        long Online = sysconf(_SC_NPROCESSORS_ONLN);
+        Threads = (Online > 0) ? (int)Online : 1;
+    }
+
+    WorkPool *Pool = calloc(1, sizeof *Pool);
+    if (!Pool)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&Pool->Lock, NULL);
+    pthread_cond_init(&Pool->Wake, NULL);
+    pthread_cond_init(&Pool->Done, NULL);
+    Pool->Threads = 1;
+
+    if (Threads > 1 && (Pool->Workers = calloc((size_t)Threads - 1, sizeof *Pool->Workers)))
+    {
+        while (Pool->Threads < Threads &&
+               pthread_create(&Pool->Workers[Pool->Threads - 1], NULL, poolWorker, Pool) == 0)
+        {
+            ++Pool->Threads;
+        }
+    }
+    return Pool;
+}
+
+int poolThreads(const WorkPool *Pool)
+{
+    return Pool ? Pool->Threads : 1;
+}
+
+// Call Fn(User, idx) for every idx in [0, Count) and return when all are
+// done. Not reentrant: Fn must not call poolRun on the same pool.
+void poolRun(WorkPool *Pool, PoolTaskFn Fn, void *User, int Count)
+{
+    if (!Pool || Pool->Threads == 1 || Count <= 1)
+    {
+        for (int idx = 0; idx < Count; ++idx)
+        {
+            Fn(User, idx);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&Pool->Lock);
+    Pool->Fn = Fn;
+    Pool->User = User;
+    Pool->Count = Count;
+    Pool->Next = 0;
+    Pool->Busy = Pool->Threads - 1;
+    ++Pool->Generation;
+    pthread_cond_broadcast(&Pool->Wake);
+    pthread_mutex_unlock(&Pool->Lock);
+
+    poolDrain(Pool);
+
+    pthread_mutex_lock(&Pool->Lock);
+    while (Pool->Busy)
+    {
+        pthread_cond_wait(&Pool->Done, &Pool->Lock);
+    }
+    pthread_mutex_unlock(&Pool->Lock);
+}
+
+void poolDestroy(WorkPool *Pool)
+{
+    if (!Pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&Pool->Lock);
+    Pool->Stop = 1;
+    pthread_cond_broadcast(&Pool->Wake);
+    pthread_mutex_unlock(&Pool->Lock);
+
+    for (int idx = 0; idx < Pool->Threads - 1; ++idx)
+    {
+        pthread_join(Pool->Workers[idx], NULL);
+    }
+    pthread_mutex_destroy(&Pool->Lock);
+    pthread_cond_destroy(&Pool->Wake);
+    pthread_cond_destroy(&Pool->Done);
+    free(Pool->Workers);
+    free(Pool);
+}
+
+#endif // WORK_POOL_IMPLEMENTATION
+
+#endif // WORK_POOL_H
@@ -0,0 +1,144 @@
+// Bounded single-producer, single-consumer ring of frame slots.
+// The ring only hands out slot indices; callers keep the frames themselves
+// in an array of the same capacity.
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <pthread.h>
+
+#define RING_TIMEOUT -1 // Nothing arrived before the timeout.
+#define RING_DONE -2    // Closed and drained, or cancelled.
+
+typedef struct
+{
+    pthread_mutex_t Lock;
+    pthread_cond_t Changed;
+    int Capacity;
+    int Head;  // Oldest filled slot.
+    int Count; // Filled slots, including one being read.
+    int Closed;
+    int Cancelled;
+} FrameRing;
+
+void ringInit(FrameRing *Ring, int Capacity);
+int ringBeginWrite(FrameRing *Ring);
+void ringEndWrite(FrameRing *Ring);
+void ringClose(FrameRing *Ring);
+int ringBeginRead(FrameRing *Ring, int TimeoutMs);
+void ringEndRead(FrameRing *Ring);
+void ringCancel(FrameRing *Ring);
+void ringDestroy(FrameRing *Ring);
+
+#ifdef FRAME_RING_IMPLEMENTATION
+
+#include <time.h>
+
+void ringInit(FrameRing *Ring, int Capacity)
+{
+    pthread_condattr_t Attr;
+    pthread_condattr_init(&Attr);
+    pthread_condattr_setclock(&Attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&Ring->Lock, NULL);
+    pthread_cond_init(&Ring->Changed, &Attr);
+    pthread_condattr_destroy(&Attr);
+    Ring->Capacity = Capacity;
+    Ring->Head = 0;
+    Ring->Count = 0;
+    Ring->Closed = 0;
+    Ring->Cancelled = 0;
+}
+
+// Wait for a free slot and return its index, or RING_DONE once cancelled.
+int ringBeginWrite(FrameRing *Ring)
+{
+    pthread_mutex_lock(&Ring->Lock);
+    while (!Ring->Cancelled && Ring->Count == Ring->Capacity)
+    {
+        pthread_cond_wait(&Ring->Changed, &Ring->Lock);
+    }
+    const int Slot = Ring->Cancelled ? RING_DONE : (Ring->Head + Ring->Count) % Ring->Capacity;
+    pthread_mutex_unlock(&Ring->Lock);
+    return Slot;
+}
+
+// Publish the slot returned by ringBeginWrite.
+void ringEndWrite(FrameRing *Ring)
+{
+    pthread_mutex_lock(&Ring->Lock);
+    ++Ring->Count;
+    pthread_cond_broadcast(&Ring->Changed);
+    pthread_mutex_unlock(&Ring->Lock);
+}
+
+// No more frames will be written; the reader drains what is left.
+void ringClose(FrameRing *Ring)
+{
+    pthread_mutex_lock(&Ring->Lock);
+    Ring->Closed = 1;
+    pthread_cond_broadcast(&Ring->Changed);
+    pthread_mutex_unlock(&Ring->Lock);
+}
+
+// Wait up to TimeoutMs for the oldest frame and return its slot. The slot
+// stays valid until ringEndRead.
+int ringBeginRead(FrameRing *Ring, int TimeoutMs)
+{
+    struct timespec Until;
+    clock_gettime(CLOCK_MONOTONIC, &Until);
+    Until.tv_sec += TimeoutMs / 1000;
+    Until.tv_nsec += (long)(TimeoutMs % 1000) * 1000000L;
+    if (Until.tv_nsec >= 1000000000L)
+    {
+        Until.tv_sec += 1;
+        Until.tv_nsec -= 1000000000L;
+    }
+
+    int Slot = RING_TIMEOUT;
+    pthread_mutex_lock(&Ring->Lock);
+    while (!Ring->Cancelled && !Ring->Count && !Ring->Closed)
+    {
+        if (pthread_cond_timedwait(&Ring->Changed, &Ring->Lock, &Until) != 0)
+        {
+            break;
+        }
+    }
+    if (Ring->Cancelled || (!Ring->Count && Ring->Closed))
+    {
+        Slot = RING_DONE;
+    }
+    else if (Ring->Count)
+    {
+        Slot = Ring->Head;
+    }
+    pthread_mutex_unlock(&Ring->Lock);
+    return Slot;
+}
+
+// Hand the slot returned by ringBeginRead back to the writer.
+void ringEndRead(FrameRing *Ring)
+{
+    pthread_mutex_lock(&Ring->Lock);
+    Ring->Head = (Ring->Head + 1) % Ring->Capacity;
+    --Ring->Count;
+    pthread_cond_broadcast(&Ring->Changed);
+    pthread_mutex_unlock(&Ring->Lock);
+}
+
+// Wake and stop the writer; used when the reader quits early.
+void ringCancel(FrameRing *Ring)
+{
+    pthread_mutex_lock(&Ring->Lock);
+    Ring->Cancelled = 1;
+    pthread_cond_broadcast(&Ring->Changed);
+    pthread_mutex_unlock(&Ring->Lock);
+}
+
+void ringDestroy(FrameRing *Ring)
+{
+    pthread_mutex_destroy(&Ring->Lock);
+    pthread_cond_destroy(&Ring->Changed);
+}
+
+#endif // FRAME_RING_IMPLEMENTATION
+
+#endif // FRAME_RING_H
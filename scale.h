@@ -0,0 +1,844 @@
+// Separable ARGB32 resampler with SIMD kernels chosen at runtime.
+// Source rows are pulled through a callback in increasing order, filtered
+// horizontally into a small ring of 16-bit rows, and filtered vertically
+// into the destination, so the source never has to be resident as a whole.
+// Optionally the colour channels are filtered in linear light: sRGB bytes
+// are expanded through a lookup table to 15-bit linear samples and encoded
+// back the same way, which keeps downscaled high-contrast detail from
+// darkening.
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    SF_Box,
+    SF_Bilinear,
+    SF_Bicubic,
+    SF_Lanczos,
+    SF_Count
+} ScaleFilter;
+
+// Returns source row Y. Within one scaleRows call Y only increases.
+typedef const uint32_t *(*ScaleRowFn)(void *User, int Y);
+
+// Filter taps along one axis of the produced window.
+typedef struct
+{
+    int Count;      // Output pixels along this axis.
+    int Taps;       // Taps per output, padded to even.
+    int *Start;     // First source index per output.
+    int *Len;       // Non-zero taps per output.
+    int32_t *Pairs; // Taps / 2 Q14 weight pairs per output, (w0 | w1 << 16).
+} ScaleAxis;
+
+typedef struct ScaleKernels ScaleKernels;
+
+typedef struct
+{
+    int SrcW;
+    int SrcH;
+    int ExpandLo;    // First source column the window reads.
+    int ExpandCount; // Source columns read, from ExpandLo.
+    int ExpandPad;   // Zeroed columns after them for over-reading kernels.
+    ScaleAxis Horz;
+    ScaleAxis Vert;
+    int Linear; // Filter colour in linear light.
+    const ScaleKernels *Kern;
+} ScalePlan;
+
+int scalePlanInit(ScalePlan *Plan, int SrcW, int SrcH, int DstW, int DstH, int ClipX, int ClipY, int ClipW,
+                  int ClipH, ScaleFilter Filter, int Linear);
+void scalePlanFree(ScalePlan *Plan);
+int scaleRows(const ScalePlan *Plan, ScaleRowFn GetRow, void *User, int Row0, int Row1, uint32_t *Dst,
+              size_t DstStride);
+const char *scaleSimdName(void);
+
+#ifdef SCALE_IMPLEMENTATION
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixbuf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCALE_X86 1
+#endif
+
+#define SCALE_PREC 14   // Weight fraction bits.
+#define SCALE_SHIFT 7   // Extra bits of an 8-bit sample in the 16-bit rows.
+#define SCALE_MAX 32767 // Ceiling of a 16-bit intermediate sample.
+
+// Byte of an ARGB32 word in memory that holds alpha.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SCALE_ALPHA_BYTE 3
+#else
+#define SCALE_ALPHA_BYTE 0
+#endif
+
+struct ScaleKernels
+{
+    const char *Name;
+    // 8-bit pixels to 16-bit samples.
+    void (*Expand)(const uint32_t *Src, int16_t *Dst, int Count);
+    // One row through the horizontal taps; Src is relative to ExpandLo.
+    void (*Horizontal)(const int16_t *Src, int16_t *Dst, const ScaleAxis *Ax);
+    // Weighted sum of NPairs * 2 rows over samples [Begin, Len).
+    void (*Vertical)(int16_t *const *Rows, const int32_t *Pairs, int NPairs, int16_t *Dst, int Begin, int Len);
+    // 16-bit samples back to 8-bit pixels.
+    void (*Pack)(const int16_t *Src, uint32_t *Dst, int Count);
+    // The same with the colour channels through the sRGB tables.
+    void (*ExpandLinear)(const uint32_t *Src, int16_t *Dst, int Count);
+    void (*PackLinear)(const int16_t *Src, uint32_t *Dst, int Count);
+};
+
+// Linear light of each byte of a pixel in memory, at the scale of an
+// expanded 8-bit sample (255 << SCALE_SHIFT is 1.0). The alpha byte's row
+// is the plain expansion. Two spare entries let a gather read 32 bits at
+// the last one.
+static uint16_t ScaleToLinear[(4 * 256) + 2];
+
+// sRGB byte of every intermediate sample in [0, SCALE_MAX], plus three
+// spare entries for the same reason.
+static uint8_t ScaleToSrgb[SCALE_MAX + 1 + 3];
+
+static pthread_once_t ScaleLinearOnce = PTHREAD_ONCE_INIT;
+
+static void scaleLinearInit(void)
+{
+    const double One = 255 << SCALE_SHIFT;
+    for (int val = 0; val < 256; ++val)
+    {
+        const double Srgb = val / 255.0;
+        const double Lin = (Srgb <= 0.04045) ? Srgb / 12.92 : pow((Srgb + 0.055) / 1.055, 2.4);
+        for (int byte = 0; byte < 4; ++byte)
+        {
+            ScaleToLinear[(byte * 256) + val] =
+                (uint16_t)((byte == SCALE_ALPHA_BYTE) ? val << SCALE_SHIFT : lround(Lin * One));
+        }
+    }
+    for (int val = 0; val <= SCALE_MAX; ++val)
+    {
+        const double Lin = (val < One) ? val / One : 1.0;
+        const double Srgb = (Lin <= 0.0031308) ? Lin * 12.92 : (1.055 * pow(Lin, 1.0 / 2.4)) - 0.055;
+        ScaleToSrgb[val] = (uint8_t)lround(Srgb * 255.0);
+    }
+}
+
+static const double ScaleSupport[SF_Count] = {0.5, 1.0, 2.0, 3.0};
+
+static double scaleSinc(double X)
+{
+    if (X == 0.0)
+    {
+        return 1.0;
+    }
+    X *= M_PI;
+    return sin(X) / X;
+}
+
+static double scaleKernel(ScaleFilter Filter, double X)
+{
+    const double A = -0.5; // Catmull-Rom
+    switch (Filter)
+    {
+    case SF_Box:
+        return (X > -0.5 && X <= 0.5) ? 1.0 : 0.0;
+    case SF_Bilinear:
+        X = fabs(X);
+        return X < 1.0 ? 1.0 - X : 0.0;
+    case SF_Bicubic:
+        X = fabs(X);
+        if (X < 1.0)
+        {
+            return (((A + 2.0) * X - (A + 3.0)) * X * X) + 1.0;
+        }
+        return X < 2.0 ? (((X - 5.0) * X + 8.0) * X - 4.0) * A : 0.0;
+    case SF_Lanczos:
+        return (X > -3.0 && X < 3.0) ? scaleSinc(X) * scaleSinc(X / 3.0) : 0.0;
+    default:
+        return 0.0;
+    }
+}
+
+static void scaleAxisFree(ScaleAxis *Ax)
+{
+    free(Ax->Start);
+    free(Ax->Len);
+    free(Ax->Pairs);
+    memset(Ax, 0, sizeof *Ax);
+}
+
+// Window [lo, lo + n) of source samples feeding output I.
+static void scaleAxisSpan(int SrcLen, double Scale, double Support, int I, int *Lo, int *N)
+{
+    double Center = (I + 0.5) * Scale;
+    int Min = (int)(Center - Support + 0.5);
+    int Max = (int)(Center + Support + 0.5);
+    *Lo = Min < 0 ? 0 : Min;
+    *N = (Max > SrcLen ? SrcLen : Max) - *Lo;
+}
+
+// Precompute normalised Q14 taps for outputs [Clip0, Clip0 + ClipLen) of a
+// SrcLen -> DstLen resize. The weights of every output sum to exactly 1.0
+// so flat areas come out unchanged.
+static int scaleAxisInit(ScaleAxis *Ax, int SrcLen, int DstLen, int Clip0, int ClipLen, ScaleFilter Filter)
+{
+    const double Scale = (double)SrcLen / DstLen;
+    const double FScale = Scale > 1.0 ? Scale : 1.0;
+    const double Support = ScaleSupport[Filter] * FScale;
+    int Lo;
+    int N;
+
+    memset(Ax, 0, sizeof *Ax);
+    Ax->Count = ClipLen;
+    for (int idx = 0; idx < ClipLen; ++idx)
+    {
+        scaleAxisSpan(SrcLen, Scale, Support, Clip0 + idx, &Lo, &N);
+        Ax->Taps = N > Ax->Taps ? N : Ax->Taps;
+    }
+    Ax->Taps = (Ax->Taps + 1) & ~1;
+    if (Ax->Taps == 0)
+    {
+        Ax->Taps = 2;
+    }
+
+    double *Weights = malloc((size_t)Ax->Taps * sizeof *Weights);
+    int *Quant = malloc((size_t)Ax->Taps * sizeof *Quant);
+    Ax->Start = malloc((size_t)ClipLen * sizeof *Ax->Start);
+    Ax->Len = malloc((size_t)ClipLen * sizeof *Ax->Len);
+    Ax->Pairs = calloc((size_t)ClipLen * (size_t)(Ax->Taps / 2), sizeof *Ax->Pairs);
+    if (!Weights || !Quant || !Ax->Start || !Ax->Len || !Ax->Pairs)
+    {
+        free(Weights);
+        free(Quant);
+        scaleAxisFree(Ax);
+        return 0;
+    }
+
+    for (int idx = 0; idx < ClipLen; ++idx)
+    {
+        const double Center = (Clip0 + idx + 0.5) * Scale;
+        double Sum = 0.0;
+        scaleAxisSpan(SrcLen, Scale, Support, Clip0 + idx, &Lo, &N);
+        if (N <= 0)
+        {
+            // Degenerate window; sample the nearest pixel.
+            Lo = (int)Center < SrcLen ? (int)Center : SrcLen - 1;
+            N = 1;
+            Weights[0] = 1.0;
+            Sum = 1.0;
+        }
+        else
+        {
+            for (int tap = 0; tap < N; ++tap)
+            {
+                Weights[tap] = scaleKernel(Filter, (tap + Lo - Center + 0.5) / FScale);
+                Sum += Weights[tap];
+            }
+        }
+        if (Sum == 0.0)
+        {
+            Weights[0] = Sum = 1.0;
+            N = 1;
+        }
+
+        int Total = 0;
+        int Peak = 0;
+        for (int tap = 0; tap < N; ++tap)
+        {
+            Quant[tap] = (int)lround(Weights[tap] / Sum * (1 << SCALE_PREC));
+            Total += Quant[tap];
+            Peak = (Quant[tap] > Quant[Peak]) ? tap : Peak;
+        }
+        Quant[Peak] += (1 << SCALE_PREC) - Total;
+
+        int32_t *Pairs = Ax->Pairs + ((size_t)idx * (size_t)(Ax->Taps / 2));
+        for (int tap = 0; tap < N; ++tap)
+        {
+            const uint32_t Half = (uint32_t)(uint16_t)(int16_t)Quant[tap];
+            Pairs[tap / 2] = (int32_t)((uint32_t)Pairs[tap / 2] | (Half << ((tap & 1) * 16)));
+        }
+        Ax->Start[idx] = Lo;
+        Ax->Len[idx] = N;
+    }
+
+    free(Weights);
+    free(Quant);
+    return 1;
+}
+
+static inline int16_t scaleClamp(int32_t Acc)
+{
+    Acc = (Acc + (1 << (SCALE_PREC - 1))) >> SCALE_PREC;
+    return (int16_t)(Acc < 0 ? 0 : (Acc > SCALE_MAX ? SCALE_MAX : Acc));
+}
+
+static inline int16_t scalePairWeight(const int32_t *Pairs, int Tap)
+{
+    return (int16_t)(uint16_t)((uint32_t)Pairs[Tap / 2] >> ((Tap & 1) * 16));
+}
+
+// Portable kernels; also the reference for the SIMD ones.
+
+static void scaleExpandScalar(const uint32_t *Src, int16_t *Dst, int Count)
+{
+    const uint8_t *Bytes = (const uint8_t *)Src;
+    for (int idx = 0; idx < Count * 4; ++idx)
+    {
+        Dst[idx] = (int16_t)(Bytes[idx] << SCALE_SHIFT);
+    }
+}
+
+static void scaleHorizontalScalar(const int16_t *Src, int16_t *Dst, const ScaleAxis *Ax)
+{
+    const int NPairs = Ax->Taps / 2;
+    for (int idx = 0; idx < Ax->Count; ++idx)
+    {
+        const int16_t *In = Src + ((size_t)Ax->Start[idx] * 4);
+        const int32_t *Pairs = Ax->Pairs + ((size_t)idx * NPairs);
+        int32_t Acc[4] = {0, 0, 0, 0};
+        for (int tap = 0; tap < Ax->Len[idx]; ++tap)
+        {
+            const int32_t Weight = scalePairWeight(Pairs, tap);
+            for (int chn = 0; chn < 4; ++chn)
+            {
+                Acc[chn] += In[(tap * 4) + chn] * Weight;
+            }
+        }
+        for (int chn = 0; chn < 4; ++chn)
+        {
+            Dst[(idx * 4) + chn] = scaleClamp(Acc[chn]);
+        }
+    }
+}
+
+static void scaleVerticalScalar(int16_t *const *Rows, const int32_t *Pairs, int NPairs, int16_t *Dst, int Begin,
+                                int Len)
+{
+    for (int idx = Begin; idx < Len; ++idx)
+    {
+        int32_t Acc = 0;
+        for (int tap = 0; tap < NPairs * 2; ++tap)
+        {
+            Acc += Rows[tap][idx] * scalePairWeight(Pairs, tap);
+        }
+        Dst[idx] = scaleClamp(Acc);
+    }
+}
+
+static void scalePackScalar(const int16_t *Src, uint32_t *Dst, int Count)
+{
+    uint8_t *Bytes = (uint8_t *)Dst;
+    for (int idx = 0; idx < Count * 4; ++idx)
+    {
+        const int Val = (Src[idx] + (1 << (SCALE_SHIFT - 1))) >> SCALE_SHIFT;
+        Bytes[idx] = (uint8_t)(Val > 255 ? 255 : Val);
+    }
+}
+
+static void scaleExpandLinearScalar(const uint32_t *Src, int16_t *Dst, int Count)
+{
+    const uint8_t *Bytes = (const uint8_t *)Src;
+    for (int idx = 0; idx < Count * 4; idx += 4)
+    {
+        for (int byte = 0; byte < 4; ++byte)
+        {
+            Dst[idx + byte] = (int16_t)ScaleToLinear[(byte * 256) + Bytes[idx + byte]];
+        }
+    }
+}
+
+static void scalePackLinearScalar(const int16_t *Src, uint32_t *Dst, int Count)
+{
+    uint8_t *Bytes = (uint8_t *)Dst;
+    for (int idx = 0; idx < Count * 4; idx += 4)
+    {
+        // Intermediate samples are never negative.
+        for (int byte = 0; byte < 4; ++byte)
+        {
+            Bytes[idx + byte] = ScaleToSrgb[Src[idx + byte]];
+        }
+        const int Val = (Src[idx + SCALE_ALPHA_BYTE] + (1 << (SCALE_SHIFT - 1))) >> SCALE_SHIFT;
+        Bytes[idx + SCALE_ALPHA_BYTE] = (uint8_t)(Val > 255 ? 255 : Val);
+    }
+}
+
+static const ScaleKernels ScaleScalar = {"scalar", scaleExpandScalar, scaleHorizontalScalar, scaleVerticalScalar,
+                                         scalePackScalar, scaleExpandLinearScalar, scalePackLinearScalar};
+
+#ifdef SCALE_X86
+
+// Interleave the two pixels of a 128-bit lane into (c0, c1) pairs per
+// channel, ready for a madd with a (w0, w1) pair.
+#define SCALE_PAIR_CHANNELS_128(Px) _mm_unpacklo_epi16((Px), _mm_unpackhi_epi64((Px), (Px)))
+
+__attribute__((target("sse2"))) static void scaleExpandSSE2(const uint32_t *Src, int16_t *Dst, int Count)
+{
+    const __m128i Zero = _mm_setzero_si128();
+    int idx = 0;
+    for (; idx + 4 <= Count; idx += 4)
+    {
+        __m128i Px = _mm_loadu_si128((const __m128i *)(Src + idx));
+        _mm_storeu_si128((__m128i *)(Dst + (idx * 4)), _mm_slli_epi16(_mm_unpacklo_epi8(Px, Zero), SCALE_SHIFT));
+        _mm_storeu_si128((__m128i *)(Dst + (idx * 4) + 8),
+                         _mm_slli_epi16(_mm_unpackhi_epi8(Px, Zero), SCALE_SHIFT));
+    }
+    scaleExpandScalar(Src + idx, Dst + (idx * 4), Count - idx);
+}
+
+__attribute__((target("sse2"))) static inline __m128i scaleHorizontalTailSSE2(const int16_t *In,
+                                                                              const int32_t *Pairs, int Pair,
+                                                                              int NPairs, __m128i Acc)
+{
+    for (; Pair < NPairs; ++Pair)
+    {
+        __m128i Px = _mm_loadu_si128((const __m128i *)(In + (Pair * 8)));
+        Acc = _mm_add_epi32(Acc, _mm_madd_epi16(SCALE_PAIR_CHANNELS_128(Px), _mm_set1_epi32(Pairs[Pair])));
+    }
+    return Acc;
+}
+
+__attribute__((target("sse2"))) static inline void scaleStore4SSE2(int16_t *Dst, __m128i Acc)
+{
+    Acc = _mm_srai_epi32(_mm_add_epi32(Acc, _mm_set1_epi32(1 << (SCALE_PREC - 1))), SCALE_PREC);
+    Acc = _mm_max_epi16(_mm_packs_epi32(Acc, Acc), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i *)Dst, Acc);
+}
+
+__attribute__((target("sse2"))) static void scaleHorizontalSSE2(const int16_t *Src, int16_t *Dst,
+                                                                const ScaleAxis *Ax)
+{
+    const int NPairs = Ax->Taps / 2;
+    for (int idx = 0; idx < Ax->Count; ++idx)
+    {
+        const int16_t *In = Src + ((size_t)Ax->Start[idx] * 4);
+        const int32_t *Pairs = Ax->Pairs + ((size_t)idx * NPairs);
+        __m128i Acc = scaleHorizontalTailSSE2(In, Pairs, 0, (Ax->Len[idx] + 1) / 2, _mm_setzero_si128());
+        scaleStore4SSE2(Dst + (idx * 4), Acc);
+    }
+}
+
+__attribute__((target("sse2"))) static void scaleVerticalSSE2(int16_t *const *Rows, const int32_t *Pairs,
+                                                              int NPairs, int16_t *Dst, int Begin, int Len)
+{
+    const __m128i Round = _mm_set1_epi32(1 << (SCALE_PREC - 1));
+    int idx = Begin;
+    for (; idx + 8 <= Len; idx += 8)
+    {
+        __m128i Lo = _mm_setzero_si128();
+        __m128i Hi = _mm_setzero_si128();
+        for (int Pair = 0; Pair < NPairs; ++Pair)
+        {
+            __m128i RowA = _mm_loadu_si128((const __m128i *)(Rows[Pair * 2] + idx));
+            __m128i RowB = _mm_loadu_si128((const __m128i *)(Rows[(Pair * 2) + 1] + idx));
+            __m128i Weight = _mm_set1_epi32(Pairs[Pair]);
+            Lo = _mm_add_epi32(Lo, _mm_madd_epi16(_mm_unpacklo_epi16(RowA, RowB), Weight));
+            Hi = _mm_add_epi32(Hi, _mm_madd_epi16(_mm_unpackhi_epi16(RowA, RowB), Weight));
+        }
+        Lo = _mm_srai_epi32(_mm_add_epi32(Lo, Round), SCALE_PREC);
+        Hi = _mm_srai_epi32(_mm_add_epi32(Hi, Round), SCALE_PREC);
+        _mm_storeu_si128((__m128i *)(Dst + idx), _mm_max_epi16(_mm_packs_epi32(Lo, Hi), _mm_setzero_si128()));
+    }
+
+    scaleVerticalScalar(Rows, Pairs, NPairs, Dst, idx, Len);
+}
+
+__attribute__((target("sse2"))) static void scalePackSSE2(const int16_t *Src, uint32_t *Dst, int Count)
+{
+    const __m128i Round = _mm_set1_epi16(1 << (SCALE_SHIFT - 1));
+    int idx = 0;
+    for (; idx + 4 <= Count; idx += 4)
+    {
+        __m128i Lo = _mm_loadu_si128((const __m128i *)(Src + (idx * 4)));
+        __m128i Hi = _mm_loadu_si128((const __m128i *)(Src + (idx * 4) + 8));
+        Lo = _mm_srli_epi16(_mm_adds_epu16(Lo, Round), SCALE_SHIFT);
+        Hi = _mm_srli_epi16(_mm_adds_epu16(Hi, Round), SCALE_SHIFT);
+        _mm_storeu_si128((__m128i *)(Dst + idx), _mm_packus_epi16(Lo, Hi));
+    }
+    scalePackScalar(Src + (idx * 4), Dst + idx, Count - idx);
+}
+
+// SSE2 has no gather; the table lookups stay scalar.
+static const ScaleKernels ScaleSSE2 = {"sse2", scaleExpandSSE2, scaleHorizontalSSE2, scaleVerticalSSE2,
+                                       scalePackSSE2, scaleExpandLinearScalar, scalePackLinearScalar};
+
+__attribute__((target("avx2"))) static void scaleExpandAVX2(const uint32_t *Src, int16_t *Dst, int Count)
+{
+    int idx = 0;
+    for (; idx + 8 <= Count; idx += 8)
+    {
+        __m128i Lo = _mm_loadu_si128((const __m128i *)(Src + idx));
+        __m128i Hi = _mm_loadu_si128((const __m128i *)(Src + idx + 4));
+        _mm256_storeu_si256((__m256i *)(Dst + (idx * 4)), _mm256_slli_epi16(_mm256_cvtepu8_epi16(Lo), SCALE_SHIFT));
+        _mm256_storeu_si256((__m256i *)(Dst + (idx * 4) + 16),
+                            _mm256_slli_epi16(_mm256_cvtepu8_epi16(Hi), SCALE_SHIFT));
+    }
+    scaleExpandSSE2(Src + idx, Dst + (idx * 4), Count - idx);
+}
+
+__attribute__((target("avx2"))) static void scaleHorizontalAVX2(const int16_t *Src, int16_t *Dst,
+                                                                const ScaleAxis *Ax)
+{
+    const int NPairs = Ax->Taps / 2;
+    for (int idx = 0; idx < Ax->Count; ++idx)
+    {
+        const int16_t *In = Src + ((size_t)Ax->Start[idx] * 4);
+        const int32_t *Pairs = Ax->Pairs + ((size_t)idx * NPairs);
+        const int Used = (Ax->Len[idx] + 1) / 2;
+        const __m256i Spread = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+        __m256i Acc = _mm256_setzero_si256();
+        int Pair = 0;
+
+        // Four taps per step: one pixel pair in each 128-bit lane.
+        for (; Pair + 2 <= Used; Pair += 2)
+        {
+            __m256i Px = _mm256_loadu_si256((const __m256i *)(In + (Pair * 8)));
+            __m256i Chn = _mm256_unpacklo_epi16(Px, _mm256_unpackhi_epi64(Px, Px));
+            __m256i Weight = _mm256_permutevar8x32_epi32(
+                _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *)(Pairs + Pair))), Spread);
+            Acc = _mm256_add_epi32(Acc, _mm256_madd_epi16(Chn, Weight));
+        }
+
+        __m128i Sum = _mm_add_epi32(_mm256_castsi256_si128(Acc), _mm256_extracti128_si256(Acc, 1));
+        scaleStore4SSE2(Dst + (idx * 4), scaleHorizontalTailSSE2(In, Pairs, Pair, Used, Sum));
+    }
+}
+
+__attribute__((target("avx2"))) static void scaleVerticalAVX2(int16_t *const *Rows, const int32_t *Pairs,
+                                                              int NPairs, int16_t *Dst, int Begin, int Len)
+{
+    const __m256i Round = _mm256_set1_epi32(1 << (SCALE_PREC - 1));
+    int idx = Begin;
+    for (; idx + 16 <= Len; idx += 16)
+    {
+        __m256i Lo = _mm256_setzero_si256();
+        __m256i Hi = _mm256_setzero_si256();
+        for (int Pair = 0; Pair < NPairs; ++Pair)
+        {
+            __m256i RowA = _mm256_loadu_si256((const __m256i *)(Rows[Pair * 2] + idx));
+            __m256i RowB = _mm256_loadu_si256((const __m256i *)(Rows[(Pair * 2) + 1] + idx));
+            __m256i Weight = _mm256_set1_epi32(Pairs[Pair]);
+            Lo = _mm256_add_epi32(Lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(RowA, RowB), Weight));
+            Hi = _mm256_add_epi32(Hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(RowA, RowB), Weight));
+        }
+        Lo = _mm256_srai_epi32(_mm256_add_epi32(Lo, Round), SCALE_PREC);
+        Hi = _mm256_srai_epi32(_mm256_add_epi32(Hi, Round), SCALE_PREC);
+        // Unpack and pack both work per lane, so the order comes back intact.
+        _mm256_storeu_si256((__m256i *)(Dst + idx),
+                            _mm256_max_epi16(_mm256_packs_epi32(Lo, Hi), _mm256_setzero_si256()));
+    }
+
+    scaleVerticalSSE2(Rows, Pairs, NPairs, Dst, idx, Len);
+}
+
+__attribute__((target("avx2"))) static void scalePackAVX2(const int16_t *Src, uint32_t *Dst, int Count)
+{
+    const __m256i Round = _mm256_set1_epi16(1 << (SCALE_SHIFT - 1));
+    int idx = 0;
+    for (; idx + 8 <= Count; idx += 8)
+    {
+        __m256i Lo = _mm256_loadu_si256((const __m256i *)(Src + (idx * 4)));
+        __m256i Hi = _mm256_loadu_si256((const __m256i *)(Src + (idx * 4) + 16));
+        Lo = _mm256_srli_epi16(_mm256_adds_epu16(Lo, Round), SCALE_SHIFT);
+        Hi = _mm256_srli_epi16(_mm256_adds_epu16(Hi, Round), SCALE_SHIFT);
+        // packus interleaves lanes; restore pixel order.
+        __m256i Packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(Lo, Hi), 0xD8);
+        _mm256_storeu_si256((__m256i *)(Dst + idx), Packed);
+    }
+    scalePackSSE2(Src + (idx * 4), Dst + idx, Count - idx);
+}
+
+// Each byte of four pixels gathered from its channel's row of the table.
+// The gather reads 32 bits at 16-bit entries; the high half is dropped.
+__attribute__((target("avx2"))) static void scaleExpandLinearAVX2(const uint32_t *Src, int16_t *Dst, int Count)
+{
+    const int *Table = (const int *)(const void *)ScaleToLinear;
+    const __m256i Rows = _mm256_setr_epi32(0, 256, 512, 768, 0, 256, 512, 768);
+    const __m256i Low = _mm256_set1_epi32(0xffff);
+    int idx = 0;
+    for (; idx + 4 <= Count; idx += 4)
+    {
+        const __m128i Px = _mm_loadu_si128((const __m128i *)(Src + idx));
+        __m256i Lo = _mm256_add_epi32(_mm256_cvtepu8_epi32(Px), Rows);
+        __m256i Hi = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_unpackhi_epi64(Px, Px)), Rows);
+        Lo = _mm256_and_si256(_mm256_i32gather_epi32(Table, Lo, 2), Low);
+        Hi = _mm256_and_si256(_mm256_i32gather_epi32(Table, Hi, 2), Low);
+        // packus interleaves lanes; restore sample order.
+        _mm256_storeu_si256((__m256i *)(Dst + (idx * 4)),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi32(Lo, Hi), 0xD8));
+    }
+    scaleExpandLinearScalar(Src + idx, Dst + (idx * 4), Count - idx);
+}
+
+// Every sample of four pixels gathered from the byte table, with the alpha
+// samples (lanes 3 and 7 on little-endian x86) rounded instead.
+__attribute__((target("avx2"))) static void scalePackLinearAVX2(const int16_t *Src, uint32_t *Dst, int Count)
+{
+    const int *Table = (const int *)(const void *)ScaleToSrgb;
+    const __m256i Round = _mm256_set1_epi32(1 << (SCALE_SHIFT - 1));
+    const __m256i Byte = _mm256_set1_epi32(0xff);
+    const __m256i Alpha = _mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1);
+    int idx = 0;
+    for (; idx + 4 <= Count; idx += 4)
+    {
+        __m256i Out[2];
+        for (int half = 0; half < 2; ++half)
+        {
+            const __m256i Val =
+                _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(Src + (idx * 4) + (half * 8))));
+            const __m256i Col = _mm256_and_si256(_mm256_i32gather_epi32(Table, Val, 1), Byte);
+            const __m256i Alp = _mm256_min_epi32(_mm256_srli_epi32(_mm256_add_epi32(Val, Round), SCALE_SHIFT), Byte);
+            Out[half] = _mm256_blendv_epi8(Col, Alp, Alpha);
+        }
+        const __m256i Words = _mm256_permute4x64_epi64(_mm256_packus_epi32(Out[0], Out[1]), 0xD8);
+        const __m128i Bytes = _mm_packus_epi16(_mm256_castsi256_si128(Words), _mm256_extracti128_si256(Words, 1));
+        _mm_storeu_si128((__m128i *)(Dst + idx), Bytes);
+    }
+    scalePackLinearScalar(Src + (idx * 4), Dst + idx, Count - idx);
+}
+
+static const ScaleKernels ScaleAVX2 = {"avx2", scaleExpandAVX2, scaleHorizontalAVX2, scaleVerticalAVX2,
+                                       scalePackAVX2, scaleExpandLinearAVX2, scalePackLinearAVX2};
+
+__attribute__((target("avx512f,avx512bw"))) static void scaleHorizontalAVX512(const int16_t *Src, int16_t *Dst,
+                                                                              const ScaleAxis *Ax)
+{
+    // Short filters leave most of a 512-bit step idle; the lane reduction
+    // then costs more than it saves.
+    if (Ax->Taps < 16)
+    {
+        scaleHorizontalAVX2(Src, Dst, Ax);
+        return;
+    }
+
+    const int NPairs = Ax->Taps / 2;
+    for (int idx = 0; idx < Ax->Count; ++idx)
+    {
+        const int16_t *In = Src + ((size_t)Ax->Start[idx] * 4);
+        const int32_t *Pairs = Ax->Pairs + ((size_t)idx * NPairs);
+        const int Used = (Ax->Len[idx] + 1) / 2;
+        const __m512i Spread = _mm512_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+        __m512i Acc = _mm512_setzero_si512();
+        int Pair = 0;
+
+        // Eight taps per step: one pixel pair in each 128-bit lane.
+        for (; Pair + 4 <= Used; Pair += 4)
+        {
+            __m512i Px = _mm512_loadu_si512((const void *)(In + (Pair * 8)));
+            __m512i Chn = _mm512_unpacklo_epi16(Px, _mm512_unpackhi_epi64(Px, Px));
+            __m512i Weight = _mm512_permutexvar_epi32(
+                Spread, _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)(Pairs + Pair))));
+            Acc = _mm512_add_epi32(Acc, _mm512_madd_epi16(Chn, Weight));
+        }
+
+        __m256i Half = _mm256_add_epi32(_mm512_castsi512_si256(Acc), _mm512_extracti64x4_epi64(Acc, 1));
+        __m128i Sum = _mm_add_epi32(_mm256_castsi256_si128(Half), _mm256_extracti128_si256(Half, 1));
+        scaleStore4SSE2(Dst + (idx * 4), scaleHorizontalTailSSE2(In, Pairs, Pair, Used, Sum));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void scaleVerticalAVX512(int16_t *const *Rows,
+                                                                            const int32_t *Pairs, int NPairs,
+                                                                            int16_t *Dst, int Begin, int Len)
+{
+    const __m512i Round = _mm512_set1_epi32(1 << (SCALE_PREC - 1));
+    int idx = Begin;
+    for (; idx + 32 <= Len; idx += 32)
+    {
+        __m512i Lo = _mm512_setzero_si512();
+        __m512i Hi = _mm512_setzero_si512();
+        for (int Pair = 0; Pair < NPairs; ++Pair)
+        {
+            __m512i RowA = _mm512_loadu_si512((const void *)(Rows[Pair * 2] + idx));
+            __m512i RowB = _mm512_loadu_si512((const void *)(Rows[(Pair * 2) + 1] + idx));
+            __m512i Weight = _mm512_set1_epi32(Pairs[Pair]);
+            Lo = _mm512_add_epi32(Lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(RowA, RowB), Weight));
+            Hi = _mm512_add_epi32(Hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(RowA, RowB), Weight));
+        }
+        Lo = _mm512_srai_epi32(_mm512_add_epi32(Lo, Round), SCALE_PREC);
+        Hi = _mm512_srai_epi32(_mm512_add_epi32(Hi, Round), SCALE_PREC);
+        _mm512_storeu_si512((void *)(Dst + idx), _mm512_max_epi16(_mm512_packs_epi32(Lo, Hi), _mm512_setzero_si512()));
+    }
+
+    scaleVerticalAVX2(Rows, Pairs, NPairs, Dst, idx, Len);
+}
+
+// Expansion and packing are memory bound; AVX2 already saturates them.
+static const ScaleKernels ScaleAVX512 = {"avx512", scaleExpandAVX2, scaleHorizontalAVX512, scaleVerticalAVX512,
+                                         scalePackAVX2, scaleExpandLinearAVX2, scalePackLinearAVX2};
+
+#endif // SCALE_X86
+
+static const ScaleKernels *ScaleChosen = &ScaleScalar;
+static pthread_once_t ScaleKernelsOnce = PTHREAD_ONCE_INIT;
+
+// Best kernel set for this CPU. WALL_SIMD=scalar|sse2|avx2|avx512 caps the
+// choice, which is how the kernels are compared against each other.
+static void scaleKernelsInit(void)
+{
+    const ScaleKernels *Best = &ScaleScalar;
+#ifdef SCALE_X86
+    __builtin_cpu_init();
+    const char *Cap = getenv("WALL_SIMD");
+    const ScaleKernels *Order[] = {&ScaleAVX512, &ScaleAVX2, &ScaleSSE2};
+    const int Usable[] = {__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"),
+                          __builtin_cpu_supports("avx2"), __builtin_cpu_supports("sse2")};
+    int Capped = Cap && *Cap;
+    for (size_t idx = 0; idx < sizeof Order / sizeof *Order; ++idx)
+    {
+        if (Capped && strcmp(Cap, Order[idx]->Name) == 0)
+        {
+            Capped = 0;
+        }
+        if (!Capped && Usable[idx])
+        {
+            Best = Order[idx];
+            break;
+        }
+    }
+#endif
+    ScaleChosen = Best;
+}
+
+// Plans are made on pool, slideshow and precompute threads at once.
+static const ScaleKernels *scaleKernels(void)
+{
+    pthread_once(&ScaleKernelsOnce, scaleKernelsInit);
+    return ScaleChosen;
+}
+
+const char *scaleSimdName(void)
+{
+    return scaleKernels()->Name;
+}
+
+// Plan the window (ClipX, ClipY, ClipW, ClipH) of a SrcW x SrcH -> DstW x DstH
+// resize, in linear light if Linear is set. Returns 0 on allocation failure.
+int scalePlanInit(ScalePlan *Plan, int SrcW, int SrcH, int DstW, int DstH, int ClipX, int ClipY, int ClipW,
+                  int ClipH, ScaleFilter Filter, int Linear)
+{
+    memset(Plan, 0, sizeof *Plan);
+    Plan->SrcW = SrcW;
+    Plan->SrcH = SrcH;
+    Plan->Linear = Linear;
+    Plan->Kern = scaleKernels();
+    if (Linear)
+    {
+        pthread_once(&ScaleLinearOnce, scaleLinearInit);
+    }
+
+    if (!scaleAxisInit(&Plan->Horz, SrcW, DstW, ClipX, ClipW, Filter) ||
+        !scaleAxisInit(&Plan->Vert, SrcH, DstH, ClipY, ClipH, Filter))
+    {
+        scalePlanFree(Plan);
+        return 0;
+    }
+
+    // Only expand the source columns the window reads.
+    int Lo = SrcW;
+    int Hi = 0;
+    for (int idx = 0; idx < ClipW; ++idx)
+    {
+        const int Start = Plan->Horz.Start[idx];
+        Lo = Start < Lo ? Start : Lo;
+        Hi = Start + Plan->Horz.Len[idx] > Hi ? Start + Plan->Horz.Len[idx] : Hi;
+    }
+    for (int idx = 0; idx < ClipW; ++idx)
+    {
+        Plan->Horz.Start[idx] -= Lo;
+    }
+    Plan->ExpandLo = Lo;
+    Plan->ExpandCount = Hi - Lo;
+    Plan->ExpandPad = Plan->Horz.Taps + 8;
+    return 1;
+}
+
+void scalePlanFree(ScalePlan *Plan)
+{
+    scaleAxisFree(&Plan->Horz);
+    scaleAxisFree(&Plan->Vert);
+}
+
+// Produce window rows [Row0, Row1) into Dst, which points at the first
+// pixel of Row0; DstStride is in pixels. Returns 0 if GetRow fails or
+// memory runs out.
+int scaleRows(const ScalePlan *Plan, ScaleRowFn GetRow, void *User, int Row0, int Row1, uint32_t *Dst,
+              size_t DstStride)
+{
+    const ScaleKernels *Kern = Plan->Kern;
+    void (*Expand)(const uint32_t *, int16_t *, int) = Plan->Linear ? Kern->ExpandLinear : Kern->Expand;
+    void (*Pack)(const int16_t *, uint32_t *, int) = Plan->Linear ? Kern->PackLinear : Kern->Pack;
+    const ScaleAxis *Vert = &Plan->Vert;
+    const int Cap = Vert->Taps;
+    const size_t RowLen = (size_t)Plan->Horz.Count * 4;
+    int Ok = 1;
+
+    if (Row0 >= Row1 || Plan->Horz.Count <= 0)
+    {
+        return 1;
+    }
+
+    // The row buffers run to megabytes on large screens.
+    const size_t ExpandLen = (size_t)(Plan->ExpandCount + Plan->ExpandPad) * 4;
+    int16_t *Expanded = pixbufAlloc(ExpandLen * sizeof *Expanded);
+    int16_t *Ring = pixbufAlloc((size_t)Cap * RowLen * sizeof *Ring);
+    int16_t *Out = malloc(RowLen * sizeof *Out);
+    int16_t **Rows = malloc((size_t)(Cap + 1) * sizeof *Rows);
+    if (!Expanded || !Ring || !Out || !Rows)
+    {
+        Ok = 0;
+        goto cleanup;
+    }
+    memset(Expanded, 0, ExpandLen * sizeof *Expanded);
+
+    int Next = Vert->Start[Row0];
+    for (int row = Row0; row < Row1 && Ok; ++row)
+    {
+        const int Start = Vert->Start[row];
+        const int Len = Vert->Len[row];
+        Next = Next < Start ? Start : Next;
+
+        // Pull and horizontally filter the rows entering the window.
+        for (; Next < Start + Len; ++Next)
+        {
+            const uint32_t *Src = GetRow(User, Next);
+            if (!Src)
+            {
+                Ok = 0;
+                break;
+            }
+            Expand(Src + Plan->ExpandLo, Expanded, Plan->ExpandCount);
+            Kern->Horizontal(Expanded, Ring + ((size_t)(Next % Cap) * RowLen), &Plan->Horz);
+        }
+        if (!Ok)
+        {
+            break;
+        }
+
+        for (int tap = 0; tap < Len; ++tap)
+        {
+            Rows[tap] = Ring + ((size_t)((Start + tap) % Cap) * RowLen);
+        }
+        Rows[Len] = Rows[Len - 1]; // Partner of an odd last tap; its weight is 0.
+
+        Kern->Vertical(Rows, Vert->Pairs + ((size_t)row * (size_t)(Cap / 2)), (Len + 1) / 2, Out, 0, (int)RowLen);
+        Pack(Out, Dst + ((size_t)(row - Row0) * DstStride), Plan->Horz.Count);
+    }
+
+cleanup:
+    pixbufFree(Expanded);
+    pixbufFree(Ring);
+    free(Out);
+    free(Rows);
+    return Ok;
+}
+
+#endif // SCALE_IMPLEMENTATION
+
+#endif // SCALE_H
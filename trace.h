@@ -0,0 +1,142 @@
+// Stage timings for one run, written as Chrome trace-event JSON (load it in
+// chrome://tracing or Perfetto). Spans are buffered from the first call and
+// only written if traceOutput names a file, so with tracing off a stage
+// costs a clock read. Once it does, every span end also samples getrusage,
+// giving page fault and peak RSS counter tracks. Main thread only.
+#ifndef TRACE_H
+#define TRACE_H
+
+void traceBegin(const char *Name);
+void traceEnd(void);
+int traceOutput(const char *Path);
+
+#ifdef TRACE_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAX_EVENTS 1024
+#define TRACE_MAX_DEPTH 32
+
+typedef struct
+{
+    const char *Name; // Static string.
+    char Phase;       // 'B' or 'E'.
+    double Ts;        // Microseconds, CLOCK_MONOTONIC.
+    long MinFlt;      // Counters, sampled at 'E' once tracing is on.
+    long MajFlt;
+    long MaxRss; // KiB.
+} TraceEvent;
+
+static TraceEvent TraceEvents[TRACE_MAX_EVENTS];
+static const char *TraceOpen[TRACE_MAX_DEPTH];
+static int TraceCount = 0;
+static int TraceDepth = 0;
+static const char *TracePath = NULL;
+
+static void tracePush(const char *Name, char Phase)
+{
+    struct timespec Now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &Now);
+    TraceEvent *Ev = &TraceEvents[TraceCount++];
+    Ev->Name = Name;
+    Ev->Phase = Phase;
+    Ev->Ts = ((double)Now.tv_sec * 1e6) + ((double)Now.tv_nsec * 1e-3);
+    if (Phase == 'E' && TracePath)
+    {
+        struct rusage Usage;
+        (void)getrusage(RUSAGE_SELF, &Usage);
+        Ev->MinFlt = Usage.ru_minflt;
+        Ev->MajFlt = Usage.ru_majflt;
+        Ev->MaxRss = Usage.ru_maxrss;
+    }
+}
+
+// Open a span. Spans nest; a full buffer drops new spans whole, keeping
+// room for the ends of the open ones.
+void traceBegin(const char *Name)
+{
+    if (TraceDepth < TRACE_MAX_DEPTH)
+    {
+        const int Room = TraceCount + TraceDepth + 2 <= TRACE_MAX_EVENTS;
+        TraceOpen[TraceDepth] = Room ? Name : NULL;
+        if (Room)
+        {
+            tracePush(Name, 'B');
+        }
+    }
+    ++TraceDepth;
+}
+
+// Close the innermost open span.
+void traceEnd(void)
+{
+    if (TraceDepth == 0)
+    {
+        return;
+    }
+    --TraceDepth;
+    if (TraceDepth < TRACE_MAX_DEPTH && TraceOpen[TraceDepth])
+    {
+        tracePush(TraceOpen[TraceDepth], 'E');
+    }
+}
+
+static void traceFlush(void)
+{
+    // Exits from inside a stage still leave a well-formed trace.
+    while (TraceDepth > 0)
+    {
+        traceEnd();
+    }
+
+    FILE *File = fopen(TracePath, "w");
+    if (!File)
+    {
+        perror(TracePath);
+        return;
+    }
+
+    const int Pid = (int)getpid();
+    const double Base = TraceCount ? TraceEvents[0].Ts : 0.0;
+    (void)fprintf(File, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    (void)fprintf(File, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"wall\"}}",
+                  Pid, Pid);
+    for (int idx = 0; idx < TraceCount; ++idx)
+    {
+        const TraceEvent *Ev = &TraceEvents[idx];
+        const double Ts = Ev->Ts - Base;
+        (void)fprintf(File, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", Ev->Name,
+                      Ev->Phase, Ts, Pid, Pid);
+        // Spans that ended before traceOutput have no counters.
+        if (Ev->Phase == 'E' && Ev->MaxRss > 0)
+        {
+            (void)fprintf(File,
+                          ",\n{\"name\":\"page faults\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"minor\":%ld,"
+                          "\"major\":%ld}}",
+                          Ts, Pid, Ev->MinFlt, Ev->MajFlt);
+            (void)fprintf(File,
+                          ",\n{\"name\":\"peak RSS KiB\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+                          "\"args\":{\"rss\":%ld}}",
+                          Ts, Pid, Ev->MaxRss);
+        }
+    }
+    (void)fprintf(File, "\n]}\n");
+    (void)fclose(File);
+}
+
+// Write the trace to Path when the process exits, however it exits.
+// Returns 0 if the exit handler can't be registered.
+int traceOutput(const char *Path)
+{
+    const int First = !TracePath;
+    TracePath = Path;
+    return !First || atexit(traceFlush) == 0;
+}
+
+#endif // TRACE_IMPLEMENTATION
+
+#endif // TRACE_H
@@ -0,0 +1,255 @@
+// Client-side frame buffers and their upload to X drawables.
+// Buffers live in a MIT-SHM segment when the server can attach it, so the
+// pixels never cross the socket; remote displays fall back to XPutImage,
+// sent as bands of rows that each fit in one request.
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+typedef struct
+{
+    Display *Dpy;
+    XImage *Image;
+    XShmSegmentInfo Shm;
+    int UseShm;
+    int Pending; // A shared-memory put may still be reading Data.
+    int Width;
+    int Height;
+    int Stride;
+    unsigned char *Data;
+} UploadBuffer;
+
+int uploadCreate(UploadBuffer *Buf, Display *Dpy, Visual *Vis, int Depth, int Width, int Height);
+void uploadPut(UploadBuffer *Buf, Drawable Dst, int DstX, int DstY);
+void uploadPutRows(UploadBuffer *Buf, Drawable Dst, int DstX, int DstY, int Row0, int Row1);
+void uploadWait(UploadBuffer *Buf);
+void uploadPutData(Display *Dpy, Visual *Vis, int Depth, Drawable Dst, const void *Data, int Width, int Height,
+                   int Stride, int ByteOrder);
+void uploadDestroy(UploadBuffer *Buf);
+
+#ifdef UPLOAD_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "pixbuf.h"
+
+static int UploadShmFailed = 0;
+
+static int uploadShmErrorHandler(Display *Dpy, XErrorEvent *Ev)
+{
+    (void)Dpy;
+    (void)Ev;
+    UploadShmFailed = 1;
+    return 0;
+}
+
+// Attach a fresh segment for Buf->Image. Returns 0 if the server can't see
+// it, which is how remote displays show up.
+static int uploadAttachShm(UploadBuffer *Buf)
+{
+    size_t Size = (size_t)Buf->Image->bytes_per_line * (size_t)Buf->Image->height;
+
+    // Reserved huge pages if there are any, rounded up to whole ones.
+    Buf->Shm.shmid = -1;
+#ifdef SHM_HUGETLB
+    const size_t Huge = pixbufHugePageSize();
+    if (Huge <= Size)
+    {
+        Buf->Shm.shmid = shmget(IPC_PRIVATE, (Size + Huge - 1) / Huge * Huge, IPC_CREAT | SHM_HUGETLB | 0600);
+    }
+#endif
+    if (Buf->Shm.shmid < 0 && (Buf->Shm.shmid = shmget(IPC_PRIVATE, Size, IPC_CREAT | 0600)) < 0)
+    {
+        return 0;
+    }
+    Buf->Shm.shmaddr = shmat(Buf->Shm.shmid, NULL, 0);
+    if (Buf->Shm.shmaddr == (char *)-1)
+    {
+        shmctl(Buf->Shm.shmid, IPC_RMID, NULL);
+        return 0;
+    }
+    Buf->Shm.readOnly = True;
+    Buf->Image->data = Buf->Shm.shmaddr;
+    pixbufAdvise(Buf->Shm.shmaddr, Size);
+
+    // A remote server accepts the request and fails it asynchronously.
+    XSync(Buf->Dpy, False);
+    UploadShmFailed = 0;
+    int (*OldHandler)(Display *, XErrorEvent *) = XSetErrorHandler(uploadShmErrorHandler);
+    Status Attached = XShmAttach(Buf->Dpy, &Buf->Shm);
+    XSync(Buf->Dpy, False);
+    XSetErrorHandler(OldHandler);
+
+    // Mark for removal now; the kernel frees it once both sides detach.
+    shmctl(Buf->Shm.shmid, IPC_RMID, NULL);
+
+    if (!Attached || UploadShmFailed)
+    {
+        shmdt(Buf->Shm.shmaddr);
+        Buf->Image->data = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Allocate a ZPixmap frame buffer of the visual's format. Returns 0 on
+// allocation failure.
+int uploadCreate(UploadBuffer *Buf, Display *Dpy, Visual *Vis, int Depth, int Width, int Height)
+{
+    *Buf = (UploadBuffer){.Dpy = Dpy, .Width = Width, .Height = Height};
+
+    if (XShmQueryExtension(Dpy))
+    {
+        Buf->Image = XShmCreateImage(Dpy, Vis, (unsigned int)Depth, ZPixmap, NULL, &Buf->Shm, (unsigned int)Width,
+                                     (unsigned int)Height);
+        if (Buf->Image && uploadAttachShm(Buf))
+        {
+            Buf->UseShm = 1;
+        }
+        else if (Buf->Image)
+        {
+            XDestroyImage(Buf->Image);
+            Buf->Image = NULL;
+        }
+    }
+
+    if (!Buf->Image)
+    {
+        Buf->Image = XCreateImage(Dpy, Vis, (unsigned int)Depth, ZPixmap, 0, NULL, (unsigned int)Width,
+                                  (unsigned int)Height, 32, 0);
+        if (!Buf->Image)
+        {
+            return 0;
+        }
+        Buf->Image->data = pixbufAlloc((size_t)Buf->Image->bytes_per_line * (size_t)Height);
+        if (!Buf->Image->data)
+        {
+            XDestroyImage(Buf->Image);
+            Buf->Image = NULL;
+            return 0;
+        }
+
+        // Writers fill the buffer in host order; Xlib swaps when sending.
+        const unsigned short One = 1;
+        Buf->Image->byte_order = *(const unsigned char *)&One ? LSBFirst : MSBFirst;
+    }
+
+    Buf->Stride = Buf->Image->bytes_per_line;
+    Buf->Data = (unsigned char *)Buf->Image->data;
+    return 1;
+}
+
+// Rows of Image that fit in one PutImage request. BIG-REQUESTS raises the
+// limit well past the core 256 KiB on most servers.
+static int uploadBandRows(Display *Dpy, const XImage *Image)
+{
+    long MaxWords = XExtendedMaxRequestSize(Dpy);
+    if (MaxWords <= 0)
+    {
+        MaxWords = XMaxRequestSize(Dpy);
+    }
+    // The request header, with the extra length word of a big request.
+    const long Rows = ((MaxWords * 4) - 28) / Image->bytes_per_line;
+    return (Rows < 1) ? 1 : (Rows > Image->height) ? Image->height : (int)Rows;
+}
+
+// Queue rows [Row0, Row1) of Image as one request per band. Nothing waits
+// on the server, so the bands stream out back to back and Xlib never has
+// to split a request itself.
+static void uploadPutBands(Display *Dpy, Drawable Dst, GC GCtx, XImage *Image, int DstX, int DstY, int Row0,
+                           int Row1)
+{
+    const int Band = uploadBandRows(Dpy, Image);
+    for (int row = Row0; row < Row1; row += Band)
+    {
+        const int Rows = (Row1 - row < Band) ? Row1 - row : Band;
+        XPutImage(Dpy, Dst, GCtx, Image, 0, row, DstX, DstY + row, (unsigned int)Image->width, (unsigned int)Rows);
+    }
+}
+
+// Copy the whole buffer into Dst at (DstX, DstY).
+void uploadPut(UploadBuffer *Buf, Drawable Dst, int DstX, int DstY)
+{
+    uploadPutRows(Buf, Dst, DstX, DstY, 0, Buf->Height);
+}
+
+// Copy rows [Row0, Row1) of the buffer into Dst, with row 0 at (DstX, DstY).
+void uploadPutRows(UploadBuffer *Buf, Drawable Dst, int DstX, int DstY, int Row0, int Row1)
+{
+    GC GCtx = XCreateGC(Buf->Dpy, Dst, 0, NULL);
+    if (Buf->UseShm)
+    {
+        XShmPutImage(Buf->Dpy, Dst, GCtx, Buf->Image, 0, Row0, DstX, DstY + Row0, (unsigned int)Buf->Width,
+                     (unsigned int)(Row1 - Row0), False);
+        Buf->Pending = 1;
+    }
+    else
+    {
+        uploadPutBands(Buf->Dpy, Dst, GCtx, Buf->Image, DstX, DstY, Row0, Row1);
+    }
+    XFreeGC(Buf->Dpy, GCtx);
+}
+
+// Block until the server is done with Data, before it is written again.
+void uploadWait(UploadBuffer *Buf)
+{
+    if (Buf->Pending)
+    {
+        XSync(Buf->Dpy, False);
+        Buf->Pending = 0;
+    }
+}
+
+// Send caller-owned pixels over the socket, e.g. straight from a mapping.
+// ByteOrder is that of Data; Xlib swaps if the server differs.
+void uploadPutData(Display *Dpy, Visual *Vis, int Depth, Drawable Dst, const void *Data, int Width, int Height,
+                   int Stride, int ByteOrder)
+{
+    XImage *Ximg = XCreateImage(Dpy, Vis, (unsigned int)Depth, ZPixmap, 0, (char *)Data, (unsigned int)Width,
+                                (unsigned int)Height, 32, Stride);
+    if (!Ximg)
+    {
+        (void)fprintf(stderr, "XCreateImage failed\n");
+        return;
+    }
+    Ximg->byte_order = ByteOrder;
+
+    GC GCtx = XCreateGC(Dpy, Dst, 0, NULL);
+    uploadPutBands(Dpy, Dst, GCtx, Ximg, 0, 0, 0, Height);
+    XFreeGC(Dpy, GCtx);
+
+    Ximg->data = NULL;
+    XDestroyImage(Ximg);
+}
+
+void uploadDestroy(UploadBuffer *Buf)
+{
+    if (!Buf->Image)
+    {
+        return;
+    }
+    if (Buf->UseShm)
+    {
+        uploadWait(Buf);
+        XShmDetach(Buf->Dpy, &Buf->Shm);
+        XSync(Buf->Dpy, False);
+        shmdt(Buf->Shm.shmaddr);
+    }
+    else
+    {
+        pixbufFree(Buf->Image->data);
+    }
+    Buf->Image->data = NULL;
+    XDestroyImage(Buf->Image);
+    *Buf = (UploadBuffer){0};
+}
+
+#endif // UPLOAD_IMPLEMENTATION
+
+#endif // UPLOAD_H
@@ -0,0 +1,768 @@
+// Plays AV1 video from IVF or Matroska/WebM files with dav1d.
+// The demuxers only understand what a looping wallpaper needs: the first
+// AV1 track, packet timestamps, and rewinding to the start.
+#ifndef VIDEO_LOADER_H
+#define VIDEO_LOADER_H
+
+#include <stdint.h>
+
+typedef struct Av1Video Av1Video;
+
+typedef struct
+{
+    const uint32_t *pixels; // BGRA; valid until the next videoNext call.
+    int width;
+    int height;
+    double duration; // Seconds until the next frame is due.
+} VideoFrame;
+
+int videoIsAv1(const char *path);
+Av1Video *videoOpen(const char *path);
+int videoNext(Av1Video *video, VideoFrame *frame);
+void videoClose(Av1Video *video);
+
+#ifdef VIDEO_LOADER_IMPLEMENTATION
+
+#include <avif/avif.h>
+#include <dav1d/dav1d.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "pixbuf.h"
+
+// Largest compressed packet accepted; guards against corrupt size fields.
+#define VIDEO_PACKET_MAX (64u << 20)
+
+// Frame duration assumed until two timestamps have been seen.
+#define VIDEO_DEFAULT_DURATION (1.0 / 30.0)
+
+#define MKV_EBML 0x1A45DFA3u
+#define MKV_SEGMENT 0x18538067u
+#define MKV_INFO 0x1549A966u
+#define MKV_TIMESTAMP_SCALE 0x2AD7B1u
+#define MKV_TRACKS 0x1654AE6Bu
+#define MKV_TRACK_ENTRY 0xAEu
+#define MKV_TRACK_NUMBER 0xD7u
+#define MKV_CODEC_ID 0x86u
+#define MKV_CODEC_PRIVATE 0x63A2u
+#define MKV_CLUSTER 0x1F43B675u
+#define MKV_CLUSTER_TIMESTAMP 0xE7u
+#define MKV_BLOCK_GROUP 0xA0u
+#define MKV_BLOCK 0xA1u
+#define MKV_SIMPLE_BLOCK 0xA3u
+
+typedef enum
+{
+    VC_Ivf,
+    VC_Matroska,
+} VideoContainer;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    double pts; // Seconds.
+} VideoPacket;
+
+typedef struct
+{
+    uint64_t number;
+    int av1;
+    uint8_t *priv; // CodecPrivate: an av1C box.
+    size_t privLen;
+} MkvTrack;
+
+struct Av1Video
+{
+    FILE *file;
+    VideoContainer container;
+    off_t dataStart; // First packet (IVF) or first Cluster (Matroska).
+
+    double ivfTimeBase; // Seconds per IVF timestamp unit.
+
+    MkvTrack entry; // TrackEntry being parsed.
+    MkvTrack track; // Chosen AV1 track; number 0 until found.
+    double mkvTimeBase;
+    uint64_t clusterTime;
+
+    VideoPacket next; // One packet of lookahead gives exact durations.
+    int haveNext;
+    int eof;
+    double lastDuration;
+
+    Dav1dContext *dec;
+    Dav1dData data; // Packet being fed to dav1d.
+    avifImage *yuv; // Borrows the planes of the current picture.
+    avifRGBImage rgb;
+};
+
+static uint32_t readLE32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Magic bytes of the file, or -1 for anything else.
+static int videoProbe(FILE *file)
+{
+    uint8_t magic[4];
+    if (fread(magic, 1, 4, file) != 4)
+    {
+        return -1;
+    }
+    if (memcmp(magic, "DKIF", 4) == 0)
+    {
+        return VC_Ivf;
+    }
+    if (((uint32_t)magic[0] << 24 | (uint32_t)magic[1] << 16 | (uint32_t)magic[2] << 8 | magic[3]) == MKV_EBML)
+    {
+        return VC_Matroska;
+    }
+    return -1;
+}
+
+// IVF: 32-byte file header, then 12-byte frame headers (size, pts).
+static int ivfOpen(Av1Video *video)
+{
+    uint8_t hdr[32];
+    if (fseeko(video->file, 0, SEEK_SET) != 0 || fread(hdr, 1, sizeof hdr, video->file) != sizeof hdr ||
+        memcmp(hdr + 8, "AV01", 4) != 0)
+    {
+        fprintf(stderr, "Not an AV1 IVF file\n");
+        return 0;
+    }
+    const uint32_t rate = readLE32(hdr + 16);
+    const uint32_t scale = readLE32(hdr + 20);
+    video->ivfTimeBase = (rate && scale) ? (double)scale / rate : VIDEO_DEFAULT_DURATION;
+    video->dataStart = (off_t)(hdr[6] | (hdr[7] << 8));
+    return fseeko(video->file, video->dataStart, SEEK_SET) == 0;
+}
+
+// Returns 1 with a packet, 0 at the end, -1 on a damaged file.
+static int ivfRead(Av1Video *video, VideoPacket *pkt)
+{
+    uint8_t hdr[12];
+    if (fread(hdr, 1, sizeof hdr, video->file) != sizeof hdr)
+    {
+        return 0;
+    }
+    const uint32_t size = readLE32(hdr);
+    const uint64_t pts = (uint64_t)readLE32(hdr + 4) | ((uint64_t)readLE32(hdr + 8) << 32);
+    if (!size || size > VIDEO_PACKET_MAX || !(pkt->data = malloc(size)))
+    {
+        return -1;
+    }
+    if (fread(pkt->data, 1, size, video->file) != size)
+    {
+        free(pkt->data);
+        return 0;
+    }
+    pkt->size = size;
+    pkt->pts = (double)pts * video->ivfTimeBase;
+    return 1;
+}
+
+// EBML variable-length integer. IDs keep their length marker, sizes don't;
+// an all-ones size means "unknown". Returns 1, 0 at the end, or -1.
+static int ebmlVint(FILE *file, uint64_t *out, int isId, int *unknown)
+{
+    int c = fgetc(file);
+    if (c == EOF)
+    {
+        return 0;
+    }
+    if (c == 0)
+    {
+        return -1;
+    }
+
+    int len = 1;
+    while (!(c & (0x80 >> (len - 1))))
+    {
+        ++len;
+    }
+    uint64_t value = isId ? (uint64_t)c : (uint64_t)(c & (0xFF >> len));
+    int ones = (value == (uint64_t)(0xFF >> len));
+    for (int idx = 1; idx < len; ++idx)
+    {
+        if ((c = fgetc(file)) == EOF)
+        {
+            return -1;
+        }
+        value = (value << 8) | (uint64_t)c;
+        ones = ones && c == 0xFF;
+    }
+    *out = value;
+    if (unknown)
+    {
+        *unknown = !isId && ones;
+    }
+    return 1;
+}
+
+static int ebmlUint(FILE *file, uint64_t size, uint64_t *out)
+{
+    *out = 0;
+    if (size > 8)
+    {
+        return 0;
+    }
+    for (uint64_t idx = 0; idx < size; ++idx)
+    {
+        int c = fgetc(file);
+        if (c == EOF)
+        {
+            return 0;
+        }
+        *out = (*out << 8) | (uint64_t)c;
+    }
+    return 1;
+}
+
+// True if the Matroska file read from the start lists an AV1 track. Reads
+// only the headers before the first Cluster.
+static int mkvHasAv1(FILE *file)
+{
+    for (;;)
+    {
+        uint64_t id;
+        uint64_t size;
+        int unknown;
+        if (ebmlVint(file, &id, 1, NULL) <= 0 || ebmlVint(file, &size, 0, &unknown) <= 0)
+        {
+            return 0;
+        }
+
+        switch (id)
+        {
+        case MKV_SEGMENT:
+        case MKV_TRACKS:
+        case MKV_TRACK_ENTRY:
+            continue;
+
+        case MKV_CLUSTER:
+            return 0;
+
+        case MKV_CODEC_ID: {
+            char codec[16] = {0};
+            if (size >= sizeof codec)
+            {
+                break;
+            }
+            if (fread(codec, 1, size, file) != size)
+            {
+                return 0;
+            }
+            if (strcmp(codec, "V_AV1") == 0)
+            {
+                return 1;
+            }
+            continue;
+        }
+
+        default:
+            break;
+        }
+
+        if (unknown || fseeko(file, (off_t)size, SEEK_CUR) != 0)
+        {
+            return 0;
+        }
+    }
+}
+
+// True for IVF or Matroska/WebM files by name and magic whose codec is AV1;
+// a WebM of VP9 is left to the image loaders to reject.
+int videoIsAv1(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (!ext || !(strcasecmp(ext, ".ivf") == 0 || strcasecmp(ext, ".webm") == 0 || strcasecmp(ext, ".mkv") == 0))
+    {
+        return 0;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    const int container = videoProbe(file);
+    uint8_t hdr[12];
+    int av1 = 0;
+    if (container == VC_Ivf)
+    {
+        av1 = fseeko(file, 0, SEEK_SET) == 0 && fread(hdr, 1, sizeof hdr, file) == sizeof hdr &&
+              memcmp(hdr + 8, "AV01", 4) == 0;
+    }
+    else if (container == VC_Matroska)
+    {
+        av1 = fseeko(file, 0, SEEK_SET) == 0 && mkvHasAv1(file);
+    }
+    fclose(file);
+    return av1;
+}
+
+// Keep the TrackEntry just parsed if it is the first AV1 track.
+static void mkvAdoptTrack(Av1Video *video)
+{
+    if (!video->track.number && video->entry.av1 && video->entry.number)
+    {
+        video->track = video->entry;
+    }
+    else
+    {
+        free(video->entry.priv);
+    }
+    memset(&video->entry, 0, sizeof video->entry);
+}
+
+// Read TrackEntry field id, of size bytes, into the entry being parsed.
+// Returns 1 if read, 0 if it is to be skipped and -1 on a read error.
+static int mkvReadTrackField(Av1Video *video, uint64_t id, uint64_t size, int unknown)
+{
+    FILE *file = video->file;
+    if (id == MKV_TRACK_NUMBER)
+    {
+        return ebmlUint(file, size, &video->entry.number) ? 1 : -1;
+    }
+    if (id == MKV_CODEC_ID)
+    {
+        char codec[16] = {0};
+        if (size >= sizeof codec)
+        {
+            return 0;
+        }
+        if (fread(codec, 1, size, file) != size)
+        {
+            return -1;
+        }
+        video->entry.av1 = strcmp(codec, "V_AV1") == 0;
+        return 1;
+    }
+
+    // CodecPrivate.
+    if (unknown || size > 4096 || video->entry.priv)
+    {
+        return 0;
+    }
+    video->entry.priv = malloc(size);
+    if (!video->entry.priv || fread(video->entry.priv, 1, size, file) != size)
+    {
+        return -1;
+    }
+    video->entry.privLen = size;
+    return 1;
+}
+
+// mkvReadBlock's result for a block of another track, or a laced or
+// oversized one; *size is then what is left of it to skip.
+#define MKV_SKIP 2
+
+// Read a Block or SimpleBlock of *size bytes into pkt. Returns like
+// ivfRead, or MKV_SKIP.
+static int mkvReadBlock(Av1Video *video, VideoPacket *pkt, uint64_t *size, int unknown)
+{
+    FILE *file = video->file;
+    // Track number, int16 timestamp relative to the cluster, flags.
+    uint64_t trackNo;
+    uint8_t hdr[3];
+    const off_t body = ftello(file);
+    if (unknown || ebmlVint(file, &trackNo, 0, NULL) <= 0 || fread(hdr, 1, 3, file) != 3)
+    {
+        return -1;
+    }
+    const uint64_t used = (uint64_t)(ftello(file) - body);
+    // AV1 in Matroska is never laced; skip other tracks and oddities.
+    if (trackNo != video->track.number || (hdr[2] & 0x06) || *size <= used || *size - used > VIDEO_PACKET_MAX)
+    {
+        *size -= used;
+        return MKV_SKIP;
+    }
+    pkt->size = *size - used;
+    if (!(pkt->data = malloc(pkt->size)))
+    {
+        return -1;
+    }
+    if (fread(pkt->data, 1, pkt->size, file) != pkt->size)
+    {
+        free(pkt->data);
+        return 0;
+    }
+    const int16_t rel = (int16_t)((hdr[0] << 8) | hdr[1]);
+    pkt->pts = ((double)video->clusterTime + rel) * video->mkvTimeBase;
+    return 1;
+}
+
+// Walk elements in file order, descending into the few masters that matter
+// and skipping everything else. Returns like ivfRead.
+static int mkvRead(Av1Video *video, VideoPacket *pkt)
+{
+    FILE *file = video->file;
+    for (;;)
+    {
+        const off_t start = ftello(file);
+        uint64_t id;
+        uint64_t size;
+        int unknown;
+        int r = ebmlVint(file, &id, 1, NULL);
+        if (r <= 0)
+        {
+            return r;
+        }
+        if (ebmlVint(file, &size, 0, &unknown) <= 0)
+        {
+            return -1;
+        }
+
+        switch (id)
+        {
+        case MKV_SEGMENT:
+        case MKV_INFO:
+        case MKV_TRACKS:
+        case MKV_BLOCK_GROUP:
+            continue;
+
+        case MKV_TRACK_ENTRY:
+            mkvAdoptTrack(video);
+            continue;
+
+        case MKV_CLUSTER:
+            mkvAdoptTrack(video);
+            if (!video->track.number)
+            {
+                fprintf(stderr, "No AV1 track\n");
+                return -1;
+            }
+            if (!video->dataStart)
+            {
+                video->dataStart = start;
+            }
+            continue;
+
+        case MKV_TIMESTAMP_SCALE: {
+            uint64_t ns;
+            if (!ebmlUint(file, size, &ns))
+            {
+                return -1;
+            }
+            video->mkvTimeBase = (double)ns * 1e-9;
+            continue;
+        }
+
+        case MKV_CLUSTER_TIMESTAMP:
+            if (!ebmlUint(file, size, &video->clusterTime))
+            {
+                return -1;
+            }
+            continue;
+
+        case MKV_TRACK_NUMBER:
+        case MKV_CODEC_ID:
+        case MKV_CODEC_PRIVATE:
+            r = mkvReadTrackField(video, id, size, unknown);
+            if (r < 0)
+            {
+                return -1;
+            }
+            if (r)
+            {
+                continue;
+            }
+            break;
+
+        case MKV_BLOCK:
+        case MKV_SIMPLE_BLOCK:
+            r = mkvReadBlock(video, pkt, &size, unknown);
+            if (r != MKV_SKIP)
+            {
+                return r;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        if (unknown || fseeko(file, (off_t)size, SEEK_CUR) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+static int videoDemux(Av1Video *video, VideoPacket *pkt)
+{
+    return (video->container == VC_Ivf) ? ivfRead(video, pkt) : mkvRead(video, pkt);
+}
+
+static void videoFreePacket(const uint8_t *buf, void *cookie)
+{
+    (void)cookie;
+    free((void *)buf);
+}
+
+// Matroska keeps the sequence header in CodecPrivate (av1C); dav1d needs
+// it before the first frame and after every flush.
+static void videoSendConfig(Av1Video *video)
+{
+    if (video->container != VC_Matroska || video->track.privLen <= 4)
+    {
+        return;
+    }
+    Dav1dData config;
+    uint8_t *copy = dav1d_data_create(&config, video->track.privLen - 4);
+    if (copy)
+    {
+        memcpy(copy, video->track.priv + 4, video->track.privLen - 4);
+        if (dav1d_send_data(video->dec, &config) < 0)
+        {
+            dav1d_data_unref(&config);
+        }
+    }
+}
+
+// Move the next packet into video->data. The packet after it is read too,
+// so the duration is the exact timestamp gap. Sets eof at the end.
+static void videoFeed(Av1Video *video)
+{
+    if (!video->haveNext)
+    {
+        video->haveNext = videoDemux(video, &video->next) > 0;
+        if (!video->haveNext)
+        {
+            video->eof = 1;
+            return;
+        }
+    }
+
+    VideoPacket pkt = video->next;
+    video->haveNext = videoDemux(video, &video->next) > 0;
+
+    double duration = video->haveNext ? video->next.pts - pkt.pts : video->lastDuration;
+    duration = (duration > 0.0) ? duration : video->lastDuration;
+    video->lastDuration = duration;
+
+    if (dav1d_data_wrap(&video->data, pkt.data, pkt.size, videoFreePacket, NULL) < 0)
+    {
+        free(pkt.data);
+        return;
+    }
+    video->data.m.timestamp = (int64_t)(pkt.pts * 1e6);
+    video->data.m.duration = (int64_t)(duration * 1e6);
+}
+
+// Back to the first packet, for looping.
+static int videoRewind(Av1Video *video)
+{
+    if (video->haveNext)
+    {
+        free(video->next.data);
+        video->haveNext = 0;
+    }
+    if (video->data.sz)
+    {
+        dav1d_data_unref(&video->data);
+    }
+    dav1d_flush(video->dec);
+    video->eof = 0;
+    if (fseeko(video->file, video->dataStart, SEEK_SET) != 0)
+    {
+        return 0;
+    }
+    videoSendConfig(video);
+    return 1;
+}
+
+Av1Video *videoOpen(const char *path)
+{
+    Av1Video *video = calloc(1, sizeof *video);
+    if (!video)
+    {
+        return NULL;
+    }
+    video->lastDuration = VIDEO_DEFAULT_DURATION;
+    video->mkvTimeBase = 1e-3; // Matroska's default TimestampScale.
+
+    int container = -1;
+    if ((video->file = fopen(path, "rb")))
+    {
+        container = videoProbe(video->file);
+    }
+    video->container = (VideoContainer)container;
+    if (container < 0 || (container == VC_Ivf && !ivfOpen(video)))
+    {
+        fprintf(stderr, "Cannot open video: %s\n", path);
+        videoClose(video);
+        return NULL;
+    }
+    if (container == VC_Matroska)
+    {
+        // Parse headers up to the first AV1 packet so a missing track fails
+        // here; the packet becomes the lookahead.
+        rewind(video->file);
+        video->haveNext = videoDemux(video, &video->next) > 0;
+        if (!video->haveNext)
+        {
+            fprintf(stderr, "No AV1 frames in %s\n", path);
+            videoClose(video);
+            return NULL;
+        }
+    }
+
+    Dav1dSettings settings;
+    dav1d_default_settings(&settings);
+    settings.n_threads = 0; // One per core, frame and tile threads.
+    if (dav1d_open(&video->dec, &settings) < 0 || !(video->yuv = avifImageCreateEmpty()))
+    {
+        fprintf(stderr, "dav1d_open failed\n");
+        videoClose(video);
+        return NULL;
+    }
+    videoSendConfig(video);
+    return video;
+}
+
+// Describe the picture's planes to libavif without copying them, and
+// convert to BGRA with its (libyuv-backed) SIMD converters.
+static int videoConvert(Av1Video *video, const Dav1dPicture *pic, VideoFrame *frame)
+{
+    static const avifPixelFormat Formats[] = {
+        [DAV1D_PIXEL_LAYOUT_I400] = AVIF_PIXEL_FORMAT_YUV400,
+        [DAV1D_PIXEL_LAYOUT_I420] = AVIF_PIXEL_FORMAT_YUV420,
+        [DAV1D_PIXEL_LAYOUT_I422] = AVIF_PIXEL_FORMAT_YUV422,
+        [DAV1D_PIXEL_LAYOUT_I444] = AVIF_PIXEL_FORMAT_YUV444,
+    };
+    avifImage *y = video->yuv;
+    y->width = (uint32_t)pic->p.w;
+    y->height = (uint32_t)pic->p.h;
+    y->depth = (uint32_t)pic->p.bpc;
+    y->yuvFormat = Formats[pic->p.layout];
+    y->yuvRange = pic->seq_hdr->color_range ? AVIF_RANGE_FULL : AVIF_RANGE_LIMITED;
+    y->colorPrimaries = (uint16_t)pic->seq_hdr->pri;
+    y->transferCharacteristics = (uint16_t)pic->seq_hdr->trc;
+    y->matrixCoefficients = (avifMatrixCoefficients)pic->seq_hdr->mtrx;
+    y->imageOwnsYUVPlanes = AVIF_FALSE;
+    for (int idx = 0; idx < 3; ++idx)
+    {
+        const int chroma = idx > 0;
+        y->yuvPlanes[idx] = (chroma && pic->p.layout == DAV1D_PIXEL_LAYOUT_I400) ? NULL : pic->data[idx];
+        y->yuvRowBytes[idx] = y->yuvPlanes[idx] ? (uint32_t)pic->stride[chroma] : 0;
+    }
+
+    // A new sequence header may change the size mid-stream.
+    if (video->rgb.pixels && (video->rgb.width != y->width || video->rgb.height != y->height))
+    {
+        pixbufFree(video->rgb.pixels);
+        video->rgb.pixels = NULL;
+    }
+    if (!video->rgb.pixels)
+    {
+        avifRGBImageSetDefaults(&video->rgb, y);
+        video->rgb.format = AVIF_RGB_FORMAT_BGRA;
+        video->rgb.depth = 8;
+        video->rgb.rowBytes = y->width * 4;
+        if (!(video->rgb.pixels = pixbufAlloc((size_t)video->rgb.rowBytes * y->height)))
+        {
+            fprintf(stderr, "Video frame alloc failed\n");
+            return 0;
+        }
+    }
+
+    avifResult r = avifImageYUVToRGB(y, &video->rgb);
+    if (r != AVIF_RESULT_OK)
+    {
+        fprintf(stderr, "Video to RGB error: %s\n", avifResultToString(r));
+        return 0;
+    }
+
+    frame->pixels = (const uint32_t *)video->rgb.pixels;
+    frame->width = (int)y->width;
+    frame->height = (int)y->height;
+    frame->duration = (pic->m.duration > 0) ? (double)pic->m.duration * 1e-6 : video->lastDuration;
+    return 1;
+}
+
+// Decode the next frame in presentation order, looping at the end. Returns
+// 0 on a decode error or if a whole pass produced no picture.
+int videoNext(Av1Video *video, VideoFrame *frame)
+{
+    Dav1dPicture pic = {0};
+    int rewound = 0;
+
+    for (;;)
+    {
+        if (!video->data.sz && !video->eof)
+        {
+            videoFeed(video);
+        }
+        if (video->data.sz)
+        {
+            int r = dav1d_send_data(video->dec, &video->data);
+            if (r < 0 && r != DAV1D_ERR(EAGAIN))
+            {
+                fprintf(stderr, "dav1d rejected a packet\n");
+                dav1d_data_unref(&video->data);
+            }
+        }
+
+        int r = dav1d_get_picture(video->dec, &pic);
+        if (r == 0)
+        {
+            break;
+        }
+        if (r != DAV1D_ERR(EAGAIN))
+        {
+            fprintf(stderr, "dav1d decode error %d\n", r);
+            return 0;
+        }
+        // Fully drained at the end of the stream: start over.
+        if (video->eof && !video->data.sz && (rewound++ || !videoRewind(video)))
+        {
+            return 0;
+        }
+    }
+
+    int ok = videoConvert(video, &pic, frame);
+    dav1d_picture_unref(&pic);
+    return ok;
+}
+
+void videoClose(Av1Video *video)
+{
+    if (!video)
+    {
+        return;
+    }
+    if (video->haveNext)
+    {
+        free(video->next.data);
+    }
+    if (video->data.sz)
+    {
+        dav1d_data_unref(&video->data);
+    }
+    if (video->dec)
+    {
+        dav1d_close(&video->dec);
+    }
+    if (video->yuv)
+    {
+        // The planes belong to dav1d pictures.
+        memset(video->yuv->yuvPlanes, 0, sizeof video->yuv->yuvPlanes);
+        avifImageDestroy(video->yuv);
+    }
+    pixbufFree(video->rgb.pixels);
+    free(video->entry.priv);
+    free(video->track.priv);
+    if (video->file)
+    {
+        fclose(video->file);
+    }
+    free(video);
+}
+
+#endif // VIDEO_LOADER_IMPLEMENTATION
+
+#endif // VIDEO_LOADER_H
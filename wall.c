@@ -5,30 +5,124 @@
  * A solid background colour can be given in RGB or RRGGBB notation.
  * This does not have support for multiple monitors, and will never.
  *
+ * Images are resampled with a box, bilinear, bicubic or lanczos filter,
+ * optionally in linear light.
+ *
  * Usage:
- *   wall <image> [-m mode] [-x N] [-y N] [-c RRGGBB]
+ *   wall <image> [-m mode] [-x N] [-y N] [-c RRGGBB] [-f filter] [-L] [-F ms]
  *   wall // restore saved settings
+ *   wall --daemon // keep X and decoded images resident, serve later runs
+ *   wall <anim.avifs> // play an image sequence until interrupted
+ *   wall <clip.ivf|clip.webm> // loop an AV1 video until interrupted
+ *   wall --slideshow DIR [-i seconds] // cycle through a directory's images
+ *   wall ... --trace FILE // write per-stage timings as Chrome trace JSON
+ *   wall <image> -o out.qoi -z WxH // render to a PPM/PAM/QOI file, no X needed
+ *   wall --precompute DIR -z WxH [-m mode] // fill the frame cache for a library
+ *   wall ... --max-memory MB // decode within a peak memory budget
  */
 
 #include <Imlib2.h>
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
 #include <argp.h>
+#include <dirent.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include <xcb/xcb.h>
 
 #include "strcopy.h"
 
+// First, since the loaders, scaler and upload buffers below allocate from it.
+#define PIXBUF_IMPLEMENTATION
+#include "pixbuf.h"
+
 #define AVIF_LOADER_IMPLEMENTATION
 #include "avif.h"
+
+#define VIDEO_LOADER_IMPLEMENTATION
+#include "video.h"
+#define FRAME_CACHE_IMPLEMENTATION
+#include "cache.h"
+#define CONVERT_IMPLEMENTATION
+#include "convert.h"
+#define IMAGE_OUT_IMPLEMENTATION
+#include "imgout.h"
+#define IPC_IMPLEMENTATION
+#include "ipc.h"
+#define JPEG_LOADER_IMPLEMENTATION
+#include "jpeg.h"
+#define PNG_STREAM_IMPLEMENTATION
+#include "pngstream.h"
+#define FRAME_RING_IMPLEMENTATION
+#include "ring.h"
+#define WORK_POOL_IMPLEMENTATION
+#include "pool.h"
+#define SCALE_IMPLEMENTATION
+#include "scale.h"
 #include "toml-c.h"
+#define TRACE_IMPLEMENTATION
+#include "trace.h"
+#define UPLOAD_IMPLEMENTATION
+#include "upload.h"
 
 #define CONFIG_FILE "%s/.wp.toml"
 
+// Decoded images the daemon keeps resident between requests.
+#define DAEMON_CACHE_SLOTS 4
+
+// How long a client may take to send its request or read the reply.
+#define DAEMON_IO_TIMEOUT_MS 2000
+
+// Tab-separated config fields in a daemon set request or query reply.
+#define CONFIG_FIELDS 9
+
+// Smallest band of frame rows handed to one worker.
+#define COMPOSE_BAND_MIN 32
+
+// Source rows of a streamed image held for the pool at once, in bytes; a
+// second window of the same size is read ahead while the first composes.
+#define COMPOSE_STREAM_WINDOW ((size_t)32 << 20)
+
+// Bands a frame sent over the socket is split into, so composing one band
+// overlaps sending the one before it.
+#define PIPELINE_BANDS 8
+
+// Seconds between slides when no interval is given.
+#define SLIDE_INTERVAL_DEFAULT 300
+
+// Largest accepted server scale divisor.
+#define SERVER_SCALE_MAX 64
+
+// Longest accepted crossfade, and how often its steps are drawn.
+#define FADE_MAX_MS 10000
+#define FADE_STEP_MS 16
+
+// Largest side of a headless render, as of an X drawable.
+#define OUTPUT_SIZE_MAX 32767
+
+// Memory the precompute workers may hold at once: a composed frame each,
+// plus the decodes in flight as priceDecode estimates them.
+#define PRECOMPUTE_BUDGET ((size_t)1 << 30)
+
+// Largest --max-memory, in MiB, and what the budget sets aside for the
+// process itself: code, libraries and the X connection.
+#define MEMORY_MAX_MB (1 << 20)
+#define MEMORY_BASELINE ((size_t)16 << 20)
+
 static char doc[] = "Set X root-window wallpaper using Imlib2.\v"
                     "Run without arguments to restore saved settings.";
 
@@ -54,6 +148,18 @@ static const struct
     {"center", WM_Center}, {"fill", WM_Fill}, {"max", WM_Max}, {"scale", WM_Scale}, {"tile", WM_Tile},
 };
 
+// Lookup table for resampling filter names.
+static const struct
+{
+    const char *Name;
+    ScaleFilter Filter;
+} FilterLUT[] = {
+    {"box", SF_Box},
+    {"bilinear", SF_Bilinear},
+    {"bicubic", SF_Bicubic},
+    {"lanczos", SF_Lanczos},
+};
+
 // Serializable user configuration.
 typedef struct
 {
@@ -62,6 +168,14 @@ typedef struct
     int OffsetX;
     int OffsetY;
     char BgColor[8];
+    int ServerScale; // Upload divisor for XRender scaling; 0 or 1 is off.
+    ScaleFilter Filter;
+    int Linear;              // Resample in linear light.
+    int Fade;                // Crossfade length in milliseconds; 0 is off.
+    int MaxMemory;           // Peak memory budget in MiB; 0 is unlimited.
+    int Shrink;              // Decode divisor picked by planDecode; never saved.
+    char SlideDir[PATH_MAX]; // Slideshow directory; empty when not cycling.
+    int SlideInterval;       // Seconds each slide stays up.
 } WallpaperConfig;
 
 // Arguments passed through argp.
@@ -70,13 +184,60 @@ typedef struct
     char *Image;
     char *ModeStr;
     char *Color;
+    char *FilterStr;
+    char *SlideDir;
+    char *TracePath;
+    char *OutputPath;
+    char *PrecomputeDir;
     int OffsetX;
     int OffsetY;
     int HasOffsetX;
     int HasOffsetY;
     int HasMode;
+    int HasFilter;
+    int Linear;
+    int ServerScale;
+    int SlideInterval;
+    int Fade;
+    int MaxMemory;
+    int OutputW; // --size; 0 when not given.
+    int OutputH;
+    int Daemon;
+    int Query;
 } Arguments;
 
+// X connection state, shared by one-shot runs and the daemon.
+typedef struct
+{
+    Display *Dpy;
+    int Scr;
+    Window Root;
+    int Width;
+    int Height;
+    int Depth;
+    int Native;   // Visual takes host-order ARGB32 pixels as-is.
+    Pixmap Owned; // Root pixmap created on this connection, when a retained one couldn't be.
+    Atom AtomRootPixmap;
+    Atom AtomSetroot;
+    Atom AtomState;
+    Pixmap RootPixmap;      // _XROOTPMAP_ID as last fetched or published, or None.
+    unsigned long State[4]; // _WALL_STATE: frame hash halves, pixmap, Width << 16 | Height.
+    int StateItems;         // Items of State that were present.
+    UploadBuffer Frame;     // Composition target, kept while the size holds.
+} WallDisplay;
+
+// Decoded image kept by the daemon, keyed by file identity.
+typedef struct
+{
+    char Path[PATH_MAX];
+    struct timespec MTime;
+    off_t Size;
+    unsigned long LastUse;
+    int SrcW; // Full size of the file; Img may be a reduced decode.
+    int SrcH;
+    Imlib_Image Img;
+} CachedImage;
+
 // Utility helpers
 static void die(const char *Message) __attribute__((noreturn));
 static void die(const char *Message)
@@ -85,27 +246,77 @@ static void die(const char *Message)
     exit(EXIT_FAILURE);
 }
 
-// Convert textual mode name to enum. Terminates on failure.
-static WallpaperMode parseMode(const char *Str)
+// Convert textual mode name to enum. Returns 0 if the name is unknown.
+static int findMode(const char *Str, WallpaperMode *Mode)
 {
     for (size_t idx = 0; idx < sizeof ModeLUT / sizeof *ModeLUT; ++idx)
     {
         if (strcmp(Str, ModeLUT[idx].Name) == 0)
         {
-            return ModeLUT[idx].Mode;
+            *Mode = ModeLUT[idx].Mode;
+            return 1;
         }
     }
+    return 0;
+}
+
+// Convert textual mode name to enum. Terminates on failure.
+static WallpaperMode parseMode(const char *Str)
+{
+    WallpaperMode Mode;
+    if (findMode(Str, &Mode))
+    {
+        return Mode;
+    }
 
     (void)fprintf(stderr, "Invalid mode: %s\nAllowed: center fill max scale tile\n", Str);
     exit(EXIT_FAILURE);
 }
 
+// Convert textual filter name to enum. Returns 0 if the name is unknown.
+static int findFilter(const char *Str, ScaleFilter *Filter)
+{
+    for (size_t idx = 0; idx < sizeof FilterLUT / sizeof *FilterLUT; ++idx)
+    {
+        if (strcmp(Str, FilterLUT[idx].Name) == 0)
+        {
+            *Filter = FilterLUT[idx].Filter;
+            return 1;
+        }
+    }
+    return 0;
+}
+
 // Hex digit to integer (0–15).
 static inline int hexVal(int chr)
 {
     return (chr <= '9') ? chr - '0' : 10 + (chr & 0x5F) - 'A';
 }
 
+// Parse an RGB or RRGGBB colour string. Returns 0 if malformed.
+static int parseColor(const char *Hex, int *Red, int *Grn, int *Blu)
+{
+    size_t Len = strlen(Hex);
+    if (!(Len == 3 || Len == 6) || strspn(Hex, "0123456789aAbBcCdDeEfF") != Len)
+    {
+        return 0;
+    }
+
+    if (Len == 3)
+    {
+        *Red = hexVal(Hex[0]) * 17;
+        *Grn = hexVal(Hex[1]) * 17;
+        *Blu = hexVal(Hex[2]) * 17;
+    }
+    else
+    {
+        *Red = (hexVal(Hex[0]) << 4) | hexVal(Hex[1]);
+        *Grn = (hexVal(Hex[2]) << 4) | hexVal(Hex[3]);
+        *Blu = (hexVal(Hex[4]) << 4) | hexVal(Hex[5]);
+    }
+    return 1;
+}
+
 static char *getConfigPath(char *Buffer, size_t Size)
 {
     const char *Home = getenv("HOME");
@@ -118,15 +329,8 @@ static char *getConfigPath(char *Buffer, size_t Size)
 }
 
 // Persistent configuration I/O
-static void saveConfig(const WallpaperConfig *Cfg)
+static void printConfig(FILE *File, const WallpaperConfig *Cfg)
 {
-    char Path[PATH_MAX];
-    FILE *File = fopen(getConfigPath(Path, sizeof Path), "w");
-    if (!File)
-    {
-        die("open config");
-    }
-
     (void)fprintf(File, "path = \"%s\"\n", Cfg->Path);
     (void)fprintf(File, "mode = \"%s\"\n", ModeLUT[Cfg->Mode].Name);
 
@@ -136,10 +340,56 @@ static void saveConfig(const WallpaperConfig *Cfg)
     }
 
     (void)fprintf(File, "background_color = \"%s\"\n", Cfg->BgColor);
+
+    if (Cfg->ServerScale > 1)
+    {
+        (void)fprintf(File, "server_scale = %d\n", Cfg->ServerScale);
+    }
+
+    if (Cfg->Filter != SF_Bilinear)
+    {
+        (void)fprintf(File, "filter = \"%s\"\n", FilterLUT[Cfg->Filter].Name);
+    }
+
+    if (Cfg->Linear)
+    {
+        (void)fprintf(File, "linear = true\n");
+    }
+
+    if (Cfg->Fade > 0)
+    {
+        (void)fprintf(File, "fade = %d\n", Cfg->Fade);
+    }
+
+    if (Cfg->MaxMemory > 0)
+    {
+        (void)fprintf(File, "max_memory = %d\n", Cfg->MaxMemory);
+    }
+
+    // Tables go last; every key after a header belongs to that table.
+    if (Cfg->SlideDir[0])
+    {
+        (void)fprintf(File, "\n[slideshow]\n");
+        (void)fprintf(File, "dir = \"%s\"\n", Cfg->SlideDir);
+        (void)fprintf(File, "interval = %d\n", Cfg->SlideInterval);
+    }
+}
+
+static void saveConfig(const WallpaperConfig *Cfg)
+{
+    char Path[PATH_MAX];
+    FILE *File = fopen(getConfigPath(Path, sizeof Path), "w");
+    if (!File)
+    {
+        die("open config");
+    }
+
+    printConfig(File, Cfg);
     (void)fclose(File);
 }
 
-static int loadConfig(WallpaperConfig *Cfg)
+// Parsed config file, or NULL if there is none or it is malformed.
+static toml_table_t *openConfig(void)
 {
     char Path[PATH_MAX];
     char errbuf[256];
@@ -147,7 +397,7 @@ static int loadConfig(WallpaperConfig *Cfg)
     FILE *File = fopen(getConfigPath(Path, sizeof Path), "r");
     if (!File)
     {
-        return 0;
+        return NULL;
     }
 
     toml_table_t *root = toml_parse_file(File, errbuf, sizeof(errbuf));
@@ -156,35 +406,34 @@ static int loadConfig(WallpaperConfig *Cfg)
     if (!root)
     {
         (void)fprintf(stderr, "TOML parse error: %s\n", errbuf);
-        return 0;
     }
+    return root;
+}
 
-    // Initialize defaults
-    Cfg->OffsetX = Cfg->OffsetY = 0;
-    strCopy(Cfg->BgColor, sizeof(Cfg->BgColor), "000000", strlen("000000"));
-
-    // Get path
-    toml_value_t path_val = toml_table_string(root, "path");
-    if (!path_val.ok)
-    {
-        (void)fprintf(stderr, "Config missing 'path' key\n");
-        toml_free(root);
-        return 0;
-    }
-    strCopy(Cfg->Path, sizeof(Cfg->Path), path_val.u.s, strlen(path_val.u.s));
-    free(path_val.u.s);
+// The config's max_memory, or 0 if unset or out of range.
+static int configMaxMemory(toml_table_t *root)
+{
+    toml_value_t memory_val = toml_table_int(root, "max_memory");
+    return (memory_val.ok && memory_val.u.i > 0 && memory_val.u.i <= MEMORY_MAX_MB) ? (int)memory_val.u.i : 0;
+}
 
-    // Get mode
-    toml_value_t mode_val = toml_table_string(root, "mode");
-    if (!mode_val.ok)
+// The stored memory budget, which applies to explicit runs as well as to
+// restores.
+static int storedMaxMemory(void)
+{
+    toml_table_t *root = openConfig();
+    if (!root)
     {
-        (void)fprintf(stderr, "Config missing 'mode' key\n");
-        toml_free(root);
         return 0;
     }
-    Cfg->Mode = parseMode(mode_val.u.s);
-    free(mode_val.u.s);
+    const int MaxMemory = configMaxMemory(root);
+    toml_free(root);
+    return MaxMemory;
+}
 
+// The optional keys, over the defaults loadConfig set.
+static void loadConfigOptions(toml_table_t *root, WallpaperConfig *Cfg)
+{
     // Get offset array (optional)
     toml_array_t *offset_arr = toml_table_array(root, "offset");
     if (offset_arr && toml_array_len(offset_arr) >= 2)
@@ -209,230 +458,3210 @@ static int loadConfig(WallpaperConfig *Cfg)
         free(color_val.u.s);
     }
 
-    toml_free(root);
-    return 1;
-}
-
-// X11 helpers
+    // Get server_scale (optional)
+    toml_value_t scale_val = toml_table_int(root, "server_scale");
+    if (scale_val.ok && scale_val.u.i > 1 && scale_val.u.i <= SERVER_SCALE_MAX)
+    {
+        Cfg->ServerScale = (int)scale_val.u.i;
+    }
 
-// Create a 24-bit pixmap and paint it with a RGB colour string.
-static Pixmap getOrCreateRootPixmap(Display *Dpy, Window Root, int Width, int Height, const char *Hex, int *created)
-{
-    Atom AtomRootPixmap = XInternAtom(Dpy, "_XROOTPMAP_ID", False);
-    Pixmap Pix = None;
-    Pixmap OldPix = None;
-    Atom ActualType;
-    int ActualFormat;
-    unsigned long NItems;
-    unsigned long BytesAfter;
-    unsigned char *Data = NULL;
-    *created = 0;
+    // Get filter (optional)
+    toml_value_t filter_val = toml_table_string(root, "filter");
+    if (filter_val.ok)
+    {
+        if (!findFilter(filter_val.u.s, &Cfg->Filter))
+        {
+            (void)fprintf(stderr, "Invalid filter in config: %s\n", filter_val.u.s);
+        }
+        free(filter_val.u.s);
+    }
 
-    if (XGetWindowProperty(Dpy, Root, AtomRootPixmap, 0, 1, False, XA_PIXMAP, &ActualType, &ActualFormat, &NItems,
-                           &BytesAfter, &Data) == Success &&
-        ActualType == XA_PIXMAP && ActualFormat == 32 && NItems == 1)
+    // Get linear (optional)
+    toml_value_t linear_val = toml_table_bool(root, "linear");
+    if (linear_val.ok)
     {
-        OldPix = *(Pixmap *)Data;
-        Pix = OldPix;
+        Cfg->Linear = linear_val.u.b ? 1 : 0;
     }
-    if (Data)
+
+    // Get fade (optional)
+    toml_value_t fade_val = toml_table_int(root, "fade");
+    if (fade_val.ok && fade_val.u.i >= 0 && fade_val.u.i <= FADE_MAX_MS)
     {
-        XFree(Data);
+        Cfg->Fade = (int)fade_val.u.i;
     }
 
-    if (Pix != None)
+    // Get max_memory (optional)
+    Cfg->MaxMemory = configMaxMemory(root);
+
+    // Get [slideshow] table (optional)
+    toml_table_t *slide_tab = toml_table_table(root, "slideshow");
+    if (slide_tab)
     {
-        Window RootRet;
-        int xpos;
-        int ypos;
-        unsigned int WidthRet;
-        unsigned int HeightRet;
-        unsigned int BorderRet;
-        unsigned int DepthRet;
-        if (!XGetGeometry(Dpy, Pix, &RootRet, &xpos, &ypos, &WidthRet, &HeightRet, &BorderRet, &DepthRet) ||
-            WidthRet != (unsigned int)Width || HeightRet != (unsigned int)Height)
+        toml_value_t dir_val = toml_table_string(slide_tab, "dir");
+        if (dir_val.ok)
         {
-            Pix = None;
+            strCopy(Cfg->SlideDir, sizeof(Cfg->SlideDir), dir_val.u.s, strlen(dir_val.u.s));
+            free(dir_val.u.s);
+        }
+        toml_value_t interval_val = toml_table_int(slide_tab, "interval");
+        if (interval_val.ok && interval_val.u.i >= 1 && interval_val.u.i <= INT_MAX)
+        {
+            Cfg->SlideInterval = (int)interval_val.u.i;
         }
     }
+}
 
-    if (Pix == None)
+static int loadConfig(WallpaperConfig *Cfg)
+{
+    toml_table_t *root = openConfig();
+    if (!root)
     {
-        if (OldPix != None)
-        {
-            XKillClient(Dpy, OldPix);
-        }
-        Pix = XCreatePixmap(Dpy, Root, Width, Height, DefaultDepth(Dpy, DefaultScreen(Dpy)));
-        *created = 1;
+        return 0;
     }
 
-    // Always repaint the background colour
-    int red = 0;
-    int grn = 0;
-    int blu = 0;
-    size_t Len = strlen(Hex);
-    if (Len == 3)
+    // Initialize defaults
+    Cfg->OffsetX = Cfg->OffsetY = 0;
+    Cfg->ServerScale = 0;
+    Cfg->Filter = SF_Bilinear;
+    Cfg->Linear = 0;
+    Cfg->Fade = 0;
+    Cfg->MaxMemory = 0;
+    Cfg->Shrink = 0;
+    Cfg->SlideDir[0] = 0;
+    Cfg->SlideInterval = SLIDE_INTERVAL_DEFAULT;
+    strCopy(Cfg->BgColor, sizeof(Cfg->BgColor), "000000", strlen("000000"));
+
+    // Get path
+    toml_value_t path_val = toml_table_string(root, "path");
+    if (!path_val.ok)
     {
-        red = hexVal(Hex[0]) * 17;
-        grn = hexVal(Hex[1]) * 17;
-        blu = hexVal(Hex[2]) * 17;
+        (void)fprintf(stderr, "Config missing 'path' key\n");
+        toml_free(root);
+        return 0;
     }
-    else if (Len == 6)
+    strCopy(Cfg->Path, sizeof(Cfg->Path), path_val.u.s, strlen(path_val.u.s));
+    free(path_val.u.s);
+
+    // Get mode
+    toml_value_t mode_val = toml_table_string(root, "mode");
+    if (!mode_val.ok)
     {
-        red = (hexVal(Hex[0]) << 4) | hexVal(Hex[1]);
-        grn = (hexVal(Hex[2]) << 4) | hexVal(Hex[3]);
-        blu = (hexVal(Hex[4]) << 4) | hexVal(Hex[5]);
+        (void)fprintf(stderr, "Config missing 'mode' key\n");
+        toml_free(root);
+        return 0;
     }
-    else
+    if (!findMode(mode_val.u.s, &Cfg->Mode))
     {
-        (void)fprintf(stderr, "Invalid colour: %s\n", Hex);
-        exit(EXIT_FAILURE);
+        (void)fprintf(stderr, "Invalid mode in config: %s\n", mode_val.u.s);
+        free(mode_val.u.s);
+        toml_free(root);
+        return 0;
     }
+    free(mode_val.u.s);
 
-    GC GCtx = XCreateGC(Dpy, Pix, 0, NULL);
-    XColor Col = {.red = (unsigned short)(red * 257),
-                  .green = (unsigned short)(grn * 257),
-                  .blue = (unsigned short)(blu * 257),
-                  .flags = DoRed | DoGreen | DoBlue};
+    loadConfigOptions(root, Cfg);
+    toml_free(root);
+    return 1;
+}
 
-    XAllocColor(Dpy, DefaultColormap(Dpy, DefaultScreen(Dpy)), &Col);
-    XSetForeground(Dpy, GCtx, Col.pixel);
-    XFillRectangle(Dpy, Pix, GCtx, 0, 0, Width, Height);
-    XFreeGC(Dpy, GCtx);
+// X11 helpers
 
-    return Pix;
+static int hostByteOrder(void)
+{
+    const uint16_t One = 1;
+    return *(const uint8_t *)&One ? LSBFirst : MSBFirst;
 }
 
-// Core wallpaper routine
-// NOLINTNEXTLINE(readability-function-size)
-static void setWallpaper(const WallpaperConfig *Cfg)
+// True for the common 24/32-bit TrueColor visual stored as 32 bits per
+// pixel, whose pixels are exactly Imlib2's ARGB32 words.
+static int isNativeVisual(Display *Dpy, int Scr, int Depth)
 {
-    Display *Dpy = XOpenDisplay(NULL);
-    if (!Dpy)
+    const Visual *Vis = DefaultVisual(Dpy, Scr);
+    if (Vis->class != TrueColor || Vis->red_mask != 0xff0000 || Vis->green_mask != 0xff00 || Vis->blue_mask != 0xff)
     {
-        die("XOpenDisplay");
+        return 0;
     }
 
-    const int Scr = DefaultScreen(Dpy);
-    const Window Root = RootWindow(Dpy, Scr);
-    const int ScrW = DisplayWidth(Dpy, Scr);
-    const int ScrH = DisplayHeight(Dpy, Scr);
+    int Count = 0;
+    int Bpp = 0;
+    XPixmapFormatValues *Formats = XListPixmapFormats(Dpy, &Count);
+    for (int idx = 0; idx < Count; ++idx)
+    {
+        if (Formats[idx].depth == Depth)
+        {
+            Bpp = Formats[idx].bits_per_pixel;
+        }
+    }
+    if (Formats)
+    {
+        XFree(Formats);
+    }
+    return Bpp == 32;
+}
 
-    int created = 0;
-    Pixmap Pix = getOrCreateRootPixmap(Dpy, Root, ScrW, ScrH, Cfg->BgColor, &created);
+// Read the root geometry and the wallpaper properties in one round trip.
+// Wd keeps the values, which go stale once other clients change them, so
+// long-lived connections fetch them again for every request.
+static void fetchRootState(WallDisplay *Wd)
+{
+    xcb_connection_t *Conn = XGetXCBConnection(Wd->Dpy);
+    const xcb_get_geometry_cookie_t Geometry = xcb_get_geometry(Conn, (xcb_drawable_t)Wd->Root);
+    const xcb_get_property_cookie_t RootPixmap =
+        xcb_get_property(Conn, 0, (xcb_window_t)Wd->Root, (xcb_atom_t)Wd->AtomRootPixmap, XCB_ATOM_PIXMAP, 0, 1);
+    const xcb_get_property_cookie_t State =
+        xcb_get_property(Conn, 0, (xcb_window_t)Wd->Root, (xcb_atom_t)Wd->AtomState, XCB_ATOM_CARDINAL, 0, 4);
 
-    // Imlib2 context
-    imlib_context_set_display(Dpy);
-    imlib_context_set_visual(DefaultVisual(Dpy, Scr));
-    imlib_context_set_colormap(DefaultColormap(Dpy, Scr));
+    xcb_get_geometry_reply_t *GeometryReply = xcb_get_geometry_reply(Conn, Geometry, NULL);
+    if (GeometryReply)
+    {
+        Wd->Width = GeometryReply->width;
+        Wd->Height = GeometryReply->height;
+        free(GeometryReply);
+    }
 
-    const char *ext = strrchr(Cfg->Path, '.');
-    Imlib_Image Img = (ext && strcasecmp(ext, ".avif") == 0) ? loadAvif(Cfg->Path) : imlib_load_image(Cfg->Path);
-    if (!Img)
+    Wd->RootPixmap = None;
+    xcb_get_property_reply_t *Reply = xcb_get_property_reply(Conn, RootPixmap, NULL);
+    if (Reply && Reply->type == XCB_ATOM_PIXMAP && Reply->format == 32 && Reply->value_len == 1)
     {
-        (void)fprintf(stderr, "Cannot load: %s\n", Cfg->Path);
-        XCloseDisplay(Dpy);
-        exit(EXIT_FAILURE);
+        Wd->RootPixmap = *(const uint32_t *)xcb_get_property_value(Reply);
     }
+    free(Reply);
 
-    imlib_context_set_image(Img);
-    const int ImgW = imlib_image_get_width();
-    const int ImgH = imlib_image_get_height();
+    Wd->StateItems = 0;
+    Reply = xcb_get_property_reply(Conn, State, NULL);
+    if (Reply && Reply->type == XCB_ATOM_CARDINAL && Reply->format == 32 && Reply->value_len <= 4)
+    {
+        const uint32_t *Items = xcb_get_property_value(Reply);
+        Wd->StateItems = (int)Reply->value_len;
+        for (int idx = 0; idx < Wd->StateItems; ++idx)
+        {
+            Wd->State[idx] = Items[idx];
+        }
+    }
+    free(Reply);
+}
 
-    imlib_context_set_drawable(Pix);
+static int openDisplay(WallDisplay *Wd)
+{
+    static const char *AtomNames[] = {"_XROOTPMAP_ID", "_XSETROOT_ID", "_WALL_STATE"};
+    xcb_intern_atom_cookie_t Cookies[3];
+    Atom Atoms[3] = {None, None, None};
 
-    int dstX = 0;
-    int dstY = 0;
-    int NewW;
-    int NewH;
-    double Scale = 1.0;
-    double scaleX = 1.0;
-    double scaleY = 1.0;
+    traceBegin("XOpenDisplay");
+    Wd->Dpy = XOpenDisplay(NULL);
+    traceEnd();
+    if (!Wd->Dpy)
+    {
+        return 0;
+    }
 
-    switch (Cfg->Mode)
+    // Every atom wall uses in one round trip, then the root state in a
+    // second; after that a typical run only waits on the server for MIT-SHM.
+    xcb_connection_t *Conn = XGetXCBConnection(Wd->Dpy);
+    for (int idx = 0; idx < 3; ++idx)
     {
-    case WM_Center:
-        dstX = ((ScrW - ImgW) / 2) + Cfg->OffsetX;
-        dstY = ((ScrH - ImgH) / 2) + Cfg->OffsetY;
-        imlib_render_image_on_drawable_at_size(dstX, dstY, ImgW, ImgH);
-        break;
+        Cookies[idx] = xcb_intern_atom(Conn, 0, (uint16_t)strlen(AtomNames[idx]), AtomNames[idx]);
+    }
+    for (int idx = 0; idx < 3; ++idx)
+    {
+        xcb_intern_atom_reply_t *Reply = xcb_intern_atom_reply(Conn, Cookies[idx], NULL);
+        if (Reply)
+        {
+            Atoms[idx] = Reply->atom;
+            free(Reply);
+        }
+    }
+    Wd->AtomRootPixmap = Atoms[0];
+    Wd->AtomSetroot = Atoms[1];
+    Wd->AtomState = Atoms[2];
 
-    case WM_Fill:
-        scaleX = (double)ScrW / ImgW;
-        scaleY = (double)ScrH / ImgH;
-        Scale = (scaleX > scaleY) ? scaleX : scaleY;
-        NewW = (int)(ImgW * Scale);
-        NewH = (int)(ImgH * Scale);
-        dstX = ((ScrW - NewW) / 2) + Cfg->OffsetX;
-        dstY = ((ScrH - NewH) / 2) + Cfg->OffsetY;
-        imlib_render_image_on_drawable_at_size(dstX, dstY, NewW, NewH);
-        break;
+    Wd->Scr = DefaultScreen(Wd->Dpy);
+    Wd->Root = RootWindow(Wd->Dpy, Wd->Scr);
+    Wd->Width = DisplayWidth(Wd->Dpy, Wd->Scr);
+    Wd->Height = DisplayHeight(Wd->Dpy, Wd->Scr);
+    Wd->Depth = DefaultDepth(Wd->Dpy, Wd->Scr);
+    Wd->Native = isNativeVisual(Wd->Dpy, Wd->Scr, Wd->Depth);
+    Wd->Owned = None;
+    Wd->Frame = (UploadBuffer){0};
+    fetchRootState(Wd);
 
-    case WM_Max:
-        scaleX = (double)ScrW / ImgW;
-        scaleY = (double)ScrH / ImgH;
-        Scale = (scaleX < scaleY) ? scaleX : scaleY;
-        NewW = (int)(ImgW * Scale);
-        NewH = (int)(ImgH * Scale);
-        dstX = (ScrW - NewW) / 2;
-        dstY = (ScrH - NewH) / 2;
-        imlib_render_image_on_drawable_at_size(dstX, dstY, NewW, NewH);
+    // Imlib2 context
+    imlib_context_set_display(Wd->Dpy);
+    imlib_context_set_visual(DefaultVisual(Wd->Dpy, Wd->Scr));
+    imlib_context_set_colormap(DefaultColormap(Wd->Dpy, Wd->Scr));
+    return 1;
+}
+
+static void closeDisplay(WallDisplay *Wd)
+{
+    uploadDestroy(&Wd->Frame);
+    traceBegin("XCloseDisplay");
+    XCloseDisplay(Wd->Dpy);
+    traceEnd();
+}
+
+// Screen-sized upload buffer, shared memory when the server is local.
+static UploadBuffer *frameBuffer(WallDisplay *Wd)
+{
+    UploadBuffer *Buf = &Wd->Frame;
+    if (Buf->Image && Buf->Width == Wd->Width && Buf->Height == Wd->Height)
+    {
+        uploadWait(Buf);
+        return Buf;
+    }
+
+    uploadDestroy(Buf);
+    if (!uploadCreate(Buf, Wd->Dpy, DefaultVisual(Wd->Dpy, Wd->Scr), Wd->Depth, Wd->Width, Wd->Height))
+    {
+        (void)fprintf(stderr, "Out of memory for %dx%d frame\n", Wd->Width, Wd->Height);
+        return NULL;
+    }
+    return Buf;
+}
+
+// An 8-bit colour channel as the bits of a TrueColor mask, as the server
+// would allocate it.
+static unsigned long maskChannel(int Value, unsigned long Mask)
+{
+    const int Shift = __builtin_ctzl(Mask);
+    const int Bits = __builtin_popcountl(Mask);
+    return ((((unsigned long)Value * 257) >> (16 - Bits)) << Shift) & Mask;
+}
+
+// Pixel value of an RGB colour. TrueColor pixels follow from the visual's
+// masks; other visuals need a colormap entry from the server.
+static unsigned long colorPixel(const WallDisplay *Wd, int Red, int Grn, int Blu)
+{
+    const Visual *Vis = DefaultVisual(Wd->Dpy, Wd->Scr);
+    if (Vis->class == TrueColor && Vis->red_mask && Vis->green_mask && Vis->blue_mask)
+    {
+        return maskChannel(Red, Vis->red_mask) | maskChannel(Grn, Vis->green_mask) | maskChannel(Blu, Vis->blue_mask);
+    }
+
+    XColor Col = {.red = (unsigned short)(Red * 257),
+                  .green = (unsigned short)(Grn * 257),
+                  .blue = (unsigned short)(Blu * 257),
+                  .flags = DoRed | DoGreen | DoBlue};
+    XAllocColor(Wd->Dpy, DefaultColormap(Wd->Dpy, Wd->Scr), &Col);
+    return Col.pixel;
+}
+
+// Screen-sized pixmap owned by a connection of its own, which closes at
+// once and leaves the pixmap behind. Other setters free the old root
+// pixmap with XKillClient; this way that takes the pixmap alone rather
+// than the connection that drew it. Returns None if the server refuses a
+// second connection.
+static Pixmap createRetainedPixmap(const WallDisplay *Wd)
+{
+    Display *Own = XOpenDisplay(DisplayString(Wd->Dpy));
+    if (!Own)
+    {
+        return None;
+    }
+    Pixmap Pix = XCreatePixmap(Own, RootWindow(Own, Wd->Scr), (unsigned int)Wd->Width, (unsigned int)Wd->Height,
+                               (unsigned int)Wd->Depth);
+    XSetCloseDownMode(Own, RetainPermanent);
+    XCloseDisplay(Own); // Syncs, so the pixmap exists before Wd->Dpy draws into it.
+    return Pix;
+}
+
+// Create a 24-bit pixmap and paint it with a RGB colour string. Painting is
+// skipped when Hex is NULL. Returns None if the colour is malformed.
+static Pixmap getOrCreateRootPixmap(WallDisplay *Wd, const char *Hex, int *created)
+{
+    Display *Dpy = Wd->Dpy;
+    const int Width = Wd->Width;
+    const int Height = Wd->Height;
+    Pixmap Pix = None;
+    Pixmap OldPix = None;
+    *created = 0;
+
+    int red = 0;
+    int grn = 0;
+    int blu = 0;
+    if (Hex && !parseColor(Hex, &red, &grn, &blu))
+    {
+        (void)fprintf(stderr, "Invalid colour: %s\n", Hex);
+        return None;
+    }
+
+    traceBegin("getOrCreateRootPixmap");
+    OldPix = Wd->RootPixmap;
+    Pix = OldPix;
+
+    // Our own pixmaps carry their size in the state, which saves asking.
+    const unsigned long Size = ((unsigned long)Width << 16) | (unsigned long)Height;
+    if (Pix != None && Wd->StateItems == 4 && Wd->State[2] == Pix)
+    {
+        Pix = (Wd->State[3] == Size) ? Pix : None;
+    }
+    else if (Pix != None)
+    {
+        Window RootRet;
+        int xpos;
+        int ypos;
+        unsigned int WidthRet;
+        unsigned int HeightRet;
+        unsigned int BorderRet;
+        unsigned int DepthRet;
+        if (!XGetGeometry(Dpy, Pix, &RootRet, &xpos, &ypos, &WidthRet, &HeightRet, &BorderRet, &DepthRet) ||
+            WidthRet != (unsigned int)Width || HeightRet != (unsigned int)Height)
+        {
+            Pix = None;
+        }
+    }
+
+    if (Pix == None)
+    {
+        // Killing our own client would drop this connection.
+        if (OldPix != None && OldPix == Wd->Owned)
+        {
+            XFreePixmap(Dpy, OldPix);
+        }
+        else if (OldPix != None)
+        {
+            XKillClient(Dpy, OldPix);
+        }
+        Wd->Owned = None;
+        Pix = createRetainedPixmap(Wd);
+        if (Pix == None)
+        {
+            Pix = XCreatePixmap(Dpy, Wd->Root, Width, Height, Wd->Depth);
+            Wd->Owned = Pix;
+        }
+        *created = 1;
+    }
+
+    if (!Hex)
+    {
+        traceEnd();
+        return Pix;
+    }
+
+    // Repaint the background colour
+    GC GCtx = XCreateGC(Dpy, Pix, 0, NULL);
+    XSetForeground(Dpy, GCtx, colorPixel(Wd, red, grn, blu));
+    XFillRectangle(Dpy, Pix, GCtx, 0, 0, Width, Height);
+    XFreeGC(Dpy, GCtx);
+
+    traceEnd();
+    return Pix;
+}
+
+// Destination rectangle of the image for the scaling modes; tile is
+// handled separately by its callers.
+static void placeImage(const WallpaperConfig *Cfg, int ScrW, int ScrH, int ImgW, int ImgH, int *dstX, int *dstY,
+                       int *NewW, int *NewH)
+{
+    double Scale = 1.0;
+    double scaleX = (double)ScrW / ImgW;
+    double scaleY = (double)ScrH / ImgH;
+
+    switch (Cfg->Mode)
+    {
+    case WM_Center:
+        *NewW = ImgW;
+        *NewH = ImgH;
+        *dstX = ((ScrW - ImgW) / 2) + Cfg->OffsetX;
+        *dstY = ((ScrH - ImgH) / 2) + Cfg->OffsetY;
+        break;
+
+    case WM_Fill:
+        Scale = (scaleX > scaleY) ? scaleX : scaleY;
+        *NewW = (int)(ImgW * Scale);
+        *NewH = (int)(ImgH * Scale);
+        *dstX = ((ScrW - *NewW) / 2) + Cfg->OffsetX;
+        *dstY = ((ScrH - *NewH) / 2) + Cfg->OffsetY;
+        break;
+
+    case WM_Max:
+        Scale = (scaleX < scaleY) ? scaleX : scaleY;
+        *NewW = (int)(ImgW * Scale);
+        *NewH = (int)(ImgH * Scale);
+        *dstX = (ScrW - *NewW) / 2;
+        *dstY = (ScrH - *NewH) / 2;
+        break;
+
+    case WM_Scale:
+    case WM_Tile:
+    default:
+        *NewW = ScrW;
+        *NewH = ScrH;
+        *dstX = 0;
+        *dstY = 0;
         break;
+    }
+}
+
+// What a decode has to cover: Cfg drawn on a ScrW x ScrH screen.
+typedef struct
+{
+    const WallpaperConfig *Cfg;
+    int ScrW;
+    int ScrH;
+    int SrcW; // Full size of the file, filled in while loading.
+    int SrcH;
+    int ForceStream; // Stream even images no larger than the screen, and center mode.
+} DecodeTarget;
+
+// Size the image is drawn at, the least a reduced decode may produce.
+static void decodeNeed(void *User, int SrcW, int SrcH, int *NeedW, int *NeedH)
+{
+    DecodeTarget *Target = User;
+    int dstX;
+    int dstY;
+
+    Target->SrcW = SrcW;
+    Target->SrcH = SrcH;
+    if (Target->Cfg->Mode == WM_Center || Target->Cfg->Mode == WM_Tile)
+    {
+        *NeedW = SrcW;
+        *NeedH = SrcH;
+        return;
+    }
+    placeImage(Target->Cfg, Target->ScrW, Target->ScrH, SrcW, SrcH, &dstX, &dstY, NeedW, NeedH);
+
+    // Over the memory budget otherwise; the scaler enlarges the rest.
+    if (Target->Cfg->Shrink > 1)
+    {
+        *NeedW = (*NeedW + Target->Cfg->Shrink - 1) / Target->Cfg->Shrink;
+        *NeedH = (*NeedH + Target->Cfg->Shrink - 1) / Target->Cfg->Shrink;
+    }
+}
+
+// Decode an image, dispatching AVIF to the libavif loader and JPEG to the
+// reduced-size loader, which falls back to Imlib2 for what it can't handle.
+static Imlib_Image loadImage(const char *Path, DecodeTarget *Target)
+{
+    const char *ext = strrchr(Path, '.');
+    Imlib_Image Img = NULL;
+
+    Target->SrcW = Target->SrcH = 0;
+    const int Avif = ext && (strcasecmp(ext, ".avif") == 0 || strcasecmp(ext, ".avifs") == 0);
+    if (Avif)
+    {
+        Img = loadAvif(Path, decodeNeed, Target);
+    }
+    else if (ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0))
+    {
+        Img = loadJpeg(Path, decodeNeed, Target);
+    }
+    if (!Img && !Avif)
+    {
+        Img = imlib_load_image(Path);
+    }
+    if (!Img)
+    {
+        (void)fprintf(stderr, "Cannot load: %s\n", Path);
+        return NULL;
+    }
+
+    if (!Target->SrcW)
+    {
+        imlib_context_set_image(Img);
+        Target->SrcW = imlib_image_get_width();
+        Target->SrcH = imlib_image_get_height();
+    }
+    return Img;
+}
+
+// Source rows handed to the scaler, from a decoded image or pulled from a
+// streaming decoder when Data is NULL. Images with alpha are flattened over
+// the background one row at a time, so the result is always opaque.
+typedef struct
+{
+    const DATA32 *Data;
+    ScaleRowFn Pull;
+    void *PullUser;
+    int Width;
+    int HasAlpha;
+    DATA32 Bg;
+    DATA32 *Scratch;
+} SourceRows;
+
+static const uint32_t *sourceRow(void *User, int Y)
+{
+    SourceRows *Src = User;
+    const DATA32 *Row = Src->Data ? Src->Data + ((size_t)Y * Src->Width) : Src->Pull(Src->PullUser, Y);
+    if (!Row || !Src->HasAlpha)
+    {
+        return Row;
+    }
+
+    for (int col = 0; col < Src->Width; ++col)
+    {
+        const DATA32 Pix = Row[col];
+        const DATA32 Alpha = Pix >> 24;
+        DATA32 Out = 0xff000000u;
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            const DATA32 Fg = (Pix >> shift) & 0xff;
+            const DATA32 Bg = (Src->Bg >> shift) & 0xff;
+            Out |= (((Fg * Alpha) + (Bg * (255 - Alpha)) + 127) / 255) << shift;
+        }
+        Src->Scratch[col] = Out;
+    }
+    return Src->Scratch;
+}
+
+static WorkPool *FramePool = NULL;
+static pthread_once_t FramePoolOnce = PTHREAD_ONCE_INIT;
+
+static void framePoolInit(void)
+{
+    FramePool = poolCreate(0);
+}
+
+// Worker pool shared by every composition in this process, whichever
+// thread asks first.
+static WorkPool *framePool(void)
+{
+    pthread_once(&FramePoolOnce, framePoolInit);
+    return FramePool;
+}
+
+// One composition, run over ranges of screen rows split into bands for the
+// pool.
+typedef struct
+{
+    const WallpaperConfig *Cfg;
+    SourceRows Src; // Template; every band gets its own Scratch.
+    DATA32 *Pixels;
+    int ScrW;
+    int ScrH;
+    int ImgW;
+    int ImgH;
+    int dstX;
+    int dstY;
+    int X0; // On-screen window of the placed image, [X0, X1) x [Y0, Y1).
+    int Y0;
+    int X1;
+    int Y1;
+    ScalePlan Plan;
+    int Scaled;  // Plan is set up; otherwise the image is copied unscaled.
+    int RowBase; // Rows [RowBase, RowEnd) of the current composeRange call.
+    int RowEnd;
+    int BandRows;
+    int Failed;
+} ComposeJob;
+
+static void fillSpan(DATA32 *Line, DATA32 Color, int From, int To)
+{
+    for (int col = From; col < To; ++col)
+    {
+        Line[col] = Color;
+    }
+}
+
+static void composeBand(void *User, int Index)
+{
+    ComposeJob *Job = User;
+    const int ScrW = Job->ScrW;
+    const int Row0 = Job->RowBase + (Index * Job->BandRows);
+    const int Row1 = (Row0 + Job->BandRows < Job->RowEnd) ? Row0 + Job->BandRows : Job->RowEnd;
+    SourceRows Src = Job->Src;
+
+    if (Src.HasAlpha && !(Src.Scratch = malloc((size_t)Job->ImgW * sizeof *Src.Scratch)))
+    {
+        __atomic_store_n(&Job->Failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (Job->Cfg->Mode == WM_Tile)
+    {
+        // Every band starts its tiles from the source, so bands stay independent.
+        const int TileW = (ScrW < Job->ImgW) ? ScrW : Job->ImgW;
+        for (int row = Row0; row < Row1; ++row)
+        {
+            DATA32 *Line = Job->Pixels + ((size_t)row * ScrW);
+            memcpy(Line, sourceRow(&Src, row % Job->ImgH), (size_t)TileW * sizeof *Line);
+            for (int col = TileW; col < ScrW; col += TileW)
+            {
+                memcpy(Line + col, Line, (size_t)((ScrW - col < TileW) ? ScrW - col : TileW) * sizeof *Line);
+            }
+        }
+        free(Src.Scratch);
+        return;
+    }
+
+    // Background around the window, then the window rows of this band.
+    const int Lo = (Row0 > Job->Y0) ? Row0 : Job->Y0;
+    const int Hi = (Row1 < Job->Y1) ? Row1 : Job->Y1;
+    for (int row = Row0; row < Row1; ++row)
+    {
+        DATA32 *Line = Job->Pixels + ((size_t)row * ScrW);
+        if (row >= Lo && row < Hi)
+        {
+            fillSpan(Line, Src.Bg, 0, Job->X0);
+            fillSpan(Line, Src.Bg, Job->X1, ScrW);
+        }
+        else
+        {
+            fillSpan(Line, Src.Bg, 0, ScrW);
+        }
+    }
+
+    DATA32 *Out = Job->Pixels + ((size_t)Lo * ScrW) + Job->X0;
+    if (Lo < Hi && !Job->Scaled)
+    {
+        for (int row = Lo; row < Hi; ++row, Out += ScrW)
+        {
+            const DATA32 *In = sourceRow(&Src, row - Job->dstY);
+            if (!In)
+            {
+                __atomic_store_n(&Job->Failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            memcpy(Out, In + (Job->X0 - Job->dstX), (size_t)(Job->X1 - Job->X0) * sizeof *Out);
+        }
+    }
+    else if (Lo < Hi && !scaleRows(&Job->Plan, sourceRow, &Src, Lo - Job->Y0, Hi - Job->Y0, Out, (size_t)ScrW))
+    {
+        __atomic_store_n(&Job->Failed, 1, __ATOMIC_RELAXED);
+    }
+    free(Src.Scratch);
+}
+
+// Set up Job to compose the background colour and Src, an image
+// Src.Width x ImgH placed per Cfg, into a ScrW x ScrH buffer. Touches no
+// Imlib2 state, so the playback thread can use it. Returns 0 if the colour
+// is malformed or memory runs out; otherwise composeEnd must follow.
+static int composeBegin(ComposeJob *Job, const WallpaperConfig *Cfg, SourceRows Src, int ImgH, int ScrW, int ScrH,
+                        DATA32 *Pixels)
+{
+    int red;
+    int grn;
+    int blu;
+    if (!parseColor(Cfg->BgColor, &red, &grn, &blu))
+    {
+        (void)fprintf(stderr, "Invalid colour: %s\n", Cfg->BgColor);
+        return 0;
+    }
+
+    *Job = (ComposeJob){.Cfg = Cfg, .Src = Src, .Pixels = Pixels, .ScrW = ScrW, .ScrH = ScrH, .ImgW = Src.Width};
+    Job->ImgH = ImgH;
+    Job->Src.Bg = 0xff000000u | ((DATA32)red << 16) | ((DATA32)grn << 8) | (DATA32)blu;
+
+    if (Cfg->Mode != WM_Tile)
+    {
+        int NewW;
+        int NewH;
+        placeImage(Cfg, ScrW, ScrH, Job->ImgW, Job->ImgH, &Job->dstX, &Job->dstY, &NewW, &NewH);
+
+        // Only the on-screen part of the placed image is produced; offsets
+        // may leave nothing of it.
+        Job->X0 = (Job->dstX > 0) ? Job->dstX : 0;
+        Job->Y0 = (Job->dstY > 0) ? Job->dstY : 0;
+        Job->X1 = (Job->dstX + NewW < ScrW) ? Job->dstX + NewW : ScrW;
+        Job->Y1 = (Job->dstY + NewH < ScrH) ? Job->dstY + NewH : ScrH;
+        if (Job->X1 <= Job->X0 || Job->Y1 <= Job->Y0)
+        {
+            Job->X0 = Job->Y0 = Job->X1 = Job->Y1 = 0;
+        }
+        else if (NewW != Job->ImgW || NewH != Job->ImgH)
+        {
+            if (!scalePlanInit(&Job->Plan, Job->ImgW, Job->ImgH, NewW, NewH, Job->X0 - Job->dstX,
+                               Job->Y0 - Job->dstY, Job->X1 - Job->X0, Job->Y1 - Job->Y0, Cfg->Filter,
+                               Cfg->Linear))
+            {
+                (void)fprintf(stderr, "Out of memory scaling to %dx%d\n", NewW, NewH);
+                return 0;
+            }
+            Job->Scaled = 1;
+        }
+    }
+    return 1;
+}
+
+// Run screen rows [Row0, Row1) through composeBand in up to Bands bands on
+// the pool.
+static void composeBands(ComposeJob *Job, int Row0, int Row1, int Bands)
+{
+    Job->RowBase = Row0;
+    Job->RowEnd = Row1;
+    Job->BandRows = (Row1 - Row0 + Bands - 1) / Bands;
+    Job->BandRows = (Job->BandRows < COMPOSE_BAND_MIN) ? COMPOSE_BAND_MIN : Job->BandRows;
+    poolRun(framePool(), composeBand, Job, (Row1 - Row0 + Job->BandRows - 1) / Job->BandRows);
+}
+
+// Source rows [First, First + Count) of a streamed image, copied out so
+// that bands can read them in any order.
+typedef struct StreamWindow
+{
+    const SourceRows *Src;           // The stream, read by one thread at a time.
+    const struct StreamWindow *Prev; // Window before this one, to take shared rows from.
+    DATA32 *Rows;
+    int Width;
+    int First;
+    int Count;
+    int Failed;
+} StreamWindow;
+
+static DATA32 *windowAt(const StreamWindow *Win, int Y)
+{
+    return Win->Rows + ((size_t)(Y - Win->First) * Win->Width);
+}
+
+static const uint32_t *windowRow(void *User, int Y)
+{
+    return windowAt(User, Y);
+}
+
+// Fill Win's rows, taking those it shares with Prev and pulling the rest.
+// Runs on a reader thread while the pool composes from Prev.
+static void *windowFill(void *Arg)
+{
+    StreamWindow *Win = Arg;
+    const StreamWindow *Prev = Win->Prev;
+    const size_t RowBytes = (size_t)Win->Width * sizeof *Win->Rows;
+    const int Last = Win->First + Win->Count;
+    int Y = Win->First;
+    for (; Prev && Y < Last && Y < Prev->First + Prev->Count; ++Y)
+    {
+        memcpy(windowAt(Win, Y), windowAt(Prev, Y), RowBytes);
+    }
+    for (; Y < Last; ++Y)
+    {
+        const uint32_t *Row = Win->Src->Pull(Win->Src->PullUser, Y);
+        if (!Row)
+        {
+            Win->Failed = 1;
+            break;
+        }
+        memcpy(windowAt(Win, Y), Row, RowBytes);
+    }
+    return NULL;
+}
+
+// Screen rows [Row0, End) whose source rows fit in WindowRows, at least
+// one row; returns End and the source rows in Win.
+static int composeStripe(const ComposeJob *Job, int Row0, int Row1, int WindowRows, StreamWindow *Win)
+{
+    int First = -1;
+    int Last = 0;
+    int End = Row0;
+    for (; End < Row1; ++End)
+    {
+        if (End < Job->Y0 || End >= Job->Y1)
+        {
+            continue; // Background only.
+        }
+        const int Win0 = Job->Scaled ? Job->Plan.Vert.Start[End - Job->Y0] : End - Job->dstY;
+        const int Win1 = Job->Scaled ? Win0 + Job->Plan.Vert.Len[End - Job->Y0] : Win0 + 1;
+        const int NewFirst = (First < 0) ? Win0 : First;
+        const int NewLast = (Win1 > Last) ? Win1 : Last;
+        if (End > Row0 && NewLast - NewFirst > WindowRows)
+        {
+            break;
+        }
+        First = NewFirst;
+        Last = NewLast;
+    }
+    Win->First = (First < 0) ? 0 : First;
+    Win->Count = (First < 0) ? 0 : Last - First;
+    return End;
+}
+
+// Compose a streamed source's screen rows [Row0, Row1) on the pool: the
+// rows are read top to bottom into one window while the bands of the
+// screen rows the other window covers compose. Returns 0, having read
+// nothing, if the run is memory budgeted or the windows can't be had, so
+// the caller composes in a single band instead.
+static int composeStreamed(ComposeJob *Job, int Row0, int Row1)
+{
+    // Budgeted runs were priced with a single band's rows.
+    WorkPool *Pool = framePool();
+    if (Job->Cfg->MaxMemory || poolThreads(Pool) < 2)
+    {
+        return 0;
+    }
+
+    // Shrinking a lot, one screen row may read more than a window's worth.
+    const size_t RowBytes = (size_t)Job->ImgW * sizeof(DATA32);
+    const int Taps = Job->Scaled ? Job->Plan.Vert.Taps : 1;
+    const size_t Fit = COMPOSE_STREAM_WINDOW / RowBytes;
+    const int WindowRows = (Fit > (size_t)Taps) ? (int)((Fit < INT_MAX) ? Fit : INT_MAX) : Taps;
+    const int ImgH = Job->ImgH;
+    const size_t Rows = (size_t)((WindowRows < ImgH) ? WindowRows : ImgH);
+    const SourceRows Stream = Job->Src; // Job->Src reads the windows while they fill.
+    StreamWindow Win[2] = {{.Src = &Stream, .Rows = pixbufAlloc(Rows * RowBytes), .Width = Job->ImgW},
+                           {.Src = &Stream, .Rows = pixbufAlloc(Rows * RowBytes), .Width = Job->ImgW}};
+    if (!Win[0].Rows || !Win[1].Rows)
+    {
+        pixbufFree(Win[0].Rows);
+        pixbufFree(Win[1].Rows);
+        return 0;
+    }
+
+    int Cur = 0;
+    int Row = Row0;
+    int End = composeStripe(Job, Row, Row1, WindowRows, &Win[Cur]);
+    windowFill(&Win[Cur]);
+    while (!Win[Cur].Failed)
+    {
+        StreamWindow *Now = &Win[Cur];
+        StreamWindow *Next = &Win[!Cur];
+        const int Stop = End;
+
+        // Read the next stripe's rows while this one composes.
+        pthread_t Reader;
+        int Threaded = 0;
+        if (Stop < Row1)
+        {
+            End = composeStripe(Job, Stop, Row1, WindowRows, Next);
+            Next->Prev = Now;
+            Next->Failed = 0;
+            Threaded = pthread_create(&Reader, NULL, windowFill, Next) == 0;
+        }
+
+        Job->Src.Pull = windowRow;
+        Job->Src.PullUser = Now;
+        composeBands(Job, Row, Stop, poolThreads(Pool) * 4);
+        Job->Src = Stream;
+
+        if (Threaded)
+        {
+            pthread_join(Reader, NULL);
+        }
+        else if (Stop < Row1)
+        {
+            windowFill(Next);
+        }
+        if (Stop >= Row1)
+        {
+            break;
+        }
+        Row = Stop;
+        Cur = !Cur;
+    }
+    Job->Failed |= Win[0].Failed | Win[1].Failed;
+    pixbufFree(Win[0].Rows);
+    pixbufFree(Win[1].Rows);
+    return 1;
+}
+
+// Compose screen rows [Row0, Row1) in parallel bands. A streamed source can
+// only be read top to bottom, so it has to be composed in one call. Returns
+// 0 if a streamed row fails to decode or memory runs out.
+static int composeRange(ComposeJob *Job, int Row0, int Row1)
+{
+    // A few bands per thread keeps the pool busy when bands cost unevenly;
+    // each band re-filters the source rows its taps share with the one above.
+    if (Job->Src.Data)
+    {
+        composeBands(Job, Row0, Row1, poolThreads(framePool()) * 4);
+    }
+    else if (!composeStreamed(Job, Row0, Row1))
+    {
+        composeBands(Job, Row0, Row1, 1);
+    }
+
+    if (Job->Failed)
+    {
+        (void)fprintf(stderr, "Cannot compose %dx%d frame\n", Job->ScrW, Job->ScrH);
+        return 0;
+    }
+    return 1;
+}
+
+static void composeEnd(ComposeJob *Job)
+{
+    if (Job->Scaled)
+    {
+        scalePlanFree(&Job->Plan);
+    }
+}
+
+// Compose a whole frame; see composeBegin.
+static int composeRows(const WallpaperConfig *Cfg, SourceRows Src, int ImgH, int ScrW, int ScrH, DATA32 *Pixels)
+{
+    ComposeJob Job;
+    if (!composeBegin(&Job, Cfg, Src, ImgH, ScrW, ScrH, Pixels))
+    {
+        return 0;
+    }
+    const int Ok = composeRange(&Job, 0, ScrH);
+    composeEnd(&Job);
+    return Ok;
+}
+
+// composeRows on the calling thread alone, for callers that already run
+// one composition per pool worker.
+static int composeSerial(const WallpaperConfig *Cfg, SourceRows Src, int ImgH, int ScrW, int ScrH, DATA32 *Pixels)
+{
+    ComposeJob Job;
+    if (!composeBegin(&Job, Cfg, Src, ImgH, ScrW, ScrH, Pixels))
+    {
+        return 0;
+    }
+    Job.RowBase = 0;
+    Job.RowEnd = ScrH;
+    Job.BandRows = ScrH;
+    composeBand(&Job, 0);
+    composeEnd(&Job);
+    return !Job.Failed;
+}
+
+// composeRows for an ImgW x ImgH ARGB32 image in memory.
+static int composePixels(const WallpaperConfig *Cfg, const DATA32 *Data, int ImgW, int ImgH, int HasAlpha, int ScrW,
+                         int ScrH, DATA32 *Pixels)
+{
+    SourceRows Src = {.Data = Data, .Width = ImgW, .HasAlpha = HasAlpha};
+    return composeRows(Cfg, Src, ImgH, ScrW, ScrH, Pixels);
+}
+
+// composePixels for a decoded Imlib2 image.
+static int composeFrame(const WallpaperConfig *Cfg, Imlib_Image Img, int ScrW, int ScrH, DATA32 *Pixels)
+{
+    imlib_context_set_image(Img);
+    return composePixels(Cfg, imlib_image_get_data_for_reading_only(), imlib_image_get_width(),
+                         imlib_image_get_height(), imlib_image_has_alpha(), ScrW, ScrH, Pixels);
+}
+
+// Streamed decodes
+//
+// A PNG or JPEG that is scaled down is decoded row by row into a window of
+// rows, which the pool scales while the next window decodes, so peak memory
+// follows the screen rather than the file. Decoding itself stays on one
+// thread, which is why images that decode no larger than the screen are
+// still loaded whole.
+
+// Rows decoded on demand; exactly one of Jpeg and Png is open.
+typedef struct
+{
+    JpegStream *Jpeg;
+    PngStream *Png;
+    int Width;
+    int Height;
+    int HasAlpha;
+} ImageStream;
+
+static const uint32_t *streamRow(void *User, int Y)
+{
+    ImageStream *Stream = User;
+    return Stream->Jpeg ? jpegStreamRow(Stream->Jpeg, Y) : pngStreamRow(Stream->Png, Y);
+}
+
+static void closeStream(ImageStream *Stream)
+{
+    if (Stream->Jpeg)
+    {
+        jpegStreamClose(Stream->Jpeg);
+    }
+    if (Stream->Png)
+    {
+        pngStreamClose(Stream->Png);
+    }
+    memset(Stream, 0, sizeof *Stream);
+}
+
+// Extension of Target's image if it is drawn in a way that can be streamed:
+// on the client, rows top to bottom. Center mode only reads the rows that
+// land on screen, so it is streamed only when asked to.
+static const char *streamExt(const DecodeTarget *Target)
+{
+    const WallpaperConfig *Cfg = Target->Cfg;
+    if (Cfg->Mode == WM_Tile || Cfg->ServerScale > 1 || (Cfg->Mode == WM_Center && !Target->ForceStream))
+    {
+        return NULL;
+    }
+    return strrchr(Cfg->Path, '.');
+}
+
+// Open Target's image as a stream if it is a PNG or JPEG, drawn scaled on
+// the client, that decodes to more pixels than the screen has, or any that
+// can be streamed with ForceStream. Returns 0 if it should be loaded whole
+// instead.
+static int openStream(ImageStream *Stream, DecodeTarget *Target)
+{
+    const WallpaperConfig *Cfg = Target->Cfg;
+    const char *ext = streamExt(Target);
+
+    memset(Stream, 0, sizeof *Stream);
+    if (!ext)
+    {
+        return 0;
+    }
+    if (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0)
+    {
+        Stream->Jpeg = jpegStreamOpen(Cfg->Path, decodeNeed, Target, &Stream->Width, &Stream->Height);
+    }
+    else if (strcasecmp(ext, ".png") == 0)
+    {
+        Stream->Png = pngStreamOpen(Cfg->Path, &Stream->Width, &Stream->Height, &Stream->HasAlpha);
+        Target->SrcW = Stream->Width;
+        Target->SrcH = Stream->Height;
+    }
+    if (!Stream->Jpeg && !Stream->Png)
+    {
+        return 0;
+    }
+    if (!Target->ForceStream && (size_t)Stream->Width * Stream->Height <= (size_t)Target->ScrW * Target->ScrH)
+    {
+        closeStream(Stream);
+        return 0;
+    }
+    return 1;
+}
+
+// Memory budget
+//
+// With max_memory set, a decode is priced from the image header before
+// anything big is allocated, and the first way of decoding that fits is
+// used: as usual, streamed, then at a half, a quarter or an eighth of the
+// drawn size. The prices count the image and frame buffers only.
+
+// Estimated peak bytes of decoding Target's image the way openStream and
+// loadImage would. Returns 0 if the header can't be read.
+static int priceDecode(DecodeTarget *Target, size_t *Bytes)
+{
+    const char *Path = Target->Cfg->Path;
+    const char *ext = strrchr(Path, '.');
+    const char *Stream = streamExt(Target);
+    const size_t Screen = (size_t)Target->ScrW * Target->ScrH;
+    int W;
+    int H;
+
+    if (ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0))
+    {
+        size_t Coef;
+        if (jpegProbe(Path, decodeNeed, Target, &W, &H, &Coef))
+        {
+            const int Streamed = Stream && (Target->ForceStream || (size_t)W * H > Screen);
+            *Bytes = Coef + ((size_t)W * (Streamed ? 1 : H) * sizeof(DATA32));
+            return 1;
+        }
+    }
+    else if (ext && strcasecmp(ext, ".png") == 0)
+    {
+        int Interlaced;
+        if (pngProbe(Path, &W, &H, &Interlaced))
+        {
+            // Streaming keeps two raw rows of up to 8 bytes a pixel and a converted one.
+            const int Streamed = Stream && !Interlaced && (Target->ForceStream || (size_t)W * H > Screen);
+            *Bytes = Streamed ? (size_t)W * 20 : (size_t)W * H * sizeof(DATA32);
+            return 1;
+        }
+    }
+    else if (ext && (strcasecmp(ext, ".avif") == 0 || strcasecmp(ext, ".avifs") == 0))
+    {
+        size_t Planes;
+        int CanShrink;
+        if (!avifProbe(Path, &W, &H, &Planes, &CanShrink))
+        {
+            return 0;
+        }
+        int NeedW;
+        int NeedH;
+        decodeNeed(Target, W, H, &NeedW, &NeedH);
+        if (CanShrink && NeedW < W && NeedH < H)
+        {
+            W = NeedW;
+            H = NeedH;
+        }
+        *Bytes = Planes + ((size_t)W * H * sizeof(DATA32));
+        return 1;
+    }
+
+    // Imlib2 reads only the header until the pixels are asked for.
+    Imlib_Image Img = imlib_load_image(Path);
+    if (!Img)
+    {
+        return 0;
+    }
+    imlib_context_set_image(Img);
+    *Bytes = (size_t)imlib_image_get_width() * imlib_image_get_height() * sizeof(DATA32);
+    imlib_free_image();
+    return 1;
+}
+
+// Pick how to decode Target's image within Cfg->MaxMemory, next to
+// FrameBytes of composed frames. Cfg is Target's, and gets the Shrink the
+// decode needs. Returns 0 with a message if nothing fits; an unreadable
+// header is left for the loader to report.
+static int planDecode(WallpaperConfig *Cfg, DecodeTarget *Target, size_t FrameBytes)
+{
+    static const struct
+    {
+        int ForceStream;
+        int Shrink;
+    } Plans[] = {{0, 1}, {1, 1}, {0, 2}, {1, 2}, {1, 4}, {1, 8}};
+
+    Target->ForceStream = 0;
+    Cfg->Shrink = 0;
+    if (Cfg->MaxMemory <= 0)
+    {
+        return 1;
+    }
+
+    // Center and tile draw the image at its own size, so it can't shrink.
+    const size_t Budget = (size_t)Cfg->MaxMemory << 20;
+    const int Scaled = Cfg->Mode != WM_Center && Cfg->Mode != WM_Tile;
+    size_t Least = SIZE_MAX;
+    for (size_t idx = 0; idx < sizeof Plans / sizeof *Plans && (Scaled || Plans[idx].Shrink == 1); ++idx)
+    {
+        size_t Bytes;
+        Target->ForceStream = Plans[idx].ForceStream;
+        Cfg->Shrink = Plans[idx].Shrink;
+        if (!priceDecode(Target, &Bytes))
+        {
+            Target->ForceStream = 0;
+            Cfg->Shrink = 0;
+            return 1;
+        }
+        Bytes += FrameBytes + MEMORY_BASELINE;
+        if (Bytes <= Budget)
+        {
+            return 1;
+        }
+        Least = (Bytes < Least) ? Bytes : Least;
+    }
+
+    (void)fprintf(stderr, "%s needs at least %zu MiB to show, over the %d MiB memory budget\n", Cfg->Path,
+                  (Least + ((1 << 20) - 1)) >> 20, Cfg->MaxMemory);
+    return 0;
+}
+
+// Source rows of Img, or of Stream when there is no decoded image.
+static SourceRows imageRows(Imlib_Image Img, ImageStream *Stream, int *ImgH)
+{
+    if (Img)
+    {
+        imlib_context_set_image(Img);
+        *ImgH = imlib_image_get_height();
+        return (SourceRows){.Data = imlib_image_get_data_for_reading_only(),
+                            .Width = imlib_image_get_width(),
+                            .HasAlpha = imlib_image_has_alpha()};
+    }
+    *ImgH = Stream->Height;
+    return (SourceRows){.Pull = streamRow, .PullUser = Stream, .Width = Stream->Width, .HasAlpha = Stream->HasAlpha};
+}
+
+// Compose Img, or Stream's rows when there is no decoded image.
+static int composeImage(const WallpaperConfig *Cfg, Imlib_Image Img, ImageStream *Stream, int ScrW, int ScrH,
+                        DATA32 *Pixels)
+{
+    int ImgH;
+    SourceRows Src = imageRows(Img, Stream, &ImgH);
+    return composeRows(Cfg, Src, ImgH, ScrW, ScrH, Pixels);
+}
+
+// Pixel layout of a composed frame on this display.
+static void frameFormat(const WallDisplay *Wd, FrameFormat *Fmt)
+{
+    const Visual *Vis = DefaultVisual(Wd->Dpy, Wd->Scr);
+    *Fmt = (FrameFormat){.Width = (uint32_t)Wd->Width,
+                         .Height = (uint32_t)Wd->Height,
+                         .Stride = (uint32_t)Wd->Width * 4,
+                         .Depth = (uint32_t)Wd->Depth,
+                         .BitsPerPixel = 32,
+                         .ByteOrder = (uint32_t)hostByteOrder(),
+                         .RedMask = (uint32_t)Vis->red_mask,
+                         .GreenMask = (uint32_t)Vis->green_mask,
+                         .BlueMask = (uint32_t)Vis->blue_mask};
+}
+
+// Everything the composed frame depends on, as a cache key.
+static int frameKey(char *Buffer, size_t Size, const WallpaperConfig *Cfg, const FrameFormat *Fmt)
+{
+    struct stat St;
+    if (stat(Cfg->Path, &St) != 0)
+    {
+        return 0;
+    }
+
+    // Linear light and shrunk decodes are appended only when set, so
+    // existing entries stay valid.
+    int Len = snprintf(Buffer, Size, "%s\n%lld.%09ld\n%lld\n%s\n%d,%d\n%s\n%ux%u\n%d\n%s%s", Cfg->Path,
+                       (long long)St.st_mtim.tv_sec, St.st_mtim.tv_nsec, (long long)St.st_size,
+                       ModeLUT[Cfg->Mode].Name, Cfg->OffsetX, Cfg->OffsetY, Cfg->BgColor, Fmt->Width, Fmt->Height,
+                       Cfg->ServerScale, FilterLUT[Cfg->Filter].Name, Cfg->Linear ? "\nlinear" : "");
+    if (Len > 0 && (size_t)Len < Size && Cfg->Shrink > 1)
+    {
+        Len += snprintf(Buffer + Len, Size - (size_t)Len, "\nshrink %d", Cfg->Shrink);
+    }
+    return Len > 0 && (size_t)Len < Size;
+}
+
+// Identity of what Cfg displays on this screen, or 0 if the image is gone.
+static uint64_t stateHash(const WallDisplay *Wd, const WallpaperConfig *Cfg)
+{
+    FrameFormat Fmt;
+    char Key[PATH_MAX + 256];
+
+    frameFormat(Wd, &Fmt);
+    if (!frameKey(Key, sizeof Key, Cfg, &Fmt))
+    {
+        return 0;
+    }
+    return frameCacheHash(Key, strlen(Key));
+}
+
+// True if the root pixmap already shows Cfg, as recorded by publishPixmap.
+// Older versions recorded only the first three state items.
+static int isAlreadyShown(const WallDisplay *Wd, const WallpaperConfig *Cfg)
+{
+    uint64_t Hash = stateHash(Wd, Cfg);
+
+    // The pixmap check catches other setters that left our property behind.
+    return Hash != 0 && Wd->StateItems >= 3 && Wd->State[0] == (Hash & 0xffffffffu) && Wd->State[1] == (Hash >> 32) &&
+           Wd->RootPixmap != None && Wd->RootPixmap == Wd->State[2];
+}
+
+// Point the root window and the pseudo-transparency atoms at Pix, and
+// record what it shows for isAlreadyShown.
+static void publishPixmap(WallDisplay *Wd, const WallpaperConfig *Cfg, Pixmap Pix, int created)
+{
+    Display *Dpy = Wd->Dpy;
+    uint64_t Hash = stateHash(Wd, Cfg);
+    unsigned long State[4] = {(unsigned long)(Hash & 0xffffffffu), (unsigned long)(Hash >> 32), Pix,
+                              ((unsigned long)Wd->Width << 16) | (unsigned long)Wd->Height};
+
+    traceBegin("publishPixmap");
+    XChangeProperty(Dpy, Wd->Root, Wd->AtomRootPixmap, XA_PIXMAP, 32, PropModeReplace, (unsigned char *)&Pix, 1);
+    XChangeProperty(Dpy, Wd->Root, Wd->AtomSetroot, XA_PIXMAP, 32, PropModeReplace, (unsigned char *)&Pix, 1);
+    XChangeProperty(Dpy, Wd->Root, Wd->AtomState, XA_CARDINAL, 32, PropModeReplace, (unsigned char *)State, 4);
+    Wd->RootPixmap = Pix;
+    memcpy(Wd->State, State, sizeof State);
+    Wd->StateItems = 4;
+
+    XSetWindowBackgroundPixmap(Dpy, Wd->Root, Pix);
+    XClearWindow(Dpy, Wd->Root);
+    XFlush(Dpy);
+
+    // Retained pixmaps outlive us already; a fallback one needs the whole
+    // connection kept.
+    if (created && Pix == Wd->Owned)
+    {
+        XSetCloseDownMode(Dpy, RetainPermanent);
+    }
+    traceEnd();
+}
+
+// Upload Img at 1/ServerScale of its placed size and let XRender scale it
+// into Pix, which already holds the background colour. Returns 0 if the
+// server lacks RENDER or the copy can't be made, so the caller can scale
+// on the client instead.
+static int renderServerScaled(WallDisplay *Wd, const WallpaperConfig *Cfg, Pixmap Pix, Imlib_Image Img)
+{
+    Display *Dpy = Wd->Dpy;
+    Visual *Vis = DefaultVisual(Dpy, Wd->Scr);
+    int EventBase;
+    int ErrorBase;
+
+    if (!XRenderQueryExtension(Dpy, &EventBase, &ErrorBase))
+    {
+        return 0;
+    }
+    XRenderPictFormat *Format = XRenderFindVisualFormat(Dpy, Vis);
+    if (!Format)
+    {
+        return 0;
+    }
+
+    imlib_context_set_image(Img);
+    int dstX;
+    int dstY;
+    int NewW;
+    int NewH;
+    placeImage(Cfg, Wd->Width, Wd->Height, imlib_image_get_width(), imlib_image_get_height(), &dstX, &dstY, &NewW,
+               &NewH);
+    const int UpW = (NewW / Cfg->ServerScale > 0) ? NewW / Cfg->ServerScale : 1;
+    const int UpH = (NewH / Cfg->ServerScale > 0) ? NewH / Cfg->ServerScale : 1;
+
+    // Reduced-size copy, flattened over the background by composeFrame.
+    // Other visuals get the flattened copy through Imlib2, so alpha is
+    // never blended over the new pixmap's undefined contents.
+    Pixmap Small = XCreatePixmap(Dpy, Pix, UpW, UpH, Wd->Depth);
+    UploadBuffer Buf;
+    WallpaperConfig Stretch = *Cfg;
+    Stretch.Mode = WM_Scale;
+    int Composed = 0;
+    if (Wd->Native && uploadCreate(&Buf, Dpy, Vis, Wd->Depth, UpW, UpH))
+    {
+        Composed = composeFrame(&Stretch, Img, UpW, UpH, (DATA32 *)Buf.Data);
+        if (Composed)
+        {
+            uploadPut(&Buf, Small, 0, 0);
+        }
+        uploadDestroy(&Buf);
+    }
+    else
+    {
+        DATA32 *Pixels = pixbufAlloc((size_t)UpW * UpH * sizeof(DATA32));
+        Imlib_Image Flat = NULL;
+        Composed = Pixels && composeFrame(&Stretch, Img, UpW, UpH, Pixels) &&
+                   (Flat = imlib_create_image_using_data(UpW, UpH, Pixels)) != NULL;
+        if (Composed)
+        {
+            imlib_context_set_image(Flat);
+            imlib_context_set_drawable(Small);
+            imlib_render_image_on_drawable(0, 0);
+            imlib_free_image();
+        }
+        pixbufFree(Pixels);
+    }
+    if (!Composed)
+    {
+        XFreePixmap(Dpy, Small);
+        return 0;
+    }
+
+    // The transform maps destination pixels back into the small pixmap.
+    XTransform Xform = {{{XDoubleToFixed((double)UpW / NewW), 0, 0},
+                         {0, XDoubleToFixed((double)UpH / NewH), 0},
+                         {0, 0, XDoubleToFixed(1.0)}}};
+    XRenderPictureAttributes Attrs = {.repeat = RepeatPad};
+    Picture Src = XRenderCreatePicture(Dpy, Small, Format, CPRepeat, &Attrs);
+    Picture Dst = XRenderCreatePicture(Dpy, Pix, Format, 0, NULL);
+
+    XRenderSetPictureTransform(Dpy, Src, &Xform);
+    XRenderSetPictureFilter(Dpy, Src, FilterGood, NULL, 0);
+    XRenderComposite(Dpy, PictOpSrc, Src, None, Dst, 0, 0, 0, 0, dstX, dstY, (unsigned int)NewW, (unsigned int)NewH);
+
+    XRenderFreePicture(Dpy, Src);
+    XRenderFreePicture(Dpy, Dst);
+    XFreePixmap(Dpy, Small);
+    return 1;
+}
+
+// Crossfade
+
+static double monotonicNow(void)
+{
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (double)Now.tv_sec + ((double)Now.tv_nsec * 1e-9);
+}
+
+// Sleep until the CLOCK_MONOTONIC time When; returns early on a signal.
+static void sleepUntil(double When)
+{
+    if (When <= 0.0)
+    {
+        return;
+    }
+    struct timespec Until = {.tv_sec = (time_t)When, .tv_nsec = (long)((When - (double)(time_t)When) * 1e9)};
+    (void)clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Until, NULL);
+}
+
+// One client-side fade step, split into bands of rows for the pool.
+typedef struct
+{
+    const DATA32 *Old;
+    const DATA32 *New;
+    DATA32 *Out;
+    int Width;
+    int Height;
+    int OldStride; // In pixels; the read-back image may be padded.
+    int BandRows;
+    uint32_t Weight; // Share of New, 0-256.
+} FadeJob;
+
+static void fadeBand(void *User, int Index)
+{
+    const FadeJob *Job = User;
+    const uint32_t NewW = Job->Weight;
+    const uint32_t OldW = 256 - NewW;
+    const int Y0 = Index * Job->BandRows;
+    const int Y1 = (Y0 + Job->BandRows < Job->Height) ? Y0 + Job->BandRows : Job->Height;
+
+    for (int Y = Y0; Y < Y1; ++Y)
+    {
+        const DATA32 *Old = Job->Old + ((size_t)Y * Job->OldStride);
+        const DATA32 *New = Job->New + ((size_t)Y * Job->Width);
+        DATA32 *Out = Job->Out + ((size_t)Y * Job->Width);
+
+        // Red and blue share a multiply, each lane stays below 2^16; plain
+        // integer ops so the compiler vectorizes the loop.
+        for (int X = 0; X < Job->Width; ++X)
+        {
+            const uint32_t A = Old[X];
+            const uint32_t B = New[X];
+            const uint32_t RB = ((((A & 0xff00ffu) * OldW) + ((B & 0xff00ffu) * NewW)) >> 8) & 0xff00ffu;
+            const uint32_t G = ((((A & 0xff00u) * OldW) + ((B & 0xff00u) * NewW)) >> 8) & 0xff00u;
+            Out[X] = (B & 0xff000000u) | RB | G;
+        }
+    }
+}
+
+// Wait for the next fade step and set T to the share of Length it shows.
+// Steps already overdue are skipped rather than drawn late. Returns 0, and
+// the caller draws the final frame, once the clock or a step costing Cost
+// seconds would run past Length.
+static int fadeNextStep(double Start, double Length, double Cost, int *Step, double *T)
+{
+    const double Period = FADE_STEP_MS * 1e-3;
+    const double Now = monotonicNow();
+    int Next = *Step + 1;
+    if (Start + (Next * Period) < Now)
+    {
+        Next = (int)((Now - Start) / Period) + 1;
+    }
+    const double Due = Start + (Next * Period);
+    if (Due + Cost >= Start + Length)
+    {
+        return 0;
+    }
+    sleepUntil(Due);
+    *Step = Next;
+    *T = (monotonicNow() - Start) / Length;
+    return *T < 1.0;
+}
+
+// Fade on the server: Over with a constant mask A leaves New*A + Pix*(1-A)
+// in Pix. Each step composes onto the previous one, so A is the part of the
+// remaining distance that the clock has covered. Returns 0 without RENDER.
+static int fadeRender(WallDisplay *Wd, UploadBuffer *Buf, Pixmap Pix, double Start, double Length)
+{
+    Display *Dpy = Wd->Dpy;
+    int EventBase;
+    int ErrorBase;
+    if (!XRenderQueryExtension(Dpy, &EventBase, &ErrorBase))
+    {
+        return 0;
+    }
+    XRenderPictFormat *Format = XRenderFindVisualFormat(Dpy, DefaultVisual(Dpy, Wd->Scr));
+    if (!Format)
+    {
+        return 0;
+    }
+
+    const unsigned int Width = (unsigned int)Wd->Width;
+    const unsigned int Height = (unsigned int)Wd->Height;
+    Pixmap New = XCreatePixmap(Dpy, Wd->Root, Width, Height, Wd->Depth);
+    uploadPut(Buf, New, 0, 0);
+    Picture Src = XRenderCreatePicture(Dpy, New, Format, 0, NULL);
+    Picture Dst = XRenderCreatePicture(Dpy, Pix, Format, 0, NULL);
+
+    double Shown = 0.0; // Share of New already in Pix.
+    double Cost = 0.0;  // Seconds the last step took.
+    int Step = 0;
+    double T;
+    while (fadeNextStep(Start, Length, Cost, &Step, &T))
+    {
+        const double Began = monotonicNow();
+        XRenderColor Alpha = {.alpha = (unsigned short)(((T - Shown) / (1.0 - Shown)) * 0xffff)};
+        Picture Mask = XRenderCreateSolidFill(Dpy, &Alpha);
+        XRenderComposite(Dpy, PictOpOver, Src, Mask, Dst, 0, 0, 0, 0, 0, 0, Width, Height);
+        XRenderFreePicture(Dpy, Mask);
+        XClearWindow(Dpy, Wd->Root);
+        XSync(Dpy, False); // One step in flight, so a busy server drops steps instead of queueing them.
+        Shown = T;
+        Cost = monotonicNow() - Began;
+    }
+
+    GC GCtx = XCreateGC(Dpy, Pix, 0, NULL);
+    XCopyArea(Dpy, New, Pix, GCtx, 0, 0, Width, Height, 0, 0);
+    XFreeGC(Dpy, GCtx);
+    XRenderFreePicture(Dpy, Src);
+    XRenderFreePicture(Dpy, Dst);
+    XFreePixmap(Dpy, New);
+    return 1;
+}
+
+// Fade on the client: read the old frame back once, blend every step in
+// parallel bands and upload it. Returns 0 if the old frame is unusable.
+static int fadeClient(WallDisplay *Wd, UploadBuffer *Buf, Pixmap Pix, double Start, double Length)
+{
+    Display *Dpy = Wd->Dpy;
+    XImage *Old = XGetImage(Dpy, Pix, 0, 0, (unsigned int)Wd->Width, (unsigned int)Wd->Height, AllPlanes, ZPixmap);
+    if (!Old)
+    {
+        return 0;
+    }
+    UploadBuffer Mix;
+    if (Old->bits_per_pixel != 32 || Old->byte_order != Buf->Image->byte_order ||
+        !uploadCreate(&Mix, Dpy, DefaultVisual(Dpy, Wd->Scr), Wd->Depth, Wd->Width, Wd->Height))
+    {
+        XDestroyImage(Old);
+        return 0;
+    }
+
+    FadeJob Job = {.Old = (const DATA32 *)Old->data,
+                   .New = (const DATA32 *)Buf->Data,
+                   .Out = (DATA32 *)Mix.Data,
+                   .Width = Wd->Width,
+                   .Height = Wd->Height,
+                   .OldStride = Old->bytes_per_line / 4};
+    WorkPool *Pool = framePool();
+    const int Bands = poolThreads(Pool) * 4;
+    Job.BandRows = (Job.Height + Bands - 1) / Bands;
+    Job.BandRows = (Job.BandRows < COMPOSE_BAND_MIN) ? COMPOSE_BAND_MIN : Job.BandRows;
+
+    double Cost = 0.0; // Seconds the last step took.
+    int Step = 0;
+    double T;
+    while (fadeNextStep(Start, Length, Cost, &Step, &T))
+    {
+        const double Began = monotonicNow();
+        Job.Weight = (uint32_t)(T * 256.0);
+        poolRun(Pool, fadeBand, &Job, (Job.Height + Job.BandRows - 1) / Job.BandRows);
+        uploadPut(&Mix, Pix, 0, 0);
+        XClearWindow(Dpy, Wd->Root);
+        uploadWait(&Mix);
+        Cost = monotonicNow() - Began;
+    }
+
+    uploadPut(Buf, Pix, 0, 0);
+    uploadDestroy(&Mix);
+    XDestroyImage(Old);
+    return 1;
+}
+
+// Put Buf's frame into Pix. If Cfg asks for it and Pix already showed a
+// wallpaper, crossfade to it, on the server when RENDER is there. Steps
+// are drawn at whatever blend the clock has reached, and one that would
+// overrun the fade is dropped for the final frame, so a loaded machine
+// shows fewer steps rather than a longer fade.
+static void presentFrame(WallDisplay *Wd, const WallpaperConfig *Cfg, UploadBuffer *Buf, Pixmap Pix, int created)
+{
+    if (Cfg->Fade > 0 && !created)
+    {
+        const double Start = monotonicNow();
+        const double Length = Cfg->Fade * 1e-3;
+        if (fadeRender(Wd, Buf, Pix, Start, Length) || fadeClient(Wd, Buf, Pix, Start, Length))
+        {
+            return;
+        }
+    }
+    uploadPut(Buf, Pix, 0, 0);
+}
+
+// Show a previously composed frame without decoding. Returns 0 on a miss.
+static int restoreCachedFrame(WallDisplay *Wd, const WallpaperConfig *Cfg)
+{
+    FrameFormat Fmt;
+    CachedFrame Frame;
+    char Key[PATH_MAX + 256];
+
+    if (!Wd->Native)
+    {
+        return 0;
+    }
+    frameFormat(Wd, &Fmt);
+    if (!frameKey(Key, sizeof Key, Cfg, &Fmt) || !frameCacheOpen(Key, &Fmt, &Frame))
+    {
+        return 0;
+    }
+
+    int created = 0;
+    Pixmap Pix = getOrCreateRootPixmap(Wd, NULL, &created);
+    UploadBuffer *Buf = frameBuffer(Wd);
+    if (Buf && (Buf->UseShm || (Cfg->Fade > 0 && !created)))
+    {
+        // Already paying for a segment; one memcpy beats the socket.
+        memcpy(Buf->Data, Frame.Pixels, (size_t)Fmt.Stride * Fmt.Height);
+        presentFrame(Wd, Cfg, Buf, Pix, created);
+    }
+    else
+    {
+        uploadPutData(Wd->Dpy, DefaultVisual(Wd->Dpy, Wd->Scr), Wd->Depth, Pix, Frame.Pixels, (int)Fmt.Width,
+                      (int)Fmt.Height, (int)Fmt.Stride, (int)Fmt.ByteOrder);
+    }
+    publishPixmap(Wd, Cfg, Pix, created);
+    frameCacheClose(&Frame);
+    return 1;
+}
+
+// One frame conversion, split into bands of rows for the pool.
+typedef struct
+{
+    const ConvertPlan *Plan;
+    const DATA32 *Pixels;
+    UploadBuffer *Buf;
+    int BandRows;
+} ConvertJob;
+
+static void convertBand(void *User, int Index)
+{
+    const ConvertJob *Job = User;
+    const int Row0 = Index * Job->BandRows;
+    const int Row1 = (Row0 + Job->BandRows < Job->Buf->Height) ? Row0 + Job->BandRows : Job->Buf->Height;
+    convertRows(Job->Plan, Job->Pixels, (size_t)Job->Buf->Width * sizeof *Job->Pixels, Job->Buf->Data,
+                (size_t)Job->Buf->Stride, Job->Buf->Width, Row0, Row1);
+}
+
+// Draw a composed frame on a non-native visual. TrueColor layouts are
+// converted into the frame buffer in parallel and uploaded as they are;
+// anything else, such as a palette, goes through Imlib2. Returns 0 if
+// memory runs out.
+static int renderComposed(WallDisplay *Wd, Pixmap Pix, DATA32 *Pixels)
+{
+    const Visual *Vis = DefaultVisual(Wd->Dpy, Wd->Scr);
+    UploadBuffer *Buf = (Vis->class == TrueColor) ? frameBuffer(Wd) : NULL;
+    ConvertPlan Plan;
+    if (Buf && convertPlanInit(&Plan, Vis->red_mask, Vis->green_mask, Vis->blue_mask, Buf->Image->bits_per_pixel,
+                               Buf->Image->byte_order != hostByteOrder()))
+    {
+        WorkPool *Pool = framePool();
+        ConvertJob Job = {.Plan = &Plan, .Pixels = Pixels, .Buf = Buf};
+        const int Bands = poolThreads(Pool) * 4;
+        Job.BandRows = (Buf->Height + Bands - 1) / Bands;
+        Job.BandRows = (Job.BandRows < COMPOSE_BAND_MIN) ? COMPOSE_BAND_MIN : Job.BandRows;
+        poolRun(Pool, convertBand, &Job, (Buf->Height + Job.BandRows - 1) / Job.BandRows);
+        uploadPut(Buf, Pix, 0, 0);
+        return 1;
+    }
+
+    Imlib_Image Frame = imlib_create_image_using_data(Wd->Width, Wd->Height, Pixels);
+    if (!Frame)
+    {
+        (void)fprintf(stderr, "Imlib image alloc failed\n");
+        return 0;
+    }
+    imlib_context_set_image(Frame);
+    imlib_context_set_drawable(Pix);
+    imlib_render_image_on_drawable(0, 0);
+    imlib_free_image();
+    return 1;
+}
+
+// Bands of a pipelined upload composed so far, shared between
+// composePipelined and its helper thread.
+typedef struct
+{
+    ComposeJob *Job;
+    int BandRows;
+    int Bands;
+    pthread_mutex_t Lock;
+    pthread_cond_t Ready;
+    int Done;
+    int Failed;
+} UploadPipe;
+
+static void *pipeCompose(void *Arg)
+{
+    UploadPipe *Pipe = Arg;
+    const int ScrH = Pipe->Job->ScrH;
+    for (int band = 0; band < Pipe->Bands; ++band)
+    {
+        const int Row0 = band * Pipe->BandRows;
+        const int Ok = composeRange(Pipe->Job, Row0, (Row0 + Pipe->BandRows < ScrH) ? Row0 + Pipe->BandRows : ScrH);
+
+        pthread_mutex_lock(&Pipe->Lock);
+        Pipe->Done += Ok;
+        Pipe->Failed = !Ok;
+        pthread_cond_signal(&Pipe->Ready);
+        pthread_mutex_unlock(&Pipe->Lock);
+        if (!Ok)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Compose Job's frame into Buf and send it to Pix a band at a time: a
+// helper thread composes the next band on the pool while this thread,
+// the only one touching Xlib, writes the previous one to the socket.
+// Returns 0 if composing fails, possibly after earlier bands were sent, so
+// Pix should not be on screen.
+static int composePipelined(ComposeJob *Job, UploadBuffer *Buf, Pixmap Pix)
+{
+    UploadPipe Pipe = {.Job = Job};
+    const int ScrH = Job->ScrH;
+    Pipe.BandRows = (ScrH + PIPELINE_BANDS - 1) / PIPELINE_BANDS;
+    Pipe.BandRows = (Pipe.BandRows < COMPOSE_BAND_MIN) ? COMPOSE_BAND_MIN : Pipe.BandRows;
+    Pipe.Bands = (ScrH + Pipe.BandRows - 1) / Pipe.BandRows;
+    pthread_mutex_init(&Pipe.Lock, NULL);
+    pthread_cond_init(&Pipe.Ready, NULL);
+
+    // Without the thread, everything is composed up front and then sent.
+    pthread_t Composer;
+    const int Threaded = pthread_create(&Composer, NULL, pipeCompose, &Pipe) == 0;
+    if (!Threaded)
+    {
+        pipeCompose(&Pipe);
+    }
+
+    for (int band = 0; band < Pipe.Bands; ++band)
+    {
+        pthread_mutex_lock(&Pipe.Lock);
+        while (Pipe.Done <= band && !Pipe.Failed)
+        {
+            pthread_cond_wait(&Pipe.Ready, &Pipe.Lock);
+        }
+        const int Composed = Pipe.Done > band;
+        pthread_mutex_unlock(&Pipe.Lock);
+        if (!Composed)
+        {
+            break;
+        }
+        const int Row0 = band * Pipe.BandRows;
+        uploadPutRows(Buf, Pix, 0, 0, Row0, (Row0 + Pipe.BandRows < ScrH) ? Row0 + Pipe.BandRows : ScrH);
+    }
+
+    if (Threaded)
+    {
+        pthread_join(Composer, NULL);
+    }
+    pthread_mutex_destroy(&Pipe.Lock);
+    pthread_cond_destroy(&Pipe.Ready);
+    return !Pipe.Failed;
+}
+
+// True if Img's frame is sent over the socket band by band as it is
+// composed. Streams are composed in one go and can't overlap, and a fade
+// needs the whole frame first.
+static int uploadPipelined(const WallpaperConfig *Cfg, Imlib_Image Img, const UploadBuffer *Buf)
+{
+    return Img && Buf && !Buf->UseShm && Cfg->Fade <= 0;
+}
+
+// Compose Img into Buf while pipelining it to a fresh off-screen pixmap, so
+// a failure midway leaves the current wallpaper untouched. Returns None on
+// failure.
+static Pixmap composeOffscreen(WallDisplay *Wd, const WallpaperConfig *Cfg, Imlib_Image Img, UploadBuffer *Buf)
+{
+    ComposeJob Job;
+    int ImgH;
+    SourceRows Src = imageRows(Img, NULL, &ImgH);
+    if (!composeBegin(&Job, Cfg, Src, ImgH, Wd->Width, Wd->Height, (DATA32 *)Buf->Data))
+    {
+        return None;
+    }
+    Pixmap Back = XCreatePixmap(Wd->Dpy, Wd->Root, Wd->Width, Wd->Height, Wd->Depth);
+    traceBegin("compose + upload");
+    const int Ok = composePipelined(&Job, Buf, Back);
+    traceEnd();
+    composeEnd(&Job);
+    if (!Ok)
+    {
+        XFreePixmap(Wd->Dpy, Back);
+        return None;
+    }
+    return Back;
+}
+
+// Copy a whole-screen pixmap onto Pix in one request and free it.
+static void movePixmap(WallDisplay *Wd, Pixmap From, Pixmap Pix)
+{
+    GC GCtx = XCreateGC(Wd->Dpy, Pix, 0, NULL);
+    XCopyArea(Wd->Dpy, From, Pix, GCtx, 0, 0, (unsigned int)Wd->Width, (unsigned int)Wd->Height, 0, 0);
+    XFreeGC(Wd->Dpy, GCtx);
+    XFreePixmap(Wd->Dpy, From);
+}
+
+// Paint an already decoded image, or Stream's rows when Img is NULL, as the
+// wallpaper. Streams are never server scaled. Returns 0 on failure.
+static int applyWallpaper(WallDisplay *Wd, const WallpaperConfig *Cfg, Imlib_Image Img, ImageStream *Stream)
+{
+    int created = 0;
+    if (Cfg->ServerScale > 1 && Cfg->Mode != WM_Center && Cfg->Mode != WM_Tile)
+    {
+        Pixmap Pix = getOrCreateRootPixmap(Wd, Cfg->BgColor, &created);
+        if (Pix == None)
+        {
+            return 0;
+        }
+        traceBegin("render (XRender)");
+        const int Rendered = renderServerScaled(Wd, Cfg, Pix, Img);
+        traceEnd();
+        if (Rendered)
+        {
+            publishPixmap(Wd, Cfg, Pix, created);
+            return 1;
+        }
+    }
+
+    if (!Wd->Native)
+    {
+        // Compose on the client anyway, then let Imlib2 convert.
+        DATA32 *Pixels = pixbufAlloc((size_t)Wd->Width * Wd->Height * sizeof *Pixels);
+        traceBegin("compose");
+        const int Composed = Pixels && composeImage(Cfg, Img, Stream, Wd->Width, Wd->Height, Pixels);
+        traceEnd();
+        if (!Composed)
+        {
+            pixbufFree(Pixels);
+            return 0;
+        }
+        Pixmap Pix = getOrCreateRootPixmap(Wd, NULL, &created);
+        traceBegin("upload");
+        const int Ok = renderComposed(Wd, Pix, Pixels);
+        traceEnd();
+        pixbufFree(Pixels);
+        if (Ok)
+        {
+            publishPixmap(Wd, Cfg, Pix, created);
+        }
+        return Ok;
+    }
+
+    FrameFormat Fmt;
+    char Key[PATH_MAX + 256];
+    frameFormat(Wd, &Fmt);
+
+    // Compose straight into the (possibly shared) upload buffer, over the
+    // socket overlapping the transfer where possible.
+    UploadBuffer *Buf = frameBuffer(Wd);
+    if (uploadPipelined(Cfg, Img, Buf))
+    {
+        Pixmap Back = composeOffscreen(Wd, Cfg, Img, Buf);
+        if (Back == None)
+        {
+            return 0;
+        }
+        Pixmap Pix = getOrCreateRootPixmap(Wd, NULL, &created);
+        movePixmap(Wd, Back, Pix);
+        publishPixmap(Wd, Cfg, Pix, created);
+        if (frameKey(Key, sizeof Key, Cfg, &Fmt))
+        {
+            (void)frameCacheStore(Key, &Fmt, Buf->Data);
+        }
+        return 1;
+    }
+
+    traceBegin("compose");
+    const int Composed = Buf && composeImage(Cfg, Img, Stream, Wd->Width, Wd->Height, (DATA32 *)Buf->Data);
+    traceEnd();
+    if (!Composed)
+    {
+        return 0;
+    }
+
+    Pixmap Pix = getOrCreateRootPixmap(Wd, NULL, &created);
+    traceBegin("upload");
+    presentFrame(Wd, Cfg, Buf, Pix, created);
+    traceEnd();
+    publishPixmap(Wd, Cfg, Pix, created);
+
+    // A failed cache write only costs the next restore a decode.
+    if (frameKey(Key, sizeof Key, Cfg, &Fmt))
+    {
+        (void)frameCacheStore(Key, &Fmt, Buf->Data);
+    }
+    return 1;
+}
+
+// Core wallpaper routine
+static void setWallpaper(const WallpaperConfig *Cfg)
+{
+    WallDisplay Wd;
+    if (!openDisplay(&Wd))
+    {
+        die("XOpenDisplay");
+    }
+
+    // A streamed image is decoded as it is composed. Other visuals need a
+    // second frame to convert into. The plan comes first: a shrunk decode is
+    // a different frame, and is shown and cached under its own key.
+    WallpaperConfig Shown = *Cfg;
+    DecodeTarget Target = {.Cfg = &Shown, .ScrW = Wd.Width, .ScrH = Wd.Height};
+    const size_t FrameBytes = (size_t)Wd.Width * Wd.Height * sizeof(DATA32) * (Wd.Native ? 1 : 2);
+    const int Fits = planDecode(&Shown, &Target, FrameBytes);
+
+    traceBegin("frame cache");
+    const int Cached = Fits && (isAlreadyShown(&Wd, &Shown) || restoreCachedFrame(&Wd, &Shown));
+    traceEnd();
+    if (Cached)
+    {
+        closeDisplay(&Wd);
+        return;
+    }
+
+    ImageStream Stream;
+    traceBegin("decode");
+    const int Streamed = Fits && openStream(&Stream, &Target);
+    Imlib_Image Img = (Fits && !Streamed) ? loadImage(Shown.Path, &Target) : NULL;
+    traceEnd();
+    if (!Streamed && !Img)
+    {
+        closeDisplay(&Wd);
+        exit(EXIT_FAILURE);
+    }
+
+    int Ok = applyWallpaper(&Wd, &Shown, Img, &Stream);
+
+    if (Streamed)
+    {
+        closeStream(&Stream);
+    }
+    else
+    {
+        imlib_context_set_image(Img);
+        imlib_free_image();
+    }
+
+    closeDisplay(&Wd);
+    if (!Ok)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Headless render
+
+// Compose Cfg on a Width x Height frame the way setWallpaper does and write
+// it to Path, without connecting to X. Nothing is cached or saved. Returns
+// 0 on failure.
+static int renderToFile(const WallpaperConfig *Cfg, const char *Path, int Width, int Height)
+{
+    // XRender scaling needs a server; the client scaler stands in for it.
+    WallpaperConfig Local = *Cfg;
+    Local.ServerScale = 0;
+
+    DecodeTarget Target = {.Cfg = &Local, .ScrW = Width, .ScrH = Height};
+    ImageStream Stream;
+    traceBegin("decode");
+    const int Fits = planDecode(&Local, &Target, (size_t)Width * Height * sizeof(DATA32));
+    const int Streamed = Fits && openStream(&Stream, &Target);
+    Imlib_Image Img = (Fits && !Streamed) ? loadImage(Local.Path, &Target) : NULL;
+    traceEnd();
+    if (!Streamed && !Img)
+    {
+        return 0;
+    }
+
+    DATA32 *Pixels = pixbufAlloc((size_t)Width * Height * sizeof *Pixels);
+    if (!Pixels)
+    {
+        (void)fprintf(stderr, "Out of memory for a %dx%d frame\n", Width, Height);
+    }
+    traceBegin("compose");
+    int Ok = Pixels && composeImage(&Local, Img, &Stream, Width, Height, Pixels);
+    traceEnd();
+    if (Ok)
+    {
+        traceBegin("write");
+        Ok = imageWrite(Path, Pixels, Width, Height);
+        traceEnd();
+    }
+    pixbufFree(Pixels);
+
+    if (Streamed)
+    {
+        closeStream(&Stream);
+    }
+    else
+    {
+        imlib_context_set_image(Img);
+        imlib_free_image();
+    }
+    return Ok;
+}
+
+// Animated wallpapers
+
+// Sequences whose composed frames fit in this many bytes are uploaded once
+// into server-side pixmaps and then cycled without decoding.
+#define ANIM_RESIDENT_BYTES (256u << 20)
+
+// Composed frames decoded ahead of presentation.
+#define ANIM_RING_FRAMES 3
+
+static volatile sig_atomic_t StopRequested = 0;
+
+static void onStopSignal(int Sig)
+{
+    (void)Sig;
+    StopRequested = 1;
+}
+
+// SIGINT and SIGTERM end the daemon and playback loops. No SA_RESTART, so
+// blocking waits return early.
+static void catchStopSignals(void)
+{
+    struct sigaction Act = {.sa_handler = onStopSignal};
+    sigemptyset(&Act.sa_mask);
+    sigaction(SIGINT, &Act, NULL);
+    sigaction(SIGTERM, &Act, NULL);
+}
+
+// AVIF image sequences and AV1 videos are played rather than shown.
+// Detecting either reads the file, so it is done once per image.
+typedef enum
+{
+    AK_Still,
+    AK_Sequence,
+    AK_Video
+} AnimationKind;
+
+static AnimationKind animationKind(const char *Path)
+{
+    const char *ext = strrchr(Path, '.');
+    if (videoIsAv1(Path))
+    {
+        return AK_Video;
+    }
+    if (ext && (strcasecmp(ext, ".avif") == 0 || strcasecmp(ext, ".avifs") == 0) && avifIsSequence(Path))
+    {
+        return AK_Sequence;
+    }
+    return AK_Still;
+}
+
+// Frames flowing from the decode thread to the presenting thread.
+typedef struct
+{
+    const WallpaperConfig *Cfg;
+    AvifSequence *Seq; // Exactly one of Seq and Video is set.
+    Av1Video *Video;
+    FrameRing Ring;
+    UploadBuffer Slots[ANIM_RING_FRAMES]; // Composed frames, shared with the server when local.
+    double Durations[ANIM_RING_FRAMES];
+    int ScrW;
+    int ScrH;
+    int Frames; // Frames to decode before closing the ring; 0 loops forever.
+} AnimPlayer;
+
+// Next frame from whichever source the player has.
+static int animNextFrame(AnimPlayer *Anim, AvifFrame *Frame)
+{
+    if (Anim->Seq)
+    {
+        if (!avifSequenceNext(Anim->Seq, Frame))
+        {
+            return 0;
+        }
+        // Like browsers, treat near-zero durations as unset instead of spinning.
+        Frame->duration = (Frame->duration > 0.01) ? Frame->duration : 0.1;
+        return 1;
+    }
+
+    VideoFrame Video;
+    if (!videoNext(Anim->Video, &Video))
+    {
+        return 0;
+    }
+    Frame->pixels = Video.pixels;
+    Frame->width = Video.width;
+    Frame->height = Video.height;
+    Frame->hasAlpha = 0;
+    Frame->duration = Video.duration;
+    return 1;
+}
+
+// Decode thread: decode, compose into the next free slot, repeat. Touches
+// no X or Imlib2 state.
+static void *animDecode(void *Arg)
+{
+    AnimPlayer *Anim = Arg;
+    AvifFrame Frame;
+
+    for (int done = 0; !Anim->Frames || done < Anim->Frames; ++done)
+    {
+        const int Slot = ringBeginWrite(&Anim->Ring);
+        if (Slot < 0 || !animNextFrame(Anim, &Frame) ||
+            !composePixels(Anim->Cfg, Frame.pixels, Frame.width, Frame.height, Frame.hasAlpha, Anim->ScrW,
+                           Anim->ScrH, (DATA32 *)Anim->Slots[Slot].Data))
+        {
+            break;
+        }
+        Anim->Durations[Slot] = Frame.duration;
+        ringEndWrite(&Anim->Ring);
+    }
+    ringClose(&Anim->Ring);
+    return NULL;
+}
+
+// True once another client has changed the wallpaper properties.
+static int wallpaperReplaced(const WallDisplay *Wd)
+{
+    XEvent Ev;
+    int Replaced = 0;
+    while (XCheckTypedWindowEvent(Wd->Dpy, Wd->Root, PropertyNotify, &Ev))
+    {
+        if (Ev.xproperty.atom == Wd->AtomRootPixmap || Ev.xproperty.atom == Wd->AtomState)
+        {
+            Replaced = 1;
+        }
+    }
+    return Replaced;
+}
+
+// Sleep until Deadline, then say whether the next frame may still be drawn:
+// no stop signal, and once shown, no other client has set a wallpaper that
+// drawing would now scribble over.
+static int animMayDraw(const WallDisplay *Wd, double Deadline, int Shown)
+{
+    sleepUntil(Deadline);
+    return !StopRequested && !(Shown && wallpaperReplaced(Wd));
+}
+
+// Presenting side of a player: the root pixmap and the frames kept on the
+// server.
+typedef struct
+{
+    Pixmap Pix;
+    Pixmap Back; // Off-screen target of streamed frames, or None.
+    GC GCtx;
+    int Created;    // Pix is new, as getOrCreateRootPixmap reports.
+    int Count;      // Frames of a resident sequence; 0 when streamed.
+    int Capacity;   // Ring slots.
+    Pixmap *Frames; // Resident frames uploaded so far, Loaded of them.
+    double *Timing; // Their durations.
+    int Loaded;
+} AnimScreen;
+
+// Allocate the ring slots and resident frames Scr needs, start the decode
+// thread and set up the root pixmap. Returns 0 on failure, with the thread
+// not started.
+static int animStart(WallDisplay *Wd, AnimPlayer *Anim, AnimScreen *Scr, pthread_t *Decoder)
+{
+    Display *Dpy = Wd->Dpy;
+    Visual *Vis = DefaultVisual(Dpy, Wd->Scr);
+
+    // Videos have no known frame count and are always streamed; the ring's
+    // slots then double as the shared-memory frame buffers being swapped.
+    const int Count = Anim->Seq ? avifSequenceCount(Anim->Seq) : 0;
+    const size_t FrameBytes = (size_t)Wd->Width * Wd->Height * 4;
+    Scr->Capacity = (Count && Count < ANIM_RING_FRAMES) ? Count : ANIM_RING_FRAMES;
+    Scr->Count = (Count && (size_t)Count <= ANIM_RESIDENT_BYTES / FrameBytes) ? Count : 0;
+    Scr->Frames = Scr->Count ? malloc((size_t)Scr->Count * sizeof *Scr->Frames) : NULL;
+    Scr->Timing = Scr->Count ? malloc((size_t)Scr->Count * sizeof *Scr->Timing) : NULL;
+    int Ok = !Scr->Count || (Scr->Frames && Scr->Timing);
+    for (int idx = 0; idx < Scr->Capacity && Ok; ++idx)
+    {
+        Ok = uploadCreate(&Anim->Slots[idx], Dpy, Vis, Wd->Depth, Wd->Width, Wd->Height);
+    }
+
+    // A resident sequence is decoded exactly once; otherwise decoding loops.
+    Anim->Frames = Scr->Count;
+    ringInit(&Anim->Ring, Scr->Capacity);
+    if (!Ok || pthread_create(Decoder, NULL, animDecode, Anim) != 0)
+    {
+        (void)fprintf(stderr, "Out of memory for animation %s\n", Anim->Cfg->Path);
+        return 0;
+    }
+
+    // Streamed frames are uploaded off-screen ahead of their deadline and
+    // shown in a single copy, so an upload is never seen half done.
+    Scr->Pix = getOrCreateRootPixmap(Wd, NULL, &Scr->Created);
+    Scr->Back = Scr->Count ? None : XCreatePixmap(Dpy, Wd->Root, Wd->Width, Wd->Height, Wd->Depth);
+    Scr->GCtx = XCreateGC(Dpy, Scr->Pix, 0, NULL);
+    return 1;
+}
+
+// Copy From onto the root pixmap.
+static void animShow(const WallDisplay *Wd, const AnimScreen *Scr, Pixmap From)
+{
+    XCopyArea(Wd->Dpy, From, Scr->Pix, Scr->GCtx, 0, 0, (unsigned int)Wd->Width, (unsigned int)Wd->Height, 0, 0);
+}
+
+// Show frames as they are due until a stop signal, the end of the
+// decoder's frames, or another client setting a wallpaper. Returns the
+// number of frames shown.
+static int animPresent(WallDisplay *Wd, AnimPlayer *Anim, AnimScreen *Scr)
+{
+    Display *Dpy = Wd->Dpy;
+    int Shown = 0;
+    double Deadline = 0.0;
+
+    while (!StopRequested)
+    {
+        double Duration;
+        if (Scr->Count && Scr->Loaded == Scr->Count)
+        {
+            // Steady state: a server-side copy per frame, no decode or upload.
+            const int Frame = Shown % Scr->Count;
+            Duration = Scr->Timing[Frame];
+            if (!animMayDraw(Wd, Deadline, Shown))
+            {
+                break;
+            }
+            animShow(Wd, Scr, Scr->Frames[Frame]);
+        }
+        else
+        {
+            const int Slot = ringBeginRead(&Anim->Ring, 100);
+            if (Slot == RING_TIMEOUT)
+            {
+                continue;
+            }
+            if (Slot == RING_DONE)
+            {
+                break;
+            }
+
+            // Resident frames are uploaded to their own pixmap for later.
+            UploadBuffer *Buf = &Anim->Slots[Slot];
+            Duration = Anim->Durations[Slot];
+            Pixmap Target = Scr->Back;
+            if (Scr->Count)
+            {
+                Target = Scr->Frames[Scr->Loaded] = XCreatePixmap(Dpy, Wd->Root, Wd->Width, Wd->Height, Wd->Depth);
+                Scr->Timing[Scr->Loaded++] = Duration;
+            }
+            uploadPut(Buf, Target, 0, 0);
+            const int Draw = animMayDraw(Wd, Deadline, Shown);
+            if (Draw)
+            {
+                animShow(Wd, Scr, Target);
+            }
+            uploadWait(Buf); // The server must be done with the slot before it is reused.
+            ringEndRead(&Anim->Ring);
+            if (!Draw)
+            {
+                break;
+            }
+        }
+
+        if (!Shown++)
+        {
+            // Watch for other setters only after our own property changes.
+            publishPixmap(Wd, Anim->Cfg, Scr->Pix, Scr->Created);
+            XSync(Dpy, False);
+            XSelectInput(Dpy, Wd->Root, PropertyChangeMask);
+            Deadline = monotonicNow();
+        }
+        else
+        {
+            XClearWindow(Dpy, Wd->Root);
+            XFlush(Dpy);
+        }
+
+        // Behind schedule (e.g. a slow decode): slip rather than burst.
+        const double Now = monotonicNow();
+        Deadline += Duration;
+        Deadline = (Deadline < Now) ? Now : Deadline;
+        if (wallpaperReplaced(Wd))
+        {
+            break;
+        }
+    }
+    return Shown;
+}
+
+// Play Cfg's image sequence or video, as Kind says it is, on the root
+// pixmap until a stop signal, a decode error, or another client setting a
+// wallpaper. Returns 0 if nothing could be shown.
+static int playAnimation(WallDisplay *Wd, const WallpaperConfig *Cfg, AnimationKind Kind)
+{
+    Display *Dpy = Wd->Dpy;
+    AnimPlayer Anim = {.Cfg = Cfg, .ScrW = Wd->Width, .ScrH = Wd->Height};
+    AnimScreen Scr = {.Pix = None, .Back = None};
+    pthread_t Decoder;
+    int Shown = 0;
+
+    if (!Wd->Native)
+    {
+        return 0;
+    }
+    if (Kind == AK_Video ? !(Anim.Video = videoOpen(Cfg->Path)) : !(Anim.Seq = avifSequenceOpen(Cfg->Path)))
+    {
+        return 0;
+    }
+
+    const int Started = animStart(Wd, &Anim, &Scr, &Decoder);
+    if (Started)
+    {
+        Shown = animPresent(Wd, &Anim, &Scr);
+    }
+
+    ringCancel(&Anim.Ring);
+    if (Started)
+    {
+        pthread_join(Decoder, NULL);
+        XFreeGC(Dpy, Scr.GCtx);
+    }
+    if (Scr.Back != None)
+    {
+        XFreePixmap(Dpy, Scr.Back);
+    }
+    ringDestroy(&Anim.Ring);
+    for (int idx = 0; idx < Scr.Loaded; ++idx)
+    {
+        XFreePixmap(Dpy, Scr.Frames[idx]);
+    }
+    for (int idx = 0; idx < Scr.Capacity; ++idx)
+    {
+        uploadDestroy(&Anim.Slots[idx]);
+    }
+    free(Scr.Frames);
+    free(Scr.Timing);
+    avifSequenceClose(Anim.Seq);
+    videoClose(Anim.Video);
+    return Shown > 0;
+}
+
+// Play Cfg's animation in the foreground, or show it as a still when that
+// isn't possible on this display.
+static void playWallpaper(const WallpaperConfig *Cfg, AnimationKind Kind)
+{
+    WallDisplay Wd;
+    if (!openDisplay(&Wd))
+    {
+        die("XOpenDisplay");
+    }
+
+    catchStopSignals();
+    int Played = playAnimation(&Wd, Cfg, Kind);
+    closeDisplay(&Wd);
+    if (!Played && !StopRequested)
+    {
+        setWallpaper(Cfg);
+    }
+}
+
+// Slideshow
+
+// File types picked up from a slideshow directory.
+static const char *const SlideExts[] = {".avif", ".bmp",  ".gif", ".jpeg", ".jpg", ".jxl",
+                                        ".png",  ".ppm",  ".tga", ".tif",  ".tiff", ".webp"};
+
+// One shuffled pass over a directory's images.
+typedef struct
+{
+    char **Paths;
+    int Count;
+    int Next; // Index of the next slide in this pass.
+    unsigned int Seed;
+} SlideList;
+
+static int isSlideImage(const char *Name)
+{
+    const char *ext = strrchr(Name, '.');
+    for (size_t idx = 0; ext && idx < sizeof SlideExts / sizeof *SlideExts; ++idx)
+    {
+        if (strcasecmp(ext, SlideExts[idx]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void freeSlides(SlideList *List)
+{
+    for (int idx = 0; idx < List->Count; ++idx)
+    {
+        free(List->Paths[idx]);
+    }
+    free(List->Paths);
+    List->Paths = NULL;
+    List->Count = 0;
+}
+
+// Replace List's paths with the images currently in Dir.
+static void scanSlides(SlideList *List, const char *Dir)
+{
+    freeSlides(List);
+    DIR *Handle = opendir(Dir);
+    if (!Handle)
+    {
+        perror(Dir);
+        return;
+    }
+
+    int Capacity = 0;
+    struct dirent *Ent;
+    while ((Ent = readdir(Handle)))
+    {
+        char Path[PATH_MAX];
+        struct stat St;
+        if (Ent->d_name[0] == '.' || !isSlideImage(Ent->d_name) ||
+            snprintf(Path, sizeof Path, "%s/%s", Dir, Ent->d_name) >= (int)sizeof Path || stat(Path, &St) != 0 ||
+            !S_ISREG(St.st_mode))
+        {
+            continue;
+        }
+        if (List->Count == Capacity)
+        {
+            Capacity = Capacity ? Capacity * 2 : 64;
+            char **Grown = realloc(List->Paths, (size_t)Capacity * sizeof *Grown);
+            if (!Grown)
+            {
+                break;
+            }
+            List->Paths = Grown;
+        }
+        const size_t Len = strlen(Path) + 1;
+        if (!(List->Paths[List->Count] = malloc(Len)))
+        {
+            break;
+        }
+        memcpy(List->Paths[List->Count++], Path, Len);
+    }
+    closedir(Handle);
+}
+
+// Next slide path, rescanning and reshuffling Dir after every full pass so
+// added and removed files are picked up. Returns NULL if Dir has no images.
+static const char *nextSlide(SlideList *List, const char *Dir)
+{
+    if (List->Next < List->Count)
+    {
+        return List->Paths[List->Next++];
+    }
+
+    // Remember the slide just shown so a pass never starts with it.
+    char Last[PATH_MAX] = "";
+    if (List->Count)
+    {
+        strCopy(Last, sizeof Last, List->Paths[List->Count - 1], strlen(List->Paths[List->Count - 1]));
+    }
+    scanSlides(List, Dir);
+    List->Next = 0;
+    if (!List->Count)
+    {
+        return NULL;
+    }
+
+    for (int idx = List->Count - 1; idx > 0; --idx)
+    {
+        const int Pick = rand_r(&List->Seed) % (idx + 1);
+        char *Swap = List->Paths[idx];
+        List->Paths[idx] = List->Paths[Pick];
+        List->Paths[Pick] = Swap;
+    }
+    if (List->Count > 1 && strcmp(List->Paths[0], Last) == 0)
+    {
+        const int Pick = 1 + (rand_r(&List->Seed) % (List->Count - 1));
+        char *Swap = List->Paths[0];
+        List->Paths[0] = List->Paths[Pick];
+        List->Paths[Pick] = Swap;
+    }
+    return List->Paths[List->Next++];
+}
+
+// The next slide, prepared by the prefetch thread. The ring holds one slot,
+// so the thread decodes while the current slide is up and Imlib2 is only
+// ever used by one thread at a time: the prefetcher between ringBeginWrite
+// and ringEndWrite, the presenter between ringBeginRead and ringEndRead.
+typedef struct
+{
+    WallpaperConfig Cfg; // Path is the slide in the slot.
+    SlideList List;
+    FrameRing Ring;
+    UploadBuffer Slot; // Native visuals: composed straight into the upload buffer.
+    DATA32 *Pixels;    // Composed slide; Slot.Data on native visuals.
+    int ScrW;
+    int ScrH;
+} SlidePlayer;
+
+// Prefetch thread: decode and compose the next slide, skipping files that
+// fail to load. Gives up when a whole pass has nothing loadable.
+static void *slideDecode(void *Arg)
+{
+    SlidePlayer *Slide = Arg;
+
+    while (ringBeginWrite(&Slide->Ring) >= 0)
+    {
+        int Ok = 0;
+        for (int Tries = 0; !Ok && !StopRequested; ++Tries)
+        {
+            const char *Path = nextSlide(&Slide->List, Slide->Cfg.SlideDir);
+            if (!Path || Tries >= Slide->List.Count)
+            {
+                break;
+            }
+            strCopy(Slide->Cfg.Path, sizeof Slide->Cfg.Path, Path, strlen(Path));
+
+            // Over-budget slides are skipped like unreadable ones.
+            DecodeTarget Target = {.Cfg = &Slide->Cfg, .ScrW = Slide->ScrW, .ScrH = Slide->ScrH};
+            const size_t FrameBytes = (size_t)Slide->ScrW * Slide->ScrH * sizeof(DATA32) * (Slide->Slot.Data ? 1 : 2);
+            ImageStream Stream;
+            if (!planDecode(&Slide->Cfg, &Target, FrameBytes))
+            {
+                continue;
+            }
+            if (openStream(&Stream, &Target))
+            {
+                Ok = composeImage(&Slide->Cfg, NULL, &Stream, Slide->ScrW, Slide->ScrH, Slide->Pixels);
+                closeStream(&Stream);
+                continue;
+            }
+            Imlib_Image Img = loadImage(Path, &Target);
+            if (Img)
+            {
+                Ok = composeFrame(&Slide->Cfg, Img, Slide->ScrW, Slide->ScrH, Slide->Pixels);
+                imlib_context_set_image(Img);
+                imlib_free_image();
+            }
+        }
+        if (!Ok)
+        {
+            break;
+        }
+        ringEndWrite(&Slide->Ring);
+    }
+    ringClose(&Slide->Ring);
+    return NULL;
+}
+
+// Allocate the slide buffer and start the prefetch thread. Returns 0 on
+// failure, with the thread not started.
+static int slideStart(WallDisplay *Wd, SlidePlayer *Slide, pthread_t *Prefetcher)
+{
+    Display *Dpy = Wd->Dpy;
+    int Ok = 1;
+    if (Wd->Native)
+    {
+        Ok = uploadCreate(&Slide->Slot, Dpy, DefaultVisual(Dpy, Wd->Scr), Wd->Depth, Wd->Width, Wd->Height);
+        Slide->Pixels = Ok ? (DATA32 *)Slide->Slot.Data : NULL;
+    }
+    else
+    {
+        Ok = (Slide->Pixels = pixbufAlloc((size_t)Wd->Width * Wd->Height * sizeof *Slide->Pixels)) != NULL;
+    }
+
+    // Stop signals must interrupt the presenter's long sleeps, so the
+    // prefetch thread never takes them.
+    sigset_t Block;
+    sigset_t Saved;
+    sigemptyset(&Block);
+    sigaddset(&Block, SIGINT);
+    sigaddset(&Block, SIGTERM);
+    ringInit(&Slide->Ring, 1);
+    pthread_sigmask(SIG_BLOCK, &Block, &Saved);
+    if (Ok && pthread_create(Prefetcher, NULL, slideDecode, Slide) != 0)
+    {
+        Ok = 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &Saved, NULL);
+    if (!Ok)
+    {
+        (void)fprintf(stderr, "Out of memory for %dx%d slideshow\n", Wd->Width, Wd->Height);
+    }
+    return Ok;
+}
+
+// Show Cfg's slideshow until a stop signal or another client setting a
+// wallpaper. Each switch only uploads the already composed next slide.
+// Returns 0 if no slide could be shown.
+static int playSlideshow(WallDisplay *Wd, const WallpaperConfig *Cfg)
+{
+    Display *Dpy = Wd->Dpy;
+    SlidePlayer Slide = {.Cfg = *Cfg, .ScrW = Wd->Width, .ScrH = Wd->Height};
+    Slide.List.Seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+
+    pthread_t Prefetcher;
+    const int Ok = slideStart(Wd, &Slide, &Prefetcher);
+    int Shown = 0;
+    double Deadline = 0.0;
+    while (Ok && !StopRequested)
+    {
+        const int Ready = ringBeginRead(&Slide.Ring, 100);
+        if (Ready == RING_TIMEOUT)
+        {
+            continue;
+        }
+        if (Ready == RING_DONE)
+        {
+            break;
+        }
+
+        sleepUntil(Deadline);
+        if (StopRequested || (Shown && wallpaperReplaced(Wd)))
+        {
+            ringEndRead(&Slide.Ring);
+            break;
+        }
+
+        int created = 0;
+        Pixmap Pix = getOrCreateRootPixmap(Wd, NULL, &created);
+        if (Wd->Native)
+        {
+            presentFrame(Wd, &Slide.Cfg, &Slide.Slot, Pix, created);
+            uploadWait(&Slide.Slot); // The prefetcher reuses the slot next.
+        }
+        else if (!renderComposed(Wd, Pix, Slide.Pixels))
+        {
+            ringEndRead(&Slide.Ring);
+            break;
+        }
+        publishPixmap(Wd, &Slide.Cfg, Pix, created);
+
+        if (!Shown++)
+        {
+            // Save what a plain restore would show, with the slideshow kept.
+            saveConfig(&Slide.Cfg);
+            XSelectInput(Dpy, Wd->Root, PropertyChangeMask);
+        }
+        // Drop the notifications for our own property changes.
+        XSync(Dpy, False);
+        (void)wallpaperReplaced(Wd);
+
+        ringEndRead(&Slide.Ring);
+        Deadline = monotonicNow() + Cfg->SlideInterval;
+
+        // Like the daemon between requests: a slide stays up far too long
+        // to sit on freed buffers in case the next one fits them.
+        pixbufTrim();
+    }
+
+    ringCancel(&Slide.Ring);
+    if (Ok)
+    {
+        pthread_join(Prefetcher, NULL);
+    }
+    ringDestroy(&Slide.Ring);
+    if (Wd->Native)
+    {
+        uploadDestroy(&Slide.Slot);
+    }
+    else
+    {
+        pixbufFree(Slide.Pixels);
+    }
+    freeSlides(&Slide.List);
+    if (!Shown && !StopRequested)
+    {
+        (void)fprintf(stderr, "No usable images in %s\n", Cfg->SlideDir);
+    }
+    return Shown > 0;
+}
+
+// Run Cfg's slideshow in the foreground.
+static int runSlideshow(const WallpaperConfig *Cfg)
+{
+    WallDisplay Wd;
+    if (!openDisplay(&Wd))
+    {
+        die("XOpenDisplay");
+    }
+
+    catchStopSignals();
+    int Shown = playSlideshow(&Wd, Cfg);
+    closeDisplay(&Wd);
+    return Shown ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Library precompute
+
+// One precompute run over a directory's images.
+typedef struct
+{
+    WallpaperConfig Cfg; // Template; every worker sets its own Path.
+    SlideList List;
+    FrameFormat Fmt;
+    pthread_mutex_t ImlibLock; // Imlib2 keeps global state.
+    pthread_mutex_t BudgetLock;
+    pthread_cond_t BudgetFreed;
+    size_t DecodeBudget; // What the workers' frames leave of PRECOMPUTE_BUDGET.
+    size_t Reserved;     // Priced decodes in flight.
+    int Next;            // Next unclaimed image, taken atomically.
+    int Stored;
+    int Present;
+    int Failed;
+} Precompute;
+
+// Decode and compose Cfg's image into Pixels on the calling thread. JPEG,
+// PNG and AVIF decode without Imlib2, so only other formats serialise.
+static int precomputeCompose(Precompute *Pre, const WallpaperConfig *Cfg, DATA32 *Pixels)
+{
+    const int ScrW = (int)Pre->Fmt.Width;
+    const int ScrH = (int)Pre->Fmt.Height;
+    const char *ext = strrchr(Cfg->Path, '.');
+    DecodeTarget Target = {.Cfg = Cfg, .ScrW = ScrW, .ScrH = ScrH};
+    ImageStream Stream = {0};
+    int ImgH;
+    int Ok = 0;
+
+    if (ext && strcasecmp(ext, ".avif") == 0)
+    {
+        SourceRows Src = {0};
+        DATA32 *Data = loadAvifPixels(Cfg->Path, decodeNeed, &Target, &Src.Width, &ImgH, &Src.HasAlpha);
+        Src.Data = Data;
+        Ok = Data && composeSerial(Cfg, Src, ImgH, ScrW, ScrH, Pixels);
+        pixbufFree(Data);
+        return Ok;
+    }
+    if (ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0))
+    {
+        Stream.Jpeg = jpegStreamOpen(Cfg->Path, decodeNeed, &Target, &Stream.Width, &Stream.Height);
+    }
+    else if (ext && strcasecmp(ext, ".png") == 0)
+    {
+        Stream.Png = pngStreamOpen(Cfg->Path, &Stream.Width, &Stream.Height, &Stream.HasAlpha);
+    }
+    if (Stream.Jpeg || Stream.Png)
+    {
+        Ok = composeSerial(Cfg, imageRows(NULL, &Stream, &ImgH), ImgH, ScrW, ScrH, Pixels);
+        closeStream(&Stream);
+        return Ok;
+    }
+
+    pthread_mutex_lock(&Pre->ImlibLock);
+    Imlib_Image Img = loadImage(Cfg->Path, &Target);
+    if (Img)
+    {
+        Ok = composeSerial(Cfg, imageRows(Img, NULL, &ImgH), ImgH, ScrW, ScrH, Pixels);
+        imlib_context_set_image(Img);
+        imlib_free_image();
+    }
+    pthread_mutex_unlock(&Pre->ImlibLock);
+    return Ok;
+}
+
+// Estimated bytes of decoding Cfg's image the way precomputeCompose does;
+// 0 if the header can't be read, which the decode then reports.
+static size_t precomputePrice(Precompute *Pre, WallpaperConfig *Cfg)
+{
+    DecodeTarget Target = {.Cfg = Cfg, .ScrW = (int)Pre->Fmt.Width, .ScrH = (int)Pre->Fmt.Height, .ForceStream = 1};
+    const char *ext = strrchr(Cfg->Path, '.');
+    const int Native = ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0 ||
+                               strcasecmp(ext, ".png") == 0 || strcasecmp(ext, ".avif") == 0);
+    size_t Bytes;
+
+    // Only the Imlib2 fallback needs the lock.
+    if (!Native)
+    {
+        pthread_mutex_lock(&Pre->ImlibLock);
+    }
+    const int Priced = priceDecode(&Target, &Bytes);
+    if (!Native)
+    {
+        pthread_mutex_unlock(&Pre->ImlibLock);
+    }
+    return Priced ? Bytes : 0;
+}
+
+// Hold Bytes of the decode budget until precomputeRelease, waiting while
+// other workers' decodes leave too little. One larger than the whole
+// budget waits until it can run alone.
+static void precomputeReserve(Precompute *Pre, size_t Bytes)
+{
+    pthread_mutex_lock(&Pre->BudgetLock);
+    while (Pre->Reserved && Pre->Reserved + Bytes > Pre->DecodeBudget)
+    {
+        pthread_cond_wait(&Pre->BudgetFreed, &Pre->BudgetLock);
+    }
+    Pre->Reserved += Bytes;
+    pthread_mutex_unlock(&Pre->BudgetLock);
+}
+
+static void precomputeRelease(Precompute *Pre, size_t Bytes)
+{
+    pthread_mutex_lock(&Pre->BudgetLock);
+    Pre->Reserved -= Bytes;
+    pthread_cond_broadcast(&Pre->BudgetFreed);
+    pthread_mutex_unlock(&Pre->BudgetLock);
+}
+
+// Pool task: claim images until none are left. Every worker keeps one
+// frame for all of its images, which bounds the memory in flight.
+static void precomputeWorker(void *User, int Index)
+{
+    Precompute *Pre = User;
+    WallpaperConfig Cfg = Pre->Cfg;
+    char Key[PATH_MAX + 256];
+    DATA32 *Pixels = NULL;
+    (void)Index;
+
+    for (;;)
+    {
+        const int Item = __atomic_fetch_add(&Pre->Next, 1, __ATOMIC_RELAXED);
+        if (Item >= Pre->List.Count)
+        {
+            break;
+        }
+
+        // Keyed by the path a later `wall IMAGE` resolves; animations are
+        // played, never restored from the cache.
+        CachedFrame Frame;
+        if (!realpath(Pre->List.Paths[Item], Cfg.Path) || animationKind(Cfg.Path) != AK_Still ||
+            !frameKey(Key, sizeof Key, &Cfg, &Pre->Fmt))
+        {
+            continue;
+        }
+        if (frameCacheOpen(Key, &Pre->Fmt, &Frame))
+        {
+            frameCacheClose(&Frame);
+            __atomic_fetch_add(&Pre->Present, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (!Pixels)
+        {
+            Pixels = pixbufAlloc((size_t)Pre->Fmt.Stride * Pre->Fmt.Height);
+        }
+        const size_t Price = precomputePrice(Pre, &Cfg);
+        precomputeReserve(Pre, Price);
+        const int Composed = Pixels && precomputeCompose(Pre, &Cfg, Pixels);
+        precomputeRelease(Pre, Price);
+        if (Composed && frameCacheStore(Key, &Pre->Fmt, Pixels))
+        {
+            __atomic_fetch_add(&Pre->Stored, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            (void)fprintf(stderr, "Cannot precompute: %s\n", Cfg.Path);
+            __atomic_fetch_add(&Pre->Failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pixbufFree(Pixels);
+}
+
+// Render every image in Dir, as Cfg places it on a Width x Height screen,
+// into the frame cache so switching to it later skips the decode. Frames
+// are stored in the 24-bit TrueColor layout wall composes natively, the
+// only one the cache serves. Needs no X connection. Returns 0 if any image
+// failed.
+static int precomputeLibrary(const WallpaperConfig *Cfg, const char *Dir, int Width, int Height)
+{
+    Precompute Pre = {.Cfg = *Cfg};
+    Pre.Fmt = (FrameFormat){.Width = (uint32_t)Width,
+                            .Height = (uint32_t)Height,
+                            .Stride = (uint32_t)Width * 4,
+                            .Depth = 24,
+                            .BitsPerPixel = 32,
+                            .ByteOrder = (uint32_t)hostByteOrder(),
+                            .RedMask = 0xff0000,
+                            .GreenMask = 0xff00,
+                            .BlueMask = 0xff};
+
+    scanSlides(&Pre.List, Dir);
+    if (Pre.List.Count == 0)
+    {
+        (void)fprintf(stderr, "No images in %s\n", Dir);
+        return 0;
+    }
+
+    // One image per core, fewer so that the frames leave at least half the
+    // budget to decode in. Each decode is priced before it starts and waits
+    // for room, so a huge image holds the others back instead of overrunning.
+    const long Online = sysconf(_SC_NPROCESSORS_ONLN);
+    const size_t FrameBytes = (size_t)Pre.Fmt.Stride * Pre.Fmt.Height;
+    size_t Workers = PRECOMPUTE_BUDGET / (FrameBytes * 2);
+    Workers = (Online > 0 && Workers > (size_t)Online) ? (size_t)Online : Workers;
+    Workers = (Workers > (size_t)Pre.List.Count) ? (size_t)Pre.List.Count : Workers;
+    Workers = Workers ? Workers : 1;
+    Pre.DecodeBudget = (Workers * FrameBytes < PRECOMPUTE_BUDGET) ? PRECOMPUTE_BUDGET - (Workers * FrameBytes) : 0;
+
+    WorkPool *Pool = poolCreate((int)Workers);
+    if (!Pool)
+    {
+        (void)fprintf(stderr, "Cannot start %zu workers\n", Workers);
+        freeSlides(&Pre.List);
+        return 0;
+    }
+    pthread_mutex_init(&Pre.ImlibLock, NULL);
+    pthread_mutex_init(&Pre.BudgetLock, NULL);
+    pthread_cond_init(&Pre.BudgetFreed, NULL);
+    traceBegin("precompute");
+    poolRun(Pool, precomputeWorker, &Pre, poolThreads(Pool));
+    traceEnd();
+    poolDestroy(Pool);
+    pthread_cond_destroy(&Pre.BudgetFreed);
+    pthread_mutex_destroy(&Pre.BudgetLock);
+    pthread_mutex_destroy(&Pre.ImlibLock);
+
+    (void)printf("%d stored, %d already cached, %d failed\n", Pre.Stored, Pre.Present, Pre.Failed);
+    freeSlides(&Pre.List);
+    return Pre.Failed == 0;
+}
+
+// Daemon mode
+
+// True if Slot's decode is large enough for Target; reduced JPEG decodes
+// only serve requests that draw them at most as large as the first one.
+static int slotCovers(const CachedImage *Slot, DecodeTarget *Target)
+{
+    int NeedW;
+    int NeedH;
+    imlib_context_set_image(Slot->Img);
+    const int ImgW = imlib_image_get_width();
+    const int ImgH = imlib_image_get_height();
+    if (ImgW == Slot->SrcW && ImgH == Slot->SrcH)
+    {
+        return 1;
+    }
+    decodeNeed(Target, Slot->SrcW, Slot->SrcH, &NeedW, &NeedH);
+    return ImgW >= NeedW && ImgH >= NeedH;
+}
+
+// Return the resident decode of Target's image, loading it into the least
+// recently used slot if the file changed, was never seen, or was decoded
+// too small for this request.
+static Imlib_Image cachedImage(CachedImage *Slots, DecodeTarget *Target)
+{
+    static unsigned long Clock = 0;
+    const char *Path = Target->Cfg->Path;
+    struct stat St;
+    if (stat(Path, &St) != 0)
+    {
+        (void)fprintf(stderr, "Cannot stat: %s\n", Path);
+        return NULL;
+    }
+
+    CachedImage *Victim = &Slots[0];
+    for (size_t idx = 0; idx < DAEMON_CACHE_SLOTS; ++idx)
+    {
+        CachedImage *Slot = &Slots[idx];
+        if (Slot->Img && strcmp(Slot->Path, Path) == 0 && Slot->Size == St.st_size &&
+            Slot->MTime.tv_sec == St.st_mtim.tv_sec && Slot->MTime.tv_nsec == St.st_mtim.tv_nsec)
+        {
+            if (!slotCovers(Slot, Target))
+            {
+                Victim = Slot;
+                break;
+            }
+            Slot->LastUse = ++Clock;
+            return Slot->Img;
+        }
+        if (!Slot->Img || (Victim->Img && Slot->LastUse < Victim->LastUse))
+        {
+            Victim = Slot;
+        }
+    }
+
+    Imlib_Image Img = loadImage(Path, Target);
+    if (!Img)
+    {
+        return NULL;
+    }
+
+    if (Victim->Img)
+    {
+        imlib_context_set_image(Victim->Img);
+        imlib_free_image_and_decache();
+    }
+    strCopy(Victim->Path, sizeof Victim->Path, Path, strlen(Path));
+    Victim->MTime = St.st_mtim;
+    Victim->Size = St.st_size;
+    Victim->LastUse = ++Clock;
+    Victim->SrcW = Target->SrcW;
+    Victim->SrcH = Target->SrcH;
+    Victim->Img = Img;
+    return Img;
+}
+
+// Serialise a config as the tab-separated fields used on the socket.
+static int formatConfigFields(char *Buffer, size_t Size, const WallpaperConfig *Cfg)
+{
+    int Len = snprintf(Buffer, Size, "%s\t%s\t%d\t%d\t%s\t%d\t%s\t%d\t%d", Cfg->Path, ModeLUT[Cfg->Mode].Name,
+                       Cfg->OffsetX, Cfg->OffsetY, Cfg->BgColor, Cfg->ServerScale, FilterLUT[Cfg->Filter].Name,
+                       Cfg->Fade, Cfg->Linear);
+    return Len > 0 && (size_t)Len < Size;
+}
+
+// Strict decimal integer parse. Returns 0 if Str has trailing garbage.
+static int parseIntField(const char *Str, int *Out)
+{
+    char *End;
+    *Out = (int)strtol(Str, &End, 10);
+    return *Str != '\0' && *End == '\0';
+}
+
+// Parse the fields written by formatConfigFields. Returns 0 if malformed.
+static int parseConfigFields(char *Fields, WallpaperConfig *Cfg)
+{
+    char *Parts[CONFIG_FIELDS];
+    int red;
+    int grn;
+    int blu;
+
+    for (size_t idx = 0; idx < CONFIG_FIELDS; ++idx)
+    {
+        Parts[idx] = strsep(&Fields, "\t");
+        if (!Parts[idx])
+        {
+            return 0;
+        }
+    }
+
+    if (Fields || Parts[0][0] != '/' || strlen(Parts[0]) >= sizeof Cfg->Path || !findMode(Parts[1], &Cfg->Mode) ||
+        !parseColor(Parts[4], &red, &grn, &blu) || !findFilter(Parts[6], &Cfg->Filter))
+    {
+        return 0;
+    }
+    strCopy(Cfg->Path, sizeof Cfg->Path, Parts[0], strlen(Parts[0]));
+    strCopy(Cfg->BgColor, sizeof Cfg->BgColor, Parts[4], strlen(Parts[4]));
+
+    return parseIntField(Parts[2], &Cfg->OffsetX) && parseIntField(Parts[3], &Cfg->OffsetY) &&
+           parseIntField(Parts[5], &Cfg->ServerScale) && Cfg->ServerScale >= 0 &&
+           Cfg->ServerScale <= SERVER_SCALE_MAX && parseIntField(Parts[7], &Cfg->Fade) && Cfg->Fade >= 0 &&
+           Cfg->Fade <= FADE_MAX_MS && parseIntField(Parts[8], &Cfg->Linear) && (Cfg->Linear == 0 || Cfg->Linear == 1);
+}
+
+// Handle one request line, writing the reply line into Reply.
+static void handleRequest(WallDisplay *Wd, CachedImage *Slots, WallpaperConfig *Current, int *HaveCurrent,
+                          char *Line, char *Reply, size_t ReplySize)
+{
+    WallpaperConfig Cfg = {.Mode = WM_Fill, .Filter = SF_Bilinear};
+    char Fields[IPC_LINE_MAX];
+    char *Args = strchr(Line, '\t');
+    if (Args)
+    {
+        *Args++ = 0;
+    }
 
-    case WM_Scale:
-        imlib_render_image_on_drawable_at_size(0, 0, ScrW, ScrH);
-        break;
+    if (strcmp(Line, "query") == 0)
+    {
+        if (!*HaveCurrent && !loadConfig(Current))
+        {
+            (void)snprintf(Reply, ReplySize, "err No stored configuration");
+            return;
+        }
+        *HaveCurrent = 1;
+        (void)formatConfigFields(Fields, sizeof Fields, Current);
+        (void)snprintf(Reply, ReplySize, "ok\t%s", Fields);
+        return;
+    }
 
-    case WM_Tile: {
-        Pixmap tile = XCreatePixmap(Dpy, Pix, ImgW, ImgH, DefaultDepth(Dpy, Scr));
+    if (strcmp(Line, "restore") == 0)
+    {
+        if (!loadConfig(&Cfg))
+        {
+            (void)snprintf(Reply, ReplySize, "err No stored configuration");
+            return;
+        }
+    }
+    else if (strcmp(Line, "set") != 0 || !Args || !parseConfigFields(Args, &Cfg))
+    {
+        (void)snprintf(Reply, ReplySize, "err Malformed request");
+        return;
+    }
 
-        imlib_context_set_drawable(tile);
-        imlib_render_image_on_drawable(0, 0);
+    // The screen size and properties go stale on a long-lived connection.
+    fetchRootState(Wd);
+    DecodeTarget Target = {.Cfg = &Cfg, .ScrW = Wd->Width, .ScrH = Wd->Height};
+    Imlib_Image Img = NULL;
+    if (!isAlreadyShown(Wd, &Cfg) && !restoreCachedFrame(Wd, &Cfg) && !(Img = cachedImage(Slots, &Target)))
+    {
+        (void)snprintf(Reply, ReplySize, "err Cannot load: %s", Cfg.Path);
+        return;
+    }
+    if (Img && !applyWallpaper(Wd, &Cfg, Img, NULL))
+    {
+        (void)snprintf(Reply, ReplySize, "err Cannot render: %s", Cfg.Path);
+        return;
+    }
 
-        imlib_context_set_drawable(Pix);
+    saveConfig(&Cfg);
+    *Current = Cfg;
+    *HaveCurrent = 1;
+    (void)snprintf(Reply, ReplySize, "ok");
+}
 
-        GC gctx = XCreateGC(Dpy, Pix, 0, NULL);
-        XSetTile(Dpy, gctx, tile);
-        XSetFillStyle(Dpy, gctx, FillTiled);
-        XSetTSOrigin(Dpy, gctx, 0, 0);
+// Socket the daemon removes if the X server goes away.
+static char DaemonSockPath[PATH_MAX];
 
-        XFillRectangle(Dpy, Pix, gctx, 0, 0, ScrW, ScrH);
+// Another setter may free the root pixmap between our reads of it, so a
+// stale _XROOTPMAP_ID is expected; report errors and keep serving.
+static int daemonXError(Display *Dpy, XErrorEvent *Event)
+{
+    char Text[128];
+    XGetErrorText(Dpy, Event->error_code, Text, sizeof Text);
+    (void)fprintf(stderr, "X error: %s (request %d)\n", Text, Event->request_code);
+    return 0;
+}
 
-        XFreeGC(Dpy, gctx);
-        XFreePixmap(Dpy, tile);
-        break;
-    }
+// Xlib exits once this returns, so leave no socket behind.
+static int daemonXIOError(Display *Dpy)
+{
+    (void)Dpy;
+    (void)fprintf(stderr, "Lost the X connection\n");
+    (void)unlink(DaemonSockPath);
+    _exit(EXIT_FAILURE);
+}
 
-    default:
-        (void)fprintf(stderr, "unhandled mode\n");
-        abort();
+// Serve set/restore/query requests until SIGINT or SIGTERM.
+static int runDaemon(void)
+{
+    char *SockPath = DaemonSockPath;
+    if (!ipcSocketPath(SockPath, sizeof DaemonSockPath))
+    {
+        (void)fprintf(stderr, "Socket path too long\n");
+        return EXIT_FAILURE;
     }
 
-    static Atom AtomRoot = None;
-    static Atom AtomSetroot = None;
+    WallDisplay Wd;
+    if (!openDisplay(&Wd))
+    {
+        die("XOpenDisplay");
+    }
 
-    if (AtomRoot == None)
+    int Listener = ipcListen(SockPath);
+    if (Listener < 0)
     {
-        AtomRoot = XInternAtom(Dpy, "_XROOTPMAP_ID", False);
-        AtomSetroot = XInternAtom(Dpy, "_XSETROOT_ID", False);
+        if (errno == EADDRINUSE)
+        {
+            (void)fprintf(stderr, "A daemon is already listening on %s\n", SockPath);
+            closeDisplay(&Wd);
+            return EXIT_FAILURE;
+        }
+        die("listen");
     }
 
-    XChangeProperty(Dpy, Root, AtomRoot, XA_PIXMAP, 32, PropModeReplace, (unsigned char *)&Pix, 1);
-    XChangeProperty(Dpy, Root, AtomSetroot, XA_PIXMAP, 32, PropModeReplace, (unsigned char *)&Pix, 1);
+    catchStopSignals();
+    signal(SIGPIPE, SIG_IGN);
+    XSetErrorHandler(daemonXError);
+    XSetIOErrorHandler(daemonXIOError);
 
-    XSetWindowBackgroundPixmap(Dpy, Root, Pix);
-    XClearWindow(Dpy, Root);
-    XFlush(Dpy);
+    // Imlib2's own cache would only duplicate the resident slots.
+    imlib_set_cache_size(0);
 
-    if (created)
+    CachedImage Slots[DAEMON_CACHE_SLOTS] = {0};
+    WallpaperConfig Current;
+    int HaveCurrent = 0;
+    char Line[IPC_LINE_MAX];
+    char Reply[IPC_LINE_MAX];
+
+    while (!StopRequested)
     {
-        XSetCloseDownMode(Dpy, RetainPermanent);
+        int Conn = accept(Listener, NULL, NULL);
+        if (Conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        // A client that connects and goes quiet, or trickles its request,
+        // must not stall the daemon; the request and the reply each get
+        // one deadline.
+        if (ipcReadLine(Conn, Line, sizeof Line, ipcDeadline(DAEMON_IO_TIMEOUT_MS), &StopRequested))
+        {
+            handleRequest(&Wd, Slots, &Current, &HaveCurrent, Line, Reply, sizeof Reply - 1);
+            strcat(Reply, "\n");
+            (void)ipcWriteAll(Conn, Reply, strlen(Reply), ipcDeadline(DAEMON_IO_TIMEOUT_MS));
+        }
+        close(Conn);
+
+        // Buffers freed by the request would otherwise stay mapped while idle.
+        pixbufTrim();
     }
 
-    imlib_context_set_image(Img);
-    imlib_free_image();
+    close(Listener);
+    (void)unlink(SockPath);
+    for (size_t idx = 0; idx < DAEMON_CACHE_SLOTS; ++idx)
+    {
+        if (Slots[idx].Img)
+        {
+            imlib_context_set_image(Slots[idx].Img);
+            imlib_free_image_and_decache();
+        }
+    }
+    closeDisplay(&Wd);
+    return EXIT_SUCCESS;
+}
 
-    XCloseDisplay(Dpy);
+// Forward a request to a running daemon. Returns -1 if no daemon is
+// listening, otherwise 1 on success and 0 on a reported failure.
+static int sendToDaemon(const char *Request, char *Reply, size_t ReplySize)
+{
+    char SockPath[PATH_MAX];
+    if (!ipcSocketPath(SockPath, sizeof SockPath))
+    {
+        return -1;
+    }
+
+    int Fd = ipcConnect(SockPath);
+    if (Fd < 0)
+    {
+        return -1;
+    }
+
+    int Ok = ipcWriteAll(Fd, Request, strlen(Request), -1) && ipcReadLine(Fd, Reply, ReplySize, -1, NULL);
+    close(Fd);
+    if (!Ok)
+    {
+        (void)fprintf(stderr, "Daemon closed the connection\n");
+        return 0;
+    }
+    if (strncmp(Reply, "ok", 2) != 0)
+    {
+        (void)fprintf(stderr, "%s\n", strncmp(Reply, "err ", 4) == 0 ? Reply + 4 : Reply);
+        return 0;
+    }
+    return 1;
 }
 
 // argp option definitions
@@ -440,13 +3669,149 @@ static struct argp_option options[] = {{"mode", 'm', "MODE", 0, "Display mode (c
                                        {"color", 'c', "HEX", 0, "Background colour (RGB or RRGGBB)", 0},
                                        {"offset-x", 'x', "N", 0, "Horizontal offset (fill/center only)", 0},
                                        {"offset-y", 'y', "N", 0, "Vertical offset (fill/center only)", 0},
+                                       {"server-scale", 's', "N", 0,
+                                        "Upload at 1/N size and let XRender scale it (fill/max/scale only)", 0},
+                                       {"filter", 'f', "FILTER", 0, "Resampling filter (box/bilinear/bicubic/lanczos)",
+                                        0},
+                                       {"linear", 'L', 0, 0, "Resample in linear light (slower, truer contrast)", 0},
+                                       {"fade", 'F', "MS", 0, "Crossfade from the previous wallpaper", 0},
+                                       {"slideshow", 'S', "DIR", 0, "Cycle through the images in DIR", 0},
+                                       {"interval", 'i', "SECONDS", 0, "Time each slide stays up (slideshow only)",
+                                        0},
+                                       {"daemon", 'd', 0, 0, "Stay resident and serve later invocations", 0},
+                                       {"query", 'q', 0, 0, "Print the active configuration", 0},
+                                       {"trace", 'T', "FILE", 0, "Write a Chrome trace of each stage to FILE", 0},
+                                       {"output", 'o', "FILE", 0,
+                                        "Render to FILE (.ppm/.pam/.qoi) instead of the screen, without X", 0},
+                                       {"precompute", 'P', "DIR", 0,
+                                        "Render every image in DIR into the frame cache, without X", 0},
+                                       {"size", 'z', "WxH", 0, "Frame size to render (output/precompute only)", 0},
+                                       {"max-memory", 'M', "MB", 0,
+                                        "Decode within MB of memory, at reduced size if need be", 0},
                                        {0}};
 
-static error_t parse_opt(int Key, char *Arg, struct argp_state *State)
+// Options taking a number. Returns ARGP_ERR_UNKNOWN for any other key.
+static error_t parseValueOption(int Key, char *Arg, struct argp_state *State)
 {
     Arguments *Args = State->input;
     char *End;
 
+    switch (Key)
+    {
+    case 'x':
+        Args->OffsetX = (int)strtol(Arg, &End, 10);
+        if (*End != '\0')
+        {
+            argp_error(State, "Invalid X offset: %s", Arg);
+        }
+        Args->HasOffsetX = 1;
+        break;
+
+    case 'y':
+        Args->OffsetY = (int)strtol(Arg, &End, 10);
+        if (*End != '\0')
+        {
+            argp_error(State, "Invalid Y offset: %s", Arg);
+        }
+        Args->HasOffsetY = 1;
+        break;
+
+    case 's':
+        Args->ServerScale = (int)strtol(Arg, &End, 10);
+        if (*End != '\0' || Args->ServerScale < 1 || Args->ServerScale > SERVER_SCALE_MAX)
+        {
+            argp_error(State, "Server scale must be 1-%d: %s", SERVER_SCALE_MAX, Arg);
+        }
+        break;
+
+    case 'F':
+        Args->Fade = (int)strtol(Arg, &End, 10);
+        if (*End != '\0' || Args->Fade < 0 || Args->Fade > FADE_MAX_MS)
+        {
+            argp_error(State, "Fade must be 0-%d ms: %s", FADE_MAX_MS, Arg);
+        }
+        break;
+
+    case 'z': {
+        long Width = strtol(Arg, &End, 10);
+        long Height = 0;
+        if (*End == 'x')
+        {
+            Height = strtol(End + 1, &End, 10);
+        }
+        if (*End != '\0' || Width < 1 || Height < 1 || Width > OUTPUT_SIZE_MAX || Height > OUTPUT_SIZE_MAX)
+        {
+            argp_error(State, "Size must be WxH, each 1-%d: %s", OUTPUT_SIZE_MAX, Arg);
+        }
+        Args->OutputW = (int)Width;
+        Args->OutputH = (int)Height;
+        break;
+    }
+
+    case 'M':
+        Args->MaxMemory = (int)strtol(Arg, &End, 10);
+        if (*End != '\0' || Args->MaxMemory < 1 || Args->MaxMemory > MEMORY_MAX_MB)
+        {
+            argp_error(State, "Memory budget must be 1-%d MB: %s", MEMORY_MAX_MB, Arg);
+        }
+        break;
+
+    case 'i':
+        Args->SlideInterval = (int)strtol(Arg, &End, 10);
+        if (*End != '\0' || Args->SlideInterval < 1)
+        {
+            argp_error(State, "Invalid interval: %s", Arg);
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+// Reject option combinations that make no sense together.
+static void checkArguments(const Arguments *Args, struct argp_state *State)
+{
+    if (Args->Image && Args->SlideDir)
+    {
+        argp_error(State, "An image and --slideshow are mutually exclusive");
+    }
+    if (Args->SlideInterval && !Args->SlideDir)
+    {
+        argp_error(State, "--interval requires --slideshow");
+    }
+    if ((Args->OutputPath || Args->PrecomputeDir) && !Args->OutputW)
+    {
+        argp_error(State, "--output and --precompute need --size");
+    }
+    if (Args->OutputW && !Args->OutputPath && !Args->PrecomputeDir)
+    {
+        argp_error(State, "--size requires --output or --precompute");
+    }
+    if (Args->OutputPath && (Args->SlideDir || Args->PrecomputeDir || Args->Daemon || Args->Query))
+    {
+        argp_error(State, "--output renders a single image");
+    }
+    if (Args->PrecomputeDir && (Args->Image || Args->SlideDir || Args->Daemon || Args->Query))
+    {
+        argp_error(State, "--precompute takes a directory instead of an image");
+    }
+    if (Args->PrecomputeDir && Args->ServerScale > 1)
+    {
+        argp_error(State, "Server-scaled frames are not cached");
+    }
+    if (Args->MaxMemory && (Args->PrecomputeDir || Args->Daemon || Args->Query))
+    {
+        argp_error(State, "--max-memory applies to showing or rendering an image");
+    }
+}
+
+static error_t parse_opt(int Key, char *Arg, struct argp_state *State)
+{
+    Arguments *Args = State->input;
+
     switch (Key)
     {
     case 'm':
@@ -464,22 +3829,41 @@ static error_t parse_opt(int Key, char *Arg, struct argp_state *State)
         break;
     }
 
-    case 'x':
-        Args->OffsetX = (int)strtol(Arg, &End, 10);
-        if (*End != '\0')
-        {
-            argp_error(State, "Invalid X offset: %s", Arg);
-        }
-        Args->HasOffsetX = 1;
+    case 'f':
+        Args->FilterStr = Arg;
+        Args->HasFilter = 1;
         break;
 
-    case 'y':
-        Args->OffsetY = (int)strtol(Arg, &End, 10);
-        if (*End != '\0')
+    case 'L':
+        Args->Linear = 1;
+        break;
+
+    case 'S':
+        Args->SlideDir = Arg;
+        break;
+
+    case 'T':
+        Args->TracePath = Arg;
+        break;
+
+    case 'o':
+        if (imageFormatOf(Arg) == IF_None)
         {
-            argp_error(State, "Invalid Y offset: %s", Arg);
+            argp_error(State, "Output must end in .ppm, .pam or .qoi: %s", Arg);
         }
-        Args->HasOffsetY = 1;
+        Args->OutputPath = Arg;
+        break;
+
+    case 'P':
+        Args->PrecomputeDir = Arg;
+        break;
+
+    case 'd':
+        Args->Daemon = 1;
+        break;
+
+    case 'q':
+        Args->Query = 1;
         break;
 
     case ARGP_KEY_ARG:
@@ -490,8 +3874,12 @@ static error_t parse_opt(int Key, char *Arg, struct argp_state *State)
         Args->Image = Arg;
         break;
 
+    case ARGP_KEY_END:
+        checkArguments(Args, State);
+        break;
+
     default:
-        return ARGP_ERR_UNKNOWN;
+        return parseValueOption(Key, Arg, State);
     }
 
     return 0;
@@ -499,49 +3887,214 @@ static error_t parse_opt(int Key, char *Arg, struct argp_state *State)
 
 static struct argp argp = {options, parse_opt, args_doc, doc, NULL, NULL, NULL};
 
-// Main entry point
+// Print the active configuration, preferring the daemon's view.
+static int queryConfig(void)
+{
+    char Reply[IPC_LINE_MAX];
+    WallpaperConfig Cfg = {.Mode = WM_Fill, .Filter = SF_Bilinear};
+
+    int Sent = sendToDaemon("query\n", Reply, sizeof Reply);
+    if (Sent == 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (Sent > 0 ? !parseConfigFields(Reply + 3, &Cfg) : !loadConfig(&Cfg))
+    {
+        (void)fprintf(stderr, "No stored configuration\n");
+        return EXIT_FAILURE;
+    }
+
+    printConfig(stdout, &Cfg);
+    return EXIT_SUCCESS;
+}
+
+// Main entry point; wall-bench includes this file without it.
+#ifndef WALL_NO_MAIN
+// Build the config an image, slideshow or library run asks for. Returns 0
+// on an invalid combination, after saying why.
+static int configFromArgs(const Arguments *Args, WallpaperConfig *Cfg)
+{
+    if (Args->SlideDir)
+    {
+        if (!realpath(Args->SlideDir, Cfg->SlideDir))
+        {
+            die("realpath");
+        }
+        Cfg->SlideInterval = Args->SlideInterval ? Args->SlideInterval : SLIDE_INTERVAL_DEFAULT;
+    }
+    else if (Args->Image && !realpath(Args->Image, Cfg->Path))
+    {
+        die("realpath");
+    }
+
+    Cfg->Mode = Args->HasMode ? parseMode(Args->ModeStr) : WM_Fill;
+
+    if (Args->HasOffsetX || Args->HasOffsetY)
+    {
+        if (Cfg->Mode != WM_Fill && Cfg->Mode != WM_Center)
+        {
+            (void)fprintf(stderr, "Offset only valid for fill/center modes\n");
+            return 0;
+        }
+        Cfg->OffsetX = Args->OffsetX;
+        Cfg->OffsetY = Args->OffsetY;
+    }
+
+    if (Args->HasFilter && !findFilter(Args->FilterStr, &Cfg->Filter))
+    {
+        (void)fprintf(stderr, "Invalid filter: %s\nAllowed: box bilinear bicubic lanczos\n", Args->FilterStr);
+        return 0;
+    }
+
+    if (Args->ServerScale > 1)
+    {
+        if (Cfg->Mode == WM_Center || Cfg->Mode == WM_Tile)
+        {
+            (void)fprintf(stderr, "Server scaling only valid for fill/max/scale modes\n");
+            return 0;
+        }
+        Cfg->ServerScale = Args->ServerScale;
+    }
+
+    Cfg->Linear = Args->Linear;
+    Cfg->Fade = Args->Fade;
+    Cfg->MaxMemory = Args->MaxMemory ? Args->MaxMemory : storedMaxMemory();
+    return 1;
+}
+
+// Do what Args asks with the settled config. Returns the exit status.
+static int showConfig(const Arguments *Args, const WallpaperConfig *Cfg, AnimationKind Kind)
+{
+    // The budget prices each decode and frame, not buffers kept for reuse.
+    if (Cfg->MaxMemory)
+    {
+        pixbufSetCacheLimit(0);
+    }
+
+    if (Args->PrecomputeDir)
+    {
+        return precomputeLibrary(Cfg, Args->PrecomputeDir, Args->OutputW, Args->OutputH) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (Args->OutputPath)
+    {
+        if (Cfg->SlideDir[0])
+        {
+            (void)fprintf(stderr, "The stored configuration is a slideshow; give an image to render\n");
+            return EXIT_FAILURE;
+        }
+        return renderToFile(Cfg, Args->OutputPath, Args->OutputW, Args->OutputH) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (Cfg->SlideDir[0])
+    {
+        // Saved once the first slide is up.
+        return runSlideshow(Cfg);
+    }
+
+    if (Kind != AK_Still)
+    {
+        // Playback only ends on a signal; save first.
+        saveConfig(Cfg);
+        playWallpaper(Cfg, Kind);
+        return EXIT_SUCCESS;
+    }
+
+    traceBegin("setWallpaper");
+    setWallpaper(Cfg);
+    traceEnd();
+    traceBegin("saveConfig");
+    saveConfig(Cfg);
+    traceEnd();
+    return EXIT_SUCCESS;
+}
+
 int main(int Argc, char *Argv[])
 {
-    WallpaperConfig Cfg = {.Mode = WM_Fill};
+    WallpaperConfig Cfg = {.Mode = WM_Fill, .Filter = SF_Bilinear};
     strCopy(Cfg.BgColor, sizeof(Cfg.BgColor), "000000", strlen("000000"));
 
     Arguments Args = {0};
+    AnimationKind Kind = AK_Still;
+    char Request[IPC_LINE_MAX];
+    char Reply[IPC_LINE_MAX];
 
+    // Closed by the exit handler, so the span covers every return path.
+    traceBegin("main");
+    traceBegin("argp");
     argp_parse(&argp, Argc, Argv, 0, NULL, &Args);
+    traceEnd();
+    if (Args.TracePath && !traceOutput(Args.TracePath))
+    {
+        (void)fprintf(stderr, "Cannot write trace to %s\n", Args.TracePath);
+    }
+
+    if (Args.Daemon)
+    {
+        return runDaemon();
+    }
+    if (Args.Query)
+    {
+        return queryConfig();
+    }
 
     if (Args.Color)
     {
         strCopy(Cfg.BgColor, sizeof(Cfg.BgColor), Args.Color, strlen(Args.Color));
     }
 
-    if (Args.Image)
+    if (Args.Image || Args.SlideDir || Args.PrecomputeDir)
     {
-        if (!realpath(Args.Image, Cfg.Path))
+        if (!configFromArgs(&Args, &Cfg))
         {
-            die("realpath");
+            return EXIT_FAILURE;
         }
+        Kind = Args.Image ? animationKind(Cfg.Path) : AK_Still;
 
-        Cfg.Mode = Args.HasMode ? parseMode(Args.ModeStr) : WM_Fill;
-
-        if (Args.HasOffsetX || Args.HasOffsetY)
+        // Paths with separators can't be framed on the socket, the daemon
+        // doesn't play animations or slideshows, and it keeps decodes resident
+        // whatever the budget; handle those locally.
+        int Sent = -1;
+        if (Args.Image && !Args.OutputPath && !Cfg.MaxMemory && !strpbrk(Cfg.Path, "\t\n") && Kind == AK_Still)
         {
-            if (Cfg.Mode != WM_Fill && Cfg.Mode != WM_Center)
-            {
-                (void)fprintf(stderr, "Offset only valid for fill/center modes\n");
-                return EXIT_FAILURE;
-            }
-            Cfg.OffsetX = Args.OffsetX;
-            Cfg.OffsetY = Args.OffsetY;
+            strCopy(Request, sizeof Request, "set\t", strlen("set\t"));
+            (void)formatConfigFields(Request + 4, sizeof Request - 5, &Cfg);
+            strcat(Request, "\n");
+            traceBegin("daemon");
+            Sent = sendToDaemon(Request, Reply, sizeof Reply);
+            traceEnd();
+        }
+        if (Sent >= 0)
+        {
+            return Sent ? EXIT_SUCCESS : EXIT_FAILURE;
         }
     }
-    else if (!loadConfig(&Cfg))
+    else
     {
-        (void)fprintf(stderr, "No stored configuration\n");
-        argp_help(&argp, stderr, ARGP_HELP_STD_USAGE, Argv[0]);
-        return EXIT_FAILURE;
+        traceBegin("loadConfig");
+        int Loaded = loadConfig(&Cfg);
+        traceEnd();
+        if (Loaded && Args.MaxMemory)
+        {
+            Cfg.MaxMemory = Args.MaxMemory;
+        }
+        Kind = (Loaded && !Cfg.SlideDir[0]) ? animationKind(Cfg.Path) : AK_Still;
+        int Local = Args.OutputPath || (Loaded && (Cfg.SlideDir[0] || Cfg.MaxMemory || Kind != AK_Still));
+        traceBegin("daemon");
+        int Sent = Local ? -1 : sendToDaemon("restore\n", Reply, sizeof Reply);
+        traceEnd();
+        if (Sent >= 0)
+        {
+            return Sent ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (!Loaded)
+        {
+            (void)fprintf(stderr, "No stored configuration\n");
+            argp_help(&argp, stderr, ARGP_HELP_STD_USAGE, Argv[0]);
+            return EXIT_FAILURE;
+        }
     }
 
-    setWallpaper(&Cfg);
-    saveConfig(&Cfg);
-    return EXIT_SUCCESS;
+    return showConfig(&Args, &Cfg, Kind);
 }
+#endif // WALL_NO_MAIN